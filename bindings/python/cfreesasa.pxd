@@ -2,7 +2,7 @@ from libc.stdio cimport FILE
 
 cdef extern from "freesasa.h":
     ctypedef enum freesasa_algorithm:
-        FREESASA_LEE_RICHARDS, FREESASA_SHRAKE_RUPLEY
+        FREESASA_LEE_RICHARDS, FREESASA_SHRAKE_RUPLEY, FREESASA_ANALYTICAL
 
     ctypedef enum freesasa_verbosity:
         FREESASA_V_NORMAL, FREESASA_V_NOWARNINGS, FREESASA_V_SILENT, FREESASA_V_DEBUG
@@ -66,6 +66,12 @@ cdef extern from "freesasa.h":
                                          int n,
                                          const freesasa_parameters *parameters)
 
+    freesasa_result* freesasa_calc_coord_gradient(const double *xyz,
+                                                  const double *radii,
+                                                  int n,
+                                                  const freesasa_parameters *parameters,
+                                                  double *gradient)
+
     void freesasa_result_free(freesasa_result *result)
 
     freesasa_classifier* freesasa_classifier_from_file(FILE *file)
@@ -28,6 +28,9 @@ ShrakeRupley = 'ShrakeRupley'
 ## Used to specify the algorithm by Lee & Richards
 LeeRichards = 'LeeRichards'
 
+## Used to specify the exact analytical calculation
+Analytical = 'Analytical'
+
 ## Used for classification
 polar = 'Polar'
 
@@ -85,13 +88,16 @@ cdef class Parameters:
 
       ## Set algorithm.
       #
-      #  @param alg (str) algorithm name, only allowed values are ::ShrakeRupley and ::LeeRichards
+      #  @param alg (str) algorithm name, only allowed values are ::ShrakeRupley,
+      #    ::LeeRichards and ::Analytical
       #  @exception AssertionError unknown algorithm specified
       def setAlgorithm(self,alg):
             if alg == ShrakeRupley:
                   self._c_param.alg = FREESASA_SHRAKE_RUPLEY
             elif alg == LeeRichards:
                   self._c_param.alg = FREESASA_LEE_RICHARDS
+            elif alg == Analytical:
+                  self._c_param.alg = FREESASA_ANALYTICAL
             else:
                   raise AssertionError("Algorithm '%s' is unknown" % alg)
 
@@ -103,6 +109,8 @@ cdef class Parameters:
                   return ShrakeRupley
             if self._c_param.alg == FREESASA_LEE_RICHARDS:
                   return LeeRichards
+            if self._c_param.alg == FREESASA_ANALYTICAL:
+                  return Analytical
             raise Exception("No algorithm specified, shouldn't be possible")
 
       ## Set probe radius.
@@ -658,6 +666,49 @@ def calcCoord(coord, radii, parameters=None):
 
       return result
 
+## Calculate SASA and its gradient for a set of coordinates and radii
+#
+# The calculation always uses the analytical algorithm.
+# @param coord list of size 3*N with atomic coordinates (x1, y1, z1,
+#   x2, y2, z2, ..., x_N, y_N, z_N'.
+# @param radii array of size N with atomic radii (r_1, r_2, ..., r_N)
+# @param Parameters to use (if not specified, defaults are used)
+# @return A Result object, and a list of size 3*N with the
+#   derivatives of the total area with respect to the coordinates
+# @exception AssertionError: mismatched array-sizes
+# @exception Exception: Out of memory
+# @exception Exception: something went wrong in calculation (see C library error messages)
+def calcCoordGradient(coord, radii, parameters=None):
+      assert(len(coord) == 3*len(radii))
+
+      cdef const freesasa_parameters *p = NULL
+      cdef double *c = <double*> malloc(len(coord)*sizeof(double))
+      cdef double *r = <double*> malloc(len(radii)*sizeof(double))
+      cdef double *g = <double*> malloc(len(coord)*sizeof(double))
+      if c is NULL or r is NULL or g is NULL:
+            raise Exception("Memory allocation error")
+
+      for i in xrange(len(coord)):
+            c[i] = coord[i]
+      for i in xrange(len(radii)):
+            r[i] = radii[i]
+
+      if parameters is not None: parameters._get_address(<size_t>&p)
+
+      result = Result()
+      result._c_result = <freesasa_result*> freesasa_calc_coord_gradient(c, r, len(radii), p, g)
+
+      if result._c_result is NULL:
+            raise Exception("Error calculating SASA.")
+
+      gradient = [g[i] for i in xrange(len(coord))]
+
+      free(c)
+      free(r)
+      free(g)
+
+      return result, gradient
+
 ## Break SASA result down into classes.
 # @param result Result from sasa calculation.
 # @param structure Structure used in calculation.
@@ -31,6 +31,9 @@ class FreeSASATestCase(unittest.TestCase):
         self.assertTrue(p.algorithm() == ShrakeRupley)
         p.setAlgorithm(LeeRichards)
         self.assertTrue(p.algorithm() == LeeRichards)
+        p.setAlgorithm(Analytical)
+        self.assertTrue(p.algorithm() == Analytical)
+        p.setAlgorithm(LeeRichards)
         self.assertRaises(AssertionError,lambda: p.setAlgorithm(-10))
 
         p.setProbeRadius(1.5)
@@ -265,6 +268,21 @@ class FreeSASATestCase(unittest.TestCase):
         self.assertRaises(AssertionError,
                           lambda: calcCoord(radii, radii))
 
+    def testCalcCoordGradient(self):
+        # two spheres of radius 2 at distance 3, moving them apart
+        # increases the area by 2*pi*R per unit length
+        parameters = Parameters()
+        parameters.setProbeRadius(0)
+        result, gradient = calcCoordGradient([0,0,0, 3,0,0], [2,2], parameters)
+        self.assertTrue(math.fabs(result.totalArea() - (8*math.pi*4 - 4*math.pi*4 + 2*math.pi*2*3)) < 1e-10)
+        self.assertTrue(math.fabs(gradient[0] + 2*math.pi*2) < 1e-10)
+        self.assertTrue(math.fabs(gradient[3] - 2*math.pi*2) < 1e-10)
+        for i in (1,2,4,5):
+            self.assertTrue(math.fabs(gradient[i]) < 1e-10)
+
+        self.assertRaises(AssertionError,
+                          lambda: calcCoordGradient([0,0,0], [1,1]))
+
     def testSelectArea(self):
         structure = Structure("data/1ubq.pdb")
         result = calc(structure,Parameters({'algorithm' : ShrakeRupley}))
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <stdint.h>
 #include "freesasa_internal.h"
 #include "coord.h"
 
@@ -289,3 +290,79 @@ freesasa_coord_scale(coord_t *c,
         c->xyz[i] *= s;
     }
 }
+
+//! Spreads the 21 lowest bits of x to every third bit
+static inline uint64_t
+morton_spread(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8) & 0x100f00f00f00f00fULL;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2) & 0x1249249249249249ULL;
+    return x;
+}
+
+int
+freesasa_coord_morton_order(const coord_t *c,
+                            int *order)
+{
+    assert(c); assert(order);
+    const int n = c->n;
+    const double *v = c->xyz;
+    double min[3], max_extent = 0, scale;
+    uint64_t *key;
+    int *tmp;
+
+    if (n == 0) return FREESASA_SUCCESS;
+
+    key = malloc(sizeof(uint64_t)*n*2);
+    tmp = malloc(sizeof(int)*n);
+    if (!key || !tmp) {
+        free(key);
+        free(tmp);
+        return mem_fail();
+    }
+
+    for (int k = 0; k < 3; ++k) {
+        double max = min[k] = v[k];
+        for (int i = 1; i < n; ++i) {
+            min[k] = fmin(min[k], v[3*i+k]);
+            max = fmax(max, v[3*i+k]);
+        }
+        max_extent = fmax(max_extent, max - min[k]);
+    }
+    scale = max_extent > 0 ? 0x1fffff/max_extent : 0;
+
+    for (int i = 0; i < n; ++i) {
+        key[i] = morton_spread((uint64_t)((v[3*i] - min[0])*scale))
+            | morton_spread((uint64_t)((v[3*i+1] - min[1])*scale)) << 1
+            | morton_spread((uint64_t)((v[3*i+2] - min[2])*scale)) << 2;
+        order[i] = i;
+    }
+
+    // radix sort, one byte at a time
+    {
+        uint64_t *k_in = key, *k_out = key + n;
+        int *o_in = order, *o_out = tmp;
+        for (int shift = 0; shift < 63; shift += 8) {
+            int count[257] = {0};
+            for (int i = 0; i < n; ++i) ++count[((k_in[i] >> shift) & 0xff) + 1];
+            if (count[((k_in[0] >> shift) & 0xff) + 1] == n) continue;
+            for (int b = 0; b < 256; ++b) count[b+1] += count[b];
+            for (int i = 0; i < n; ++i) {
+                const int pos = count[(k_in[i] >> shift) & 0xff]++;
+                k_out[pos] = k_in[i];
+                o_out[pos] = o_in[i];
+            }
+            uint64_t *kt = k_in; k_in = k_out; k_out = kt;
+            int *ot = o_in; o_in = o_out; o_out = ot;
+        }
+        if (o_in != order) memcpy(order, o_in, sizeof(int)*n);
+    }
+
+    free(key);
+    free(tmp);
+    return FREESASA_SUCCESS;
+}
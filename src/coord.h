@@ -336,6 +336,25 @@ void
 freesasa_coord_scale(coord_t *coord,
                      double a);
 
+/**
+    Order the coordinates along a Morton (Z-order) curve.
+
+    The coordinates are mapped to a grid of 2^21 points along each
+    axis, and sorted by the index obtained by interleaving the bits
+    of the three grid coordinates. Coordinates that are close in
+    space are then usually close in the order.
+
+    @param coord A ::coord_t object
+    @param order Array where order[k] is set to the index of the k:th
+      coordinate along the curve. The user has to make sure it has
+      space for all coordinates.
+    @return ::FREESASA_SUCCESS. ::FREESASA_FAIL if memory allocation
+      failed.
+ */
+int
+freesasa_coord_morton_order(const coord_t *coord,
+                            int *order);
+
 #undef __attrib_pure__
 
 #endif
@@ -41,6 +41,14 @@ const freesasa_parameters freesasa_default_parameters = {
     .shrake_rupley_n_points = FREESASA_DEF_SR_N,
     .lee_richards_n_slices = FREESASA_DEF_LR_N,
     .n_threads = DEF_NUMBER_THREADS,
+    .shrake_rupley_kernel = FREESASA_SR_AUTO,
+    .shrake_rupley_point_set = FREESASA_SR_SPIRAL,
+    .shrake_rupley_tolerance = 0,
+    .precision = FREESASA_DOUBLE_PRECISION,
+    .lee_richards_kernel = FREESASA_LR_AUTO,
+    .lee_richards_tolerance = 0,
+    .atom_order = FREESASA_INPUT_ORDER,
+    .neighbor_storage = FREESASA_NB_FULL,
 };
 
 static freesasa_result *
@@ -75,11 +83,86 @@ freesasa_result_free(freesasa_result *r)
     }
 }
 
-freesasa_result*
-freesasa_calc(const coord_t *c, 
-              const double *radii,
-              const freesasa_parameters *parameters)
+static int
+calc_sasa(double *sasa,
+          const coord_t *c,
+          const double *radii,
+          const freesasa_parameters *parameters,
+          freesasa_verlet_list *verlet)
+{
+    switch(parameters->alg) {
+    case FREESASA_SHRAKE_RUPLEY:
+        return freesasa_shrake_rupley(sasa, c, radii, parameters, verlet);
+    case FREESASA_LEE_RICHARDS:
+        return freesasa_lee_richards(sasa, c, radii, parameters, verlet);
+    case FREESASA_ANALYTICAL:
+        return freesasa_analytical(sasa, c, radii, parameters, verlet);
+    default:
+        assert(0); //should never get here
+        return FREESASA_FAIL;
+    }
+}
 
+/**
+    Calculates SASA with the atoms sorted along a Morton curve, the
+    results are stored in the original order.
+ */
+static int
+calc_sasa_morton(double *sasa,
+                 const coord_t *c,
+                 const double *radii,
+                 const freesasa_parameters *parameters)
+{
+    const int n = freesasa_coord_n(c);
+    const double *v = freesasa_coord_all(c);
+    int *order = NULL;
+    double *xyz = NULL, *r = NULL, *s = NULL;
+    coord_t *sorted = NULL;
+    int ret = FREESASA_FAIL;
+
+    if (n == 0) return calc_sasa(sasa, c, radii, parameters, NULL);
+
+    order = malloc(sizeof(int)*n);
+    xyz = malloc(sizeof(double)*3*n);
+    r = malloc(sizeof(double)*n);
+    s = malloc(sizeof(double)*n);
+    if (!order || !xyz || !r || !s) {
+        mem_fail();
+        goto cleanup;
+    }
+    if (freesasa_coord_morton_order(c, order)) goto cleanup;
+
+    for (int k = 0; k < n; ++k) {
+        const int i = order[k];
+        xyz[3*k] = v[3*i];
+        xyz[3*k+1] = v[3*i+1];
+        xyz[3*k+2] = v[3*i+2];
+        r[k] = radii[i];
+    }
+    sorted = freesasa_coord_new_linked(xyz, n);
+    if (sorted == NULL) goto cleanup;
+
+    ret = calc_sasa(s, sorted, r, parameters, NULL);
+    for (int k = 0; k < n; ++k) sasa[order[k]] = s[k];
+
+ cleanup:
+    freesasa_coord_free(sorted);
+    free(order);
+    free(xyz);
+    free(r);
+    free(s);
+    return ret;
+}
+
+/**
+    Creates a result object for the coordinates. The atoms are
+    processed in input order if a Verlet list is used.
+ */
+static freesasa_result*
+calc_result(const coord_t *c,
+            const double *radii,
+            const freesasa_parameters *parameters,
+            freesasa_verlet_list *verlet)
 {
     assert(c);
     assert(radii);
@@ -94,15 +177,15 @@ freesasa_calc(const coord_t *c,
 
     if (parameters == NULL) parameters = &freesasa_default_parameters;
 
-    switch(parameters->alg) {
-    case FREESASA_SHRAKE_RUPLEY:
-        ret = freesasa_shrake_rupley(result->sasa, c, radii, parameters);
+    switch(verlet ? FREESASA_INPUT_ORDER : parameters->atom_order) {
+    case FREESASA_INPUT_ORDER:
+        ret = calc_sasa(result->sasa, c, radii, parameters, verlet);
         break;
-    case FREESASA_LEE_RICHARDS:
-        ret = freesasa_lee_richards(result->sasa, c, radii, parameters);
+    case FREESASA_MORTON_ORDER:
+        ret = calc_sasa_morton(result->sasa, c, radii, parameters);
         break;
     default:
-        assert(0); //should never get here
+        ret = fail_msg("illegal atom order %d", parameters->atom_order);
         break;
     }
     if (ret == FREESASA_FAIL) {
@@ -119,6 +202,14 @@ freesasa_calc(const coord_t *c,
     return result;
 }
 
+freesasa_result*
+freesasa_calc(const coord_t *c, 
+              const double *radii,
+              const freesasa_parameters *parameters)
+{
+    return calc_result(c, radii, parameters, NULL);
+}
+
 freesasa_result*
 freesasa_calc_coord(const double *xyz, 
                     const double *radii,
@@ -141,6 +232,71 @@ freesasa_calc_coord(const double *xyz,
     return result;
 }
 
+freesasa_result*
+freesasa_calc_coord_verlet(const double *xyz,
+                           const double *radii,
+                           int n,
+                           const freesasa_parameters *parameters,
+                           freesasa_verlet_list *verlet)
+{
+    assert(xyz);
+    assert(radii);
+    assert(verlet);
+    assert(n > 0);
+
+    coord_t *coord = NULL;
+    freesasa_result *result = NULL;
+
+    coord = freesasa_coord_new_linked(xyz,n);
+    if (coord != NULL) result = calc_result(coord, radii, parameters, verlet);
+    if (result == NULL) fail_msg("");
+
+    freesasa_coord_free(coord);
+
+    return result;
+}
+
+freesasa_result*
+freesasa_calc_coord_gradient(const double *xyz,
+                             const double *radii,
+                             int n,
+                             const freesasa_parameters *parameters,
+                             double *gradient)
+{
+    assert(xyz);
+    assert(radii);
+    assert(gradient);
+    assert(n > 0);
+
+    coord_t *coord = NULL;
+    freesasa_result *result = NULL;
+
+    if (parameters == NULL) parameters = &freesasa_default_parameters;
+
+    coord = freesasa_coord_new_linked(xyz,n);
+    if (coord != NULL) result = result_new(n);
+    if (result != NULL &&
+        freesasa_analytical_gradient(result->sasa, gradient, coord,
+                                     radii, parameters, NULL) == FREESASA_FAIL) {
+        freesasa_result_free(result);
+        result = NULL;
+    }
+    if (result == NULL) {
+        fail_msg("");
+    } else {
+        result->total = 0;
+        for (int i = 0; i < n; ++i) {
+            result->total += result->sasa[i];
+        }
+        result->parameters = *parameters;
+        result->parameters.alg = FREESASA_ANALYTICAL;
+    }
+
+    freesasa_coord_free(coord);
+
+    return result;
+}
+
 freesasa_result*
 freesasa_calc_structure(const freesasa_structure* structure,
                         const freesasa_parameters* parameters)
@@ -248,6 +404,8 @@ freesasa_alg_name(freesasa_algorithm alg)
         return "Shrake & Rupley";
     case FREESASA_LEE_RICHARDS:
         return "Lee & Richards";
+    case FREESASA_ANALYTICAL:
+        return "Analytical";
     }
     assert(0 && "Illegal algorithm");
 }
@@ -88,9 +88,167 @@ extern "C"{
 //! The FreeSASA algorithms. @ingroup core
 typedef enum {
     FREESASA_LEE_RICHARDS, //!< Lee & Richards' algorithm
-    FREESASA_SHRAKE_RUPLEY //!< Shrake & Rupley's algorithm
+    FREESASA_SHRAKE_RUPLEY, //!< Shrake & Rupley's algorithm
+    FREESASA_ANALYTICAL //!< Exact calculation using the Gauss-Bonnet theorem
 } freesasa_algorithm;
 
+/**
+    Kernels for the test-point occlusion check in Shrake & Rupley's
+    algorithm. The SIMD kernels test several test points against one
+    neighbor at a time and give results identical to the scalar
+    kernel. They are only available if the library was compiled with
+    SIMD support and the CPU supports the instruction set, otherwise
+    the scalar kernel is used (with a warning).
+
+    The cap kernel uses an alternative formulation where each neighbor
+    buries a spherical cap of the unit sphere, and a test point is
+    buried if its scalar product with the direction to the neighbor
+    exceeds a threshold. It is equivalent to the other kernels except
+    for round-off errors, i.e. test points that lie exactly on the
+    border of a cap can be classified differently.
+
+    The patch kernel also uses the cap formulation, but requires the
+    icosahedral test points (see ::freesasa_sr_point_set, falls back
+    on the cap kernel otherwise). Patches of test points that are
+    completely inside a cap are buried at once, and patches that are
+    not touched by any cap are exposed without testing the individual
+    points.
+
+    The lookup-table kernel quantizes the direction and size of each
+    cap, and takes the buried test points from a precomputed table of
+    bitmasks, the exposed points are those not in the union of the
+    masks. This makes the cost per neighbor independent of the number
+    of test points (except for the length of the masks), but the
+    result is only an approximation of the other kernels (typically
+    within 1 % for the total area). The table is built the first time
+    a given number of test points is used, and cached until the
+    program exits. It uses around 80 kB per test point (at most
+    256 MB, above that the quantization is coarser).
+
+    @ingroup core
+ */
+typedef enum {
+    FREESASA_SR_AUTO=0, //!< Fastest available of the SIMD and scalar kernels below
+    FREESASA_SR_SCALAR, //!< One test point at a time (reference implementation)
+    FREESASA_SR_AVX2, //!< 4 test points at a time, using AVX2
+    FREESASA_SR_AVX512, //!< 8 test points at a time, using AVX-512
+    FREESASA_SR_CAP, //!< Cap-threshold formulation, unit test points are never translated
+    FREESASA_SR_LUT, //!< Occlusion masks from lookup table (approximate)
+    FREESASA_SR_PATCH, //!< Cap-threshold formulation, tests whole patches of icosahedral test points first
+} freesasa_sr_kernel;
+
+/**
+    Kernels for the slice calculation in Lee & Richards' algorithm.
+    The SIMD kernels process several neighbors at a time, including
+    the square roots and the inverse trigonometric functions that
+    determine the buried arcs. They agree with the scalar kernel
+    within 1e-10 Å^2 per atom (the vectorized `acos()` and `atan2()`
+    are not rounded exactly like the standard library ones). They are
+    only available if the library was compiled with SIMD support and
+    the CPU supports the instruction set, otherwise the scalar kernel
+    is used (with a warning). In single precision (see
+    ::freesasa_precision) the scalar kernel is always used.
+
+    @ingroup core
+ */
+typedef enum {
+    FREESASA_LR_AUTO=0, //!< Fastest available of the kernels below
+    FREESASA_LR_SCALAR, //!< One neighbor at a time (reference implementation)
+    FREESASA_LR_AVX2, //!< 4 neighbors at a time, using AVX2
+    FREESASA_LR_AVX512, //!< 8 neighbors at a time, using AVX-512
+} freesasa_lr_kernel;
+
+/**
+    Distribution of test points in Shrake & Rupley's algorithm.
+
+    The golden section spiral gives exactly the requested number of
+    points. The icosahedral point set is a geodesic grid, obtained by
+    subdividing the faces of an icosahedron, and the number of points
+    is restricted to 10f^2 + 2 (12, 42, 92, 162, ..., 1002, ...), the
+    value closest to the requested number is used. The points are
+    grouped in patches with bounding caps, which allows the kernel
+    ::FREESASA_SR_PATCH to bury or expose whole patches at once.
+
+    @ingroup core
+ */
+typedef enum {
+    FREESASA_SR_SPIRAL=0, //!< Golden section spiral
+    FREESASA_SR_ICOSAHEDRAL, //!< Subdivided icosahedron, with patches
+} freesasa_sr_point_set;
+
+/**
+    Floating point precision of the SASA kernels.
+
+    In single precision the geometry of each atom and its neighbors is
+    represented as `float`, relative to the center of the atom, while
+    areas are still accumulated in double precision. This halves the
+    memory traffic of the inner loops and doubles the SIMD width. It
+    affects the L&R calculation and the S&R kernels
+    ::FREESASA_SR_AUTO, ::FREESASA_SR_SCALAR, ::FREESASA_SR_AVX2 and
+    ::FREESASA_SR_AVX512 (the other S&R kernels always use double
+    precision). The results differ from the double precision ones by
+    much less than the error of the approximations themselves, see
+    @ref Precision.
+
+    @ingroup core
+ */
+typedef enum {
+    FREESASA_DOUBLE_PRECISION=0, //!< Double precision (default)
+    FREESASA_SINGLE_PRECISION, //!< Single precision, with double precision accumulation
+} freesasa_precision;
+
+/**
+    Order in which the atoms are processed in the calculation.
+
+    With ::FREESASA_MORTON_ORDER the atoms are sorted along a Morton
+    (Z-order) curve before the calculation, see
+    freesasa_coord_morton_order(), and the results are then permuted
+    back. Neighboring atoms are then usually stored close to each
+    other, which makes better use of the CPU caches in large
+    structures. The order only affects the efficiency of the
+    calculation, not the results (apart from rounding errors).
+
+    @ingroup core
+ */
+typedef enum {
+    FREESASA_INPUT_ORDER=0, //!< The order of the input
+    FREESASA_MORTON_ORDER, //!< Along a Morton curve
+} freesasa_atom_order;
+
+/**
+    Storage of the neighbor list.
+
+    The neighbor list stores the distances between neighbors in the
+    xy-plane for L&R, and it is usually the largest allocation in
+    calculations for large structures. By default the distances are
+    stored for each neighbor of each atom, i.e. twice for every pair.
+    With ::FREESASA_NB_HALF they are stored once for every pair, which
+    reduces the memory of the list by almost 30%, at the cost of an
+    indirection each time the distances are read. In single precision
+    (::FREESASA_SINGLE_PRECISION) L&R stores the distances as float,
+    which reduces the memory of the list by another 30-40%. S&R and the
+    analytical calculation don't use the distances and don't store
+    them, unless a ::freesasa_verlet_list is used.
+
+    With ::FREESASA_NB_NONE no neighbor list is stored at all. Each
+    thread takes a block of the cells used to find neighbors, and
+    finds the neighbors of one atom at a time, right before its area
+    is calculated. The memory use is then proportional to the number
+    of atoms, not the number of pairs of neighbors. This applies to
+    S&R and L&R with per-atom slices, other calculations use a full
+    list.
+
+    The results are the same with all alternatives, apart from
+    rounding errors.
+
+    @ingroup core
+ */
+typedef enum {
+    FREESASA_NB_FULL=0, //!< Distances for each neighbor of each atom
+    FREESASA_NB_HALF, //!< Distances for each pair of atoms (only L&R)
+    FREESASA_NB_NONE, //!< No list, the neighbors are found when needed (S&R and L&R)
+} freesasa_nb_storage;
+
 //! Verbosity levels. @see freesasa_set_verbosity() @see freesasa_get_verbosity()
 typedef enum {
     FREESASA_V_NORMAL, //!< Print all errors and warnings.
@@ -181,6 +339,14 @@ typedef struct {
     int shrake_rupley_n_points;   //!< Number of test points in S&R calculation
     int lee_richards_n_slices;    //!< Number of slices per atom in L&R calculation
     int n_threads;                //!< Number of threads to use, if compiled with thread-support
+    freesasa_sr_kernel shrake_rupley_kernel; //!< Occlusion kernel in S&R calculation
+    freesasa_sr_point_set shrake_rupley_point_set; //!< Test-point distribution in S&R calculation
+    double shrake_rupley_tolerance; //!< Tolerance (Å^2 per atom) for adaptive resolution in S&R, 0 for fixed resolution
+    freesasa_precision precision; //!< Floating point precision of the calculation
+    freesasa_lr_kernel lee_richards_kernel; //!< Slice kernel in L&R calculation
+    double lee_richards_tolerance; //!< Tolerance (Å^2 per atom) for adaptive slicing in L&R, 0 for fixed slices
+    freesasa_atom_order atom_order; //!< Order in which atoms are processed
+    freesasa_nb_storage neighbor_storage; //!< Storage of the neighbor list
 } freesasa_parameters;
 
 //! The default parameters for FreeSASA @ingroup core
@@ -317,6 +483,180 @@ freesasa_calc_coord(const double *xyz,
                     int n,
                     const freesasa_parameters *parameters);
 
+/**
+    Calculates SASA and its gradient with respect to the coordinates.
+
+    The gradient of the total area is calculated analytically, and the
+    calculation therefore always uses ::FREESASA_ANALYTICAL, the
+    algorithm in the parameters is ignored. The gradient is obtained in
+    the same pass as the areas, and costs little extra.
+
+    Atoms with degenerate geometry (for example three spheres whose
+    surfaces intersect at one point) are calculated with L&R instead
+    and don't contribute to the gradient, a warning is printed if that
+    happens.
+
+    Return value is dynamically allocated, should be freed with
+    freesasa_result_free().
+
+    @param xyz Array of coordinates in the form x1,y1,z1,x2,y2,z2,...,xn,yn,zn.
+    @param radii Radii, this array should have n elements.
+    @param n Number of coordinates (i.e. xyz has size 3*n, radii size n).
+    @param parameters Parameters for the calculation, if `NULL`
+      defaults are used.
+    @param gradient The derivatives of the total area with respect to
+      the coordinates are written to this array, which should have 3*n
+      elements, in the same order as xyz.
+
+    @return The result of the calculation, `NULL` if something went wrong.
+
+    @ingroup core
+ */
+freesasa_result *
+freesasa_calc_coord_gradient(const double *xyz,
+                             const double *radii,
+                             int n,
+                             const freesasa_parameters *parameters,
+                             double *gradient);
+
+/**
+    Verlet list, neighbor lists that are reused between calculations
+    for successive frames of a trajectory.
+
+    @see freesasa_calc_coord_verlet()
+
+    @ingroup core
+ */
+typedef struct freesasa_verlet_list freesasa_verlet_list;
+
+/**
+    Creates a Verlet list.
+
+    The list stores all pairs of atoms that are closer than the sum of
+    their radii (including the probe radius) plus the skin. As long as
+    no atom has moved more than half the skin since the pairs were
+    found, the neighbors for new coordinates are among them. A larger
+    skin means that the pairs have to be found less often, but more
+    pairs have to be checked in each calculation. A skin of 1-2 Å is
+    reasonable for MD trajectories saved every few ps.
+
+    Should be freed with freesasa_verlet_list_free().
+
+    @param skin The skin in Ångström, should be >= 0.
+    @return The list, `NULL` if skin is negative or memory allocation
+      failed.
+
+    @ingroup core
+ */
+freesasa_verlet_list *
+freesasa_verlet_list_new(double skin);
+
+/**
+    Frees a Verlet list.
+
+    @param verlet The list, can be `NULL`.
+
+    @ingroup core
+ */
+void
+freesasa_verlet_list_free(freesasa_verlet_list *verlet);
+
+/**
+    The number of times the pairs of a Verlet list have been searched
+    for.
+
+    @param verlet The list
+    @return The number of searches.
+
+    @ingroup core
+ */
+int
+freesasa_verlet_list_n_builds(const freesasa_verlet_list *verlet);
+
+/**
+    Calculates SASA for one frame of a trajectory.
+
+    Same as freesasa_calc_coord(), but the neighbor lists are taken
+    from a Verlet list, which is updated for the new coordinates. The
+    pairs of neighbors are only searched for if an atom has moved more
+    than half the skin since the last search, or the radii, the probe
+    radius or the number of atoms have changed. The results are the
+    same as with freesasa_calc_coord(), apart from rounding errors.
+    The atoms are always processed in the input order,
+    ::freesasa_parameters.atom_order is ignored.
+
+    @param xyz Array of coordinates in the form x1,y1,z1,x2,y2,z2,...,xn,yn,zn.
+    @param radii Radii, this array should have n elements.
+    @param n Number of coordinates (i.e. xyz has size 3*n, radii size n).
+    @param parameters Parameters for the calculation, if `NULL`
+      defaults are used.
+    @param verlet A Verlet list, the same one should be used for all
+      frames of a trajectory.
+
+    @return The result of the calculation, `NULL` if something went wrong.
+
+    @ingroup core
+ */
+freesasa_result *
+freesasa_calc_coord_verlet(const double *xyz,
+                           const double *radii,
+                           int n,
+                           const freesasa_parameters *parameters,
+                           freesasa_verlet_list *verlet);
+
+/**
+    Creates the thread pool of the library.
+
+    Without a pool, each calculation with
+    ::freesasa_parameters.n_threads > 1 starts and stops its own
+    threads. When many small structures are processed, that can take
+    as long as the calculations themselves. Once a pool has been
+    created, all calculations, including the construction of neighbor
+    lists, run on its threads instead. The thread that starts a
+    calculation is one of the n_threads threads of the pool.
+
+    ::freesasa_parameters.n_threads still decides how the work is
+    divided, and should normally be the same as n_threads. If the pool
+    is in use by a calculation in another thread, new threads are
+    started as without a pool.
+
+    A pool that already exists is destroyed first. This function and
+    freesasa_thread_pool_destroy() can be called while calculations
+    are running in other threads, a calculation that uses the pool is
+    then allowed to finish before the pool is destroyed.
+
+    @param n_threads Number of threads, >= 1.
+    @return ::FREESASA_SUCCESS. ::FREESASA_FAIL if n_threads is
+      invalid, or if memory allocation or thread creation failed, then
+      there is no pool. ::FREESASA_WARN if the library was compiled
+      without thread support.
+
+    @ingroup core
+ */
+int
+freesasa_thread_pool_create(int n_threads);
+
+/**
+    Stops the threads of the pool created by
+    freesasa_thread_pool_create(). Does nothing if there is no pool.
+    If a calculation in another thread uses the pool, this waits until
+    it has finished.
+
+    @ingroup core
+ */
+void
+freesasa_thread_pool_destroy(void);
+
+/**
+    The number of threads in the thread pool.
+
+    @return The number of threads, 0 if there is no pool.
+
+    @ingroup core
+ */
+int
+freesasa_thread_pool_n_threads(void);
+
 /**
     Calculates SASA for a structure and returns as a tree of
     ::freesasa_node.
@@ -29,6 +29,8 @@ extern const freesasa_nodearea freesasa_nodearea_null;
     @param radii Array of radii for each sphere.
     @param param Parameters specifying resolution, probe radius and
     number of threads. If NULL :.freesasa_default_parameters is used.
+    @param verlet Verlet list to take the neighbors from, if NULL the
+    neighbor list is calculated from scratch.
     @return ::FREESASA_SUCCESS on success, ::FREESASA_WARN if multiple
     threads are requested when compiled in single-threaded mode (with
     error message). ::FREESASA_FAIL if memory allocation failure.
@@ -37,7 +39,8 @@ int
 freesasa_shrake_rupley(double *sasa,
                        const coord_t *c,
                        const double *radii,
-                       const freesasa_parameters *param);
+                       const freesasa_parameters *param,
+                       freesasa_verlet_list *verlet);
 
 /**
     Calculate SASA using L&R algorithm.
@@ -55,6 +58,8 @@ freesasa_shrake_rupley(double *sasa,
     @param radii Array of radii for each sphere.
     @param param Parameters specifying resolution, probe radius and
     number of threads. If NULL :.freesasa_default_parameters is used.
+    @param verlet Verlet list to take the neighbors from, if NULL the
+    neighbor list is calculated from scratch.
     @return ::FREESASA_SUCCESS on success, ::FREESASA_WARN if
     multiple threads are requested when compiled in single-threaded
     mode (with error message). ::FREESASA_FAIL if memory allocation 
@@ -63,13 +68,68 @@ freesasa_shrake_rupley(double *sasa,
 int freesasa_lee_richards(double* sasa,
                           const coord_t *c,
                           const double *radii,
-                          const freesasa_parameters *param);
+                          const freesasa_parameters *param,
+                          freesasa_verlet_list *verlet);
+
+/**
+    Calculate SASA analytically.
+
+    The exposed area of each sphere is calculated exactly from the
+    arcs that bound it, using the Gauss-Bonnet theorem. Spheres where
+    the arcs can't be determined reliably, because three circles
+    intersect at one point or similar, are calculated using high
+    resolution L&R instead.
+
+    @param sasa The results are written to this array, the user has to
+    make sure it is large enough.
+    @param c Coordinates of the object to calculate SASA for.
+    @param radii Array of radii for each sphere.
+    @param param Parameters specifying probe radius and number of
+    threads. If NULL :.freesasa_default_parameters is used.
+    @param verlet Verlet list to take the neighbors from, if NULL the
+    neighbor list is calculated from scratch.
+    @return ::FREESASA_SUCCESS on success, ::FREESASA_WARN if
+    multiple threads are requested when compiled in single-threaded
+    mode (with error message). ::FREESASA_FAIL if memory allocation 
+    failure.
+ */
+int freesasa_analytical(double* sasa,
+                        const coord_t *c,
+                        const double *radii,
+                        const freesasa_parameters *param,
+                        freesasa_verlet_list *verlet);
+
+/**
+    Same as freesasa_analytical(), but also calculates the gradient of
+    the total area with respect to the coordinates.
+
+    @param sasa The results are written to this array.
+    @param gradient The gradient is written to this array, 3 elements
+    per atom.
+    @param c Coordinates of the object to calculate SASA for.
+    @param radii Array of radii for each sphere.
+    @param param Parameters specifying probe radius and number of
+    threads. If NULL :.freesasa_default_parameters is used.
+    @param verlet Verlet list to take the neighbors from, if NULL the
+    neighbor list is calculated from scratch.
+    @return ::FREESASA_SUCCESS on success, ::FREESASA_WARN if
+    multiple threads are requested when compiled in single-threaded
+    mode, or if some atoms had degenerate geometry and are missing in
+    the gradient (with error message). ::FREESASA_FAIL if memory
+    allocation failure.
+ */
+int freesasa_analytical_gradient(double *sasa,
+                                 double *gradient,
+                                 const coord_t *c,
+                                 const double *radii,
+                                 const freesasa_parameters *param,
+                                 freesasa_verlet_list *verlet);
 
 /**
     Calculate SASA based on a coordinate object, radii and parameters
 
-    Wrapper for freesasa_lee_richards() and freesasa_shrake_rupley()
-    that creates a result object.
+    Wrapper for freesasa_lee_richards(), freesasa_shrake_rupley() and
+    freesasa_analytical() that creates a result object.
 
     Return value is dynamically allocated, should be freed with
     freesasa_result_free().
@@ -358,6 +418,16 @@ freesasa_fail(const char *format,...);
 int
 freesasa_warn(const char *format,...);
 
+/**
+    Print debug message using format string and arguments, only if
+    verbosity is ::FREESASA_V_DEBUG.
+
+    @param format Format string
+    @return ::FREESASA_SUCCESS
+ */
+int
+freesasa_debug(const char *format,...);
+
 /**
     Print warning message using function, file and line-number. 
 
@@ -382,6 +452,65 @@ freesasa_mem_fail(const char* file,
 const char*
 freesasa_thread_error(int error_code);
 
+/**
+    Runs a set of tasks in parallel and waits for them to finish.
+
+    Task t is called with the argument args + t*arg_size, i.e.
+    element t of an array of structs. The tasks run on the thread pool
+    if there is one (see freesasa_thread_pool_create()), otherwise a
+    thread is created for each task. The tasks should return NULL,
+    and not call pthread_exit(). Only available if the library is
+    compiled with thread support.
+
+    @param n_tasks Number of tasks
+    @param task The function to run
+    @param args Array of arguments
+    @param arg_size Size of each element of args
+    @return ::FREESASA_SUCCESS. ::FREESASA_FAIL if threads could not be
+      created or joined, then not all tasks have been run.
+ */
+int
+freesasa_thread_run(int n_tasks,
+                    void *(*task)(void *),
+                    void *args,
+                    size_t arg_size);
+
+/**
+    Processes a range of atoms in parallel, with dynamic load balancing.
+
+    The atoms are divided into chunks of roughly equal cost, where the
+    cost of an atom is estimated as its number of neighbors plus one
+    (or one if it is skipped). Each thread starts with a contiguous
+    range of the chunks, with its share of the total cost, and when
+    it is done it takes chunks from the threads that have most left.
+    Only available if the library is compiled with thread support.
+
+    @param n_threads Number of threads
+    @param n_atoms Number of atoms, >= n_threads
+    @param nn Number of neighbors of each atom, or NULL if the atoms
+      have the same cost
+    @param skip Array where skip[i] != 0 if atom i is cheap (e.g.
+      buried), or NULL
+    @param range Function that processes the atoms first to end-1,
+      called with the data of the thread
+    @param data Array with the data of each thread
+    @param data_size Size of each element of data, 0 if all threads
+      share the same data
+    @param imbalance If not NULL, the load imbalance is stored here:
+      the time of the slowest thread divided by the mean.
+    @return ::FREESASA_SUCCESS. ::FREESASA_FAIL if threads could not
+      be created or joined.
+ */
+int
+freesasa_thread_run_atoms(int n_threads,
+                          int n_atoms,
+                          const int *nn,
+                          const char *skip,
+                          void (*range)(void *data, int first, int end),
+                          void *data,
+                          size_t data_size,
+                          double *imbalance);
+
 /**
     Prints fail message with function name, file name, and line number.
 
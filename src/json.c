@@ -200,6 +200,9 @@ parameters2json(const freesasa_parameters *p)
     case FREESASA_LEE_RICHARDS:
         res = json_object_new_int(p->lee_richards_n_slices);
         break;
+    case FREESASA_ANALYTICAL:
+        res = json_object_new_int(0);
+        break;
     default:
         assert(0);
         break;
@@ -124,14 +124,28 @@ write_parameters(FILE *log,
     switch(p->alg) {
     case FREESASA_SHRAKE_RUPLEY:
         fprintf(log,"testpoints   : %d\n",p->shrake_rupley_n_points);
+        if (p->shrake_rupley_tolerance > 0)
+            fprintf(log,"tolerance    : %g\n",p->shrake_rupley_tolerance);
         break;
     case FREESASA_LEE_RICHARDS:
         fprintf(log,"slices       : %d\n",p->lee_richards_n_slices);
+        if (p->lee_richards_tolerance > 0)
+            fprintf(log,"tolerance    : %g\n",p->lee_richards_tolerance);
+        if (p->neighbor_storage == FREESASA_NB_HALF)
+            fprintf(log,"neighbors    : half\n");
+        break;
+    case FREESASA_ANALYTICAL:
         break;
     default:
         assert(0);
         break;
     }
+    if (p->precision == FREESASA_SINGLE_PRECISION)
+        fprintf(log,"precision    : single\n");
+    if (p->atom_order == FREESASA_MORTON_ORDER)
+        fprintf(log,"atom order   : morton\n");
+    if (p->neighbor_storage == FREESASA_NB_NONE && p->alg != FREESASA_ANALYTICAL)
+        fprintf(log,"neighbors    : none\n");
 
     fflush(log);
     if (ferror(log)) {
@@ -34,13 +34,19 @@ static char *program_name = "freesasa";
 
 #define FORMAT_STRING "log|res|seq|pdb|rsa" XML_STRING JSON_STRING
 
-enum {B_FILE, SELECT, UNKNOWN, RSA, RADII, DEPRECATED};
+// maximum resolution with --sr-tolerance if no resolution is given
+#define SR_TOLERANCE_DEF_N 1000
+// maximum resolution with --lr-tolerance if no resolution is given
+#define LR_TOLERANCE_DEF_N 1000
+
+enum {B_FILE, SELECT, UNKNOWN, RSA, RADII, DEPRECATED, SR_TOLERANCE, SINGLE_PRECISION, LR_TOLERANCE};
 
 static int option_flag;
 
 static struct option long_options[] = {
     {"lee-richards",         no_argument,       0, 'L'},
     {"shrake-rupley",        no_argument,       0, 'S'},
+    {"analytical",           no_argument,       0, 'A'},
     {"probe-radius",         required_argument, 0, 'p'},
     {"resolution",           required_argument, 0, 'n'},
     {"help",                 no_argument,       0, 'h'},
@@ -64,6 +70,9 @@ static struct option long_options[] = {
     {"rsa",                  no_argument,       &option_flag, RSA},
     {"radii",                required_argument, &option_flag, RADII},
     {"deprecated",           no_argument,       &option_flag, DEPRECATED},
+    {"sr-tolerance",         required_argument, &option_flag, SR_TOLERANCE},
+    {"lr-tolerance",         required_argument, &option_flag, LR_TOLERANCE},
+    {"single-precision",     no_argument,       &option_flag, SINGLE_PRECISION},
     // Deprecated options
     {"foreach-residue-type", no_argument,       0, 'r'},
     {"foreach-residue",      no_argument,       0, 'R'},
@@ -72,7 +81,7 @@ static struct option long_options[] = {
     {0,0,0,0}
 };
 
-#define NOARG_OPTIONS "hvwLSHYOCMm"
+#define NOARG_OPTIONS "hvwLSAHYOCMm"
 #define NOARG_DEPRECATED "BrRl"
 #define ARG_OPTIONS "c:n:t:p:g:e:o:f:"
 const char* options_string = ":" NOARG_OPTIONS NOARG_DEPRECATED ARG_OPTIONS;
@@ -162,8 +171,9 @@ help(void)
     printf("\n       %s [options] < pdb-file", program_name);
     printf("\n       %s (-h | --help | -v | --version | --deprecated)\n", program_name);
     printf("\n"
-           "Options: [--shrake-rupley | --lee-richards] --probe-radius=FLOAT\n"
-           "  --resolution=INTEGER -n-threads=INTEGER\n"
+           "Options: [--shrake-rupley | --lee-richards | --analytical]\n"
+           "  --probe-radius=FLOAT --resolution=INTEGER --sr-tolerance=FLOAT\n"
+           "  --lr-tolerance=FLOAT --single-precision -n-threads=INTEGER\n"
            "  [--radius-from-occupancy | --config-file FILE | --radii=(protor|naccess)]\n"
            "  --hetatm --hydrogen [--separate-models | --join-models] [--separate-chains |\n"
            "  --chain-groups=STRING...] --unknown=(guess|skip|halt)\n"
@@ -172,10 +182,21 @@ help(void)
            "  --depth=(structure|chain|residue|atom)\n");
     printf("\nPARAMETERS\n"
            "  -S --shrake-rupley           Use Shrake & Rupley algorithm\n"
-           "  -L --lee-richards            Use Lee & Richards algorithm [default]\n");
+           "  -L --lee-richards            Use Lee & Richards algorithm [default]\n"
+           "  -A --analytical              Exact calculation, no resolution parameter\n");
     printf("  -p R --probe-radius=R        [default: %4.2f Å]\n"
            "  -n N --resolution=N          [S&R default: %d] [L&R default: %d]\n",
            FREESASA_DEF_PROBE_RADIUS, FREESASA_DEF_SR_N, FREESASA_DEF_LR_N);
+    printf("  --sr-tolerance=T             Adaptive S&R resolution, with the resolution\n"
+           "                               as maximum (at least 256, default %d) and\n"
+           "                               estimated error T Å^2 per atom\n",
+           SR_TOLERANCE_DEF_N);
+    printf("  --lr-tolerance=T             Adaptive L&R slicing, with the resolution as\n"
+           "                               maximum (default %d) and estimated error\n"
+           "                               T Å^2 per atom\n",
+           LR_TOLERANCE_DEF_N);
+    printf("  --single-precision           Calculate in single precision (faster, with\n"
+           "                               negligible loss of accuracy)\n");
     if (USE_THREADS) {
         printf(
            "  -t N --n-threads=N           [default: %d]\n",
@@ -571,6 +592,19 @@ parse_arg(int argc, char **argv, struct cli_state *state)
             case DEPRECATED:
                 deprecated();
                 exit(EXIT_SUCCESS);
+            case SR_TOLERANCE:
+                state->parameters.shrake_rupley_tolerance = atof(optarg);
+                if (state->parameters.shrake_rupley_tolerance <= 0)
+                    abort_msg("S&R tolerance must be larger than 0");
+                break;
+            case LR_TOLERANCE:
+                state->parameters.lee_richards_tolerance = atof(optarg);
+                if (state->parameters.lee_richards_tolerance <= 0)
+                    abort_msg("L&R tolerance must be larger than 0");
+                break;
+            case SINGLE_PRECISION:
+                state->parameters.precision = FREESASA_SINGLE_PRECISION;
+                break;
             default:
                 abort(); // what does this even mean?
             }
@@ -621,6 +655,10 @@ parse_arg(int argc, char **argv, struct cli_state *state)
             state->parameters.alg = FREESASA_LEE_RICHARDS;
             ++alg_set;
             break;
+        case 'A':
+            state->parameters.alg = FREESASA_ANALYTICAL;
+            ++alg_set;
+            break;
         case 'p':
             state->parameters.probe_radius = atof(optarg);
             if (state->parameters.probe_radius <= 0)
@@ -688,6 +726,16 @@ parse_arg(int argc, char **argv, struct cli_state *state)
     }
     if (state->output == NULL) state->output = stdout;
     if (alg_set > 1) abort_msg("multiple algorithms specified");
+    if (state->parameters.shrake_rupley_tolerance > 0) {
+        if (state->parameters.alg != FREESASA_SHRAKE_RUPLEY)
+            abort_msg("the option --sr-tolerance can only be used with -S");
+        if (!opt_set['n']) state->parameters.shrake_rupley_n_points = SR_TOLERANCE_DEF_N;
+    }
+    if (state->parameters.lee_richards_tolerance > 0) {
+        if (state->parameters.alg != FREESASA_LEE_RICHARDS)
+            abort_msg("the option --lr-tolerance can only be used with -L");
+        if (!opt_set['n']) state->parameters.lee_richards_n_slices = LR_TOLERANCE_DEF_N;
+    }
     if (state->output_format == 0) state->output_format = FREESASA_LOG;
     if (opt_set['m'] && opt_set['M']) abort_msg("the options -m and -M can't be combined");
     if (opt_set['g'] && opt_set['C']) abort_msg("the options -g and -C can't be combined");
@@ -721,6 +769,11 @@ main(int argc,
     init_state(&state);
 
     optind = parse_arg(argc, argv, &state);
+
+    // the threads are reused for all structures in all files
+    if (USE_THREADS && state.parameters.n_threads > 1) {
+        freesasa_thread_pool_create(state.parameters.n_threads);
+    }
     
     if (argc > optind) {
         for (int i = optind; i < argc; ++i) {
@@ -741,6 +794,7 @@ main(int argc,
 
     freesasa_tree_export(state.output, tree, state.output_format | state.output_depth | (state.no_rel ? FREESASA_OUTPUT_SKIP_REL : 0));
     freesasa_node_free(tree);
+    freesasa_thread_pool_destroy();
 
     release_state(&state);
 
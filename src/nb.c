@@ -2,30 +2,41 @@
 # include <config.h>
 #endif
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <stdint.h>
 #include "freesasa_internal.h"
 #include "nb.h"
 
-#ifndef FREESASA_NB_CHUNK
-#define FREESASA_NB_CHUNK 128
-#endif
+// the arrays of the neighbor list are aligned to this many doubles (one cache line)
+#define NB_ALIGN 8
+
+/* A sparse cell grid, where only the occupied cells are stored, is
+   used if the dense grid over the bounding box would have more than
+   this many cells per atom, or use more than NB_DENSE_MAX_BYTES. */
+#define NB_SPARSE_CELLS_PER_ATOM 8
+#define NB_DENSE_MAX_BYTES ((double)(1 << 28))
+
+// the neighbor list is only built in parallel if each thread gets at least this many atoms
+#define NB_ATOMS_PER_THREAD 2000
 
 typedef struct cell cell;
 struct cell {
-    cell *nb[17]; //! includes self, only forward neighbors
-    int *atom; //! indices of the atoms/coordinates in a cell
+    cell *nb[14]; //! includes self, only forward neighbors
+    cell *bnb[13]; //! backward neighbors, only used by ::nb_search
+    int *atom; //! indices of the atoms/coordinates in a cell (points into cell_list::atom)
     int n_nb; //! number of neighbors to cell
+    int n_bnb; //! number of backward neighbors
     int n_atoms; //! number of atoms in cell
 };
 
-static cell empty_cell = {{NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,
-                           NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL},
-                          NULL, 0, 0};
+static cell empty_cell = {{NULL}, {NULL}, NULL, 0, 0, 0};
 
 //! cell lists, divide space into boxes
 typedef struct cell_list {
     cell *cell; //! the cells
+    int *atom; //! all atoms, sorted by cell
     int n; //! number of cells
     int nx, ny, nz; //! number of cells along each axis
     double d; //! cell size
@@ -34,7 +45,7 @@ typedef struct cell_list {
     double z_max, z_min;
 } cell_list;
 
-static struct cell_list empty_cell_list = {NULL,0,0,0,0,0,0,0,0,0,0,0};
+static struct cell_list empty_cell_list = {NULL,NULL,0,0,0,0,0,0,0,0,0,0,0};
 
 //! Finds the bounds of the cell list and writes them to the provided cell list
 static void
@@ -63,7 +74,6 @@ cell_list_bounds(cell_list *c,
     c->nx = ceil((c->x_max - c->x_min)/d);
     c->ny = ceil((c->y_max - c->y_min)/d);
     c->nz = ceil((c->z_max - c->z_min)/d);
-    c->n = c->nx*c->ny*c->nz;
 }
 
 static inline int
@@ -95,12 +105,14 @@ fill_nb(cell_list *c,
     for (int i = xmin; i <= xmax; ++i) {
         for (int j = ymin; j <= ymax; ++j) {
             for (int k = zmin; k <= zmax; ++k) {
-                /* Scalar product between (i-ix,j-iy,k-iz) and (1,1,1) should
-                   be non-negative. Using only forward neighbors means
+                /* The offset (i-ix,j-iy,k-iz) should be lexicographically
+                   non-negative. Using only forward neighbors means
                    there's no double counting when comparing cells */
-                if (i-ix+j-iy+k-iz >= 0) { 
+                if (i > ix || (i == ix && (j > iy || (j == iy && k >= iz)))) {
                     cell->nb[n] = &c->cell[cell_index(c,i,j,k)];
                     ++n;
+                } else {
+                    cell->bnb[cell->n_bnb++] = &c->cell[cell_index(c,i,j,k)];
                 }
             }
         }
@@ -122,69 +134,256 @@ get_nb(cell_list *c)
     }
 }
 
+//! Get the cell coordinates of a given atom
+static inline void
+coord2cell_xyz(const cell_list *c,
+               const double * restrict xyz,
+               int *ix,
+               int *iy,
+               int *iz)
+{
+    double d = c->d;
+    *ix = (int)((xyz[0] - c->x_min)/d);
+    *iy = (int)((xyz[1] - c->y_min)/d);
+    *iz = (int)((xyz[2] - c->z_min)/d);
+}
+
 //! Get the cell index of a given atom
 static int
 coord2cell_index(const cell_list *c,
                  const double * restrict xyz)
 {
-    double d = c->d;
-    int ix = (int)((xyz[0] - c->x_min)/d);
-    int iy = (int)((xyz[1] - c->y_min)/d);
-    int iz = (int)((xyz[2] - c->z_min)/d);
+    int ix, iy, iz;
+    coord2cell_xyz(c,xyz,&ix,&iy,&iz);
     return cell_index(c,ix,iy,iz);
 }
 
 /**
-   Assigns cells to each coordinate. Returns FREESASA_FAIL if realloc
+   Assigns cells to each coordinate, using a counting sort: the atoms
+   in each cell are counted, and then stored contiguously in
+   cell_list::atom, ordered by cell. Returns FREESASA_FAIL if malloc
    fails, FREESASA_SUCCESS else.
  */
 static int
 fill_cells(cell_list *c,
            const coord_t *coord)
 {
+    const int n = freesasa_coord_n(coord);
+    int pos = 0;
+
+    c->atom = malloc(sizeof(int)*n);
+    if (!c->atom) return mem_fail();
+
     for (int i = 0; i < c->n; ++i) {
         c->cell[i].n_atoms = 0;
     }
-    for (int i = 0; i < freesasa_coord_n(coord); ++i) {
-        const double * restrict v = freesasa_coord_i(coord,i);
-        cell *cell;
-        int *a;
-        cell = &c->cell[coord2cell_index(c,v)];
-        ++cell->n_atoms;
-        a = cell->atom;
-        cell->atom = realloc(cell->atom,sizeof(int)*cell->n_atoms);
-        if (!cell->atom) { cell->atom = a; return mem_fail(); }
-        cell->atom[cell->n_atoms-1] = i;
+    for (int i = 0; i < n; ++i) {
+        ++c->cell[coord2cell_index(c,freesasa_coord_i(coord,i))].n_atoms;
+    }
+    for (int i = 0; i < c->n; ++i) {
+        c->cell[i].atom = c->atom + pos;
+        pos += c->cell[i].n_atoms;
+        c->cell[i].n_atoms = 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        cell *cell = &c->cell[coord2cell_index(c,freesasa_coord_i(coord,i))];
+        cell->atom[cell->n_atoms++] = i;
     }
     return FREESASA_SUCCESS;
 }
 
+/**
+   Hash table from the linear index of an occupied cell in the dense
+   grid (the key) to its index in a sparse grid (the value). Uses
+   open addressing with linear probing, empty slots have value -1.
+ */
+typedef struct {
+    int64_t *key;
+    int *value;
+    int size; //! a power of 2
+} cell_hash;
+
+//! The slot where key is stored, or the empty slot where it should be stored
+static int
+cell_hash_slot(const cell_hash *h,
+               int64_t key)
+{
+    const int mask = h->size - 1;
+    int s = (int)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    while (h->value[s] >= 0 && h->key[s] != key) s = (s + 1) & mask;
+    return s;
+}
+
+//! Linear index of a cell in the dense grid, without overflow
+static inline int64_t
+cell_key(const cell_list *c,
+         int ix,
+         int iy,
+         int iz)
+{
+    return ix + c->nx*(iy + (int64_t)c->ny*iz);
+}
+
+static int
+compare_key(const void *a,
+            const void *b)
+{
+    const int64_t ka = *(const int64_t*)a, kb = *(const int64_t*)b;
+    return (ka > kb) - (ka < kb);
+}
+
+/**
+   Fill the neighbor list for a cell in a sparse grid. Same as
+   fill_nb(), but only occupied cells are included.
+ */
+static void
+fill_nb_sparse(cell_list *c,
+               const cell_hash *h,
+               cell *cell,
+               int64_t key)
+{
+    const int ix = key % c->nx, iy = (key / c->nx) % c->ny, iz = key / ((int64_t)c->nx*c->ny);
+    int n = 0;
+    int xmin = ix > 0 ? ix - 1 : 0;
+    int xmax = ix < c->nx - 1 ? ix + 1 : ix;
+    int ymin = iy > 0 ? iy - 1 : 0;
+    int ymax = iy < c->ny - 1 ? iy + 1 : iy;
+    int zmin = iz > 0 ? iz - 1 : 0;
+    int zmax = iz < c->nz - 1 ? iz + 1 : iz;
+    for (int i = xmin; i <= xmax; ++i) {
+        for (int j = ymin; j <= ymax; ++j) {
+            for (int k = zmin; k <= zmax; ++k) {
+                const int s = cell_hash_slot(h, cell_key(c,i,j,k));
+                if (h->value[s] < 0) continue;
+                if (i > ix || (i == ix && (j > iy || (j == iy && k >= iz)))) {
+                    cell->nb[n] = &c->cell[h->value[s]];
+                    ++n;
+                } else {
+                    cell->bnb[cell->n_bnb++] = &c->cell[h->value[s]];
+                }
+            }
+        }
+    }
+    cell->n_nb = n;
+    assert(n > 0);
+}
+
+/**
+   Creates the cells of a sparse grid, where only occupied cells are
+   stored, assigns the atoms to them and finds their neighbors. The
+   cells are in the same order as in the dense grid, so that the
+   neighbor lists built from the two are identical. Returns
+   FREESASA_FAIL if malloc fails, FREESASA_SUCCESS else.
+ */
+static int
+fill_cells_sparse(cell_list *c,
+                  const coord_t *coord)
+{
+    const int n = freesasa_coord_n(coord);
+    cell_hash h = {NULL, NULL, 2};
+    int *cell_of = malloc(sizeof(int)*n);
+    int64_t *keys = NULL;
+    int m = 0, pos = 0, return_value = FREESASA_FAIL;
+
+    while (h.size < 2*n) h.size *= 2;
+    h.key = malloc(sizeof(int64_t)*h.size);
+    h.value = malloc(sizeof(int)*h.size);
+    if (!cell_of || !h.key || !h.value) goto cleanup;
+    for (int s = 0; s < h.size; ++s) h.value[s] = -1;
+
+    // find the occupied cells, numbered in order of appearance
+    for (int i = 0; i < n; ++i) {
+        int ix, iy, iz, s;
+        int64_t key;
+        coord2cell_xyz(c,freesasa_coord_i(coord,i),&ix,&iy,&iz);
+        key = cell_key(c,ix,iy,iz);
+        s = cell_hash_slot(&h,key);
+        if (h.value[s] < 0) {
+            h.key[s] = key;
+            h.value[s] = m++;
+        }
+        cell_of[i] = s;
+    }
+
+    keys = malloc(sizeof(int64_t)*m);
+    c->cell = malloc(sizeof(cell)*m);
+    c->atom = malloc(sizeof(int)*n);
+    if (!keys || !c->cell || !c->atom) goto cleanup;
+
+    // renumber them in the order of the dense grid
+    for (int s = 0; s < h.size; ++s) {
+        if (h.value[s] >= 0) keys[h.value[s]] = h.key[s];
+    }
+    qsort(keys, m, sizeof(int64_t), compare_key);
+    for (int i = 0; i < m; ++i) {
+        h.value[cell_hash_slot(&h,keys[i])] = i;
+    }
+
+    // and then the same counting sort as fill_cells()
+    c->n = m;
+    for (int i = 0; i < m; ++i) c->cell[i] = empty_cell;
+    for (int i = 0; i < n; ++i) {
+        cell_of[i] = h.value[cell_of[i]];
+        ++c->cell[cell_of[i]].n_atoms;
+    }
+    for (int i = 0; i < m; ++i) {
+        c->cell[i].atom = c->atom + pos;
+        pos += c->cell[i].n_atoms;
+        c->cell[i].n_atoms = 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        cell *cell = &c->cell[cell_of[i]];
+        cell->atom[cell->n_atoms++] = i;
+    }
+
+    for (int i = 0; i < m; ++i) {
+        fill_nb_sparse(c,&h,&c->cell[i],keys[i]);
+    }
+    return_value = FREESASA_SUCCESS;
+
+ cleanup:
+    free(cell_of);
+    free(keys);
+    free(h.key);
+    free(h.value);
+    if (return_value) mem_fail();
+    return return_value;
+}
+
 //! Frees an object created by cell_list_new().
 static void
 cell_list_free(cell_list *c)
 {
     if (c) {
-        if (c->cell) for (int i = 0; i < c->n; ++i) free(c->cell[i].atom);
+        free(c->atom);
         free(c->cell);
         free(c);
     }
 }
 
+//! Type of cell grid, see cell_list_new_grid()
+enum cell_grid {CELL_GRID_AUTO, CELL_GRID_DENSE, CELL_GRID_SPARSE};
+
 /**
     Creates a cell list with provided cell-size assigning cells to
-    each of the provided coordinates. The created cell list should be
-    freed using cell_list_free().
-    
+    each of the provided coordinates, using the given type of
+    grid. With CELL_GRID_AUTO a dense grid is used unless it would
+    have many more cells than atoms (i.e. for extended or sparse
+    systems, or if there are outliers far from the rest of the
+    atoms).
+
     Returns NULL if there are malloc fails.
  */
 static cell_list*
-cell_list_new(double cell_size,
-              const coord_t *coord)
+cell_list_new_grid(double cell_size,
+                   const coord_t *coord,
+                   enum cell_grid grid)
 {
     assert(cell_size > 0);
     assert(coord);
 
     cell_list *c = malloc(sizeof(cell_list));
+    double n_cells;
     if (!c) {mem_fail(); return NULL;}
 
     *c = empty_cell_list;
@@ -192,6 +391,29 @@ cell_list_new(double cell_size,
     c->d = cell_size;
     cell_list_bounds(c,coord);
 
+    n_cells = (double)c->nx*c->ny*c->nz;
+    if (n_cells > 1e18) {
+        cell_list_free(c);
+        fail_msg("coordinates span too large a volume for cell list");
+        return NULL;
+    }
+    if (grid == CELL_GRID_AUTO) {
+        if (n_cells > NB_SPARSE_CELLS_PER_ATOM*(double)freesasa_coord_n(coord) ||
+            n_cells*sizeof(cell) > NB_DENSE_MAX_BYTES)
+            grid = CELL_GRID_SPARSE;
+        else
+            grid = CELL_GRID_DENSE;
+    }
+
+    if (grid == CELL_GRID_SPARSE) {
+        if (fill_cells_sparse(c,coord)) {
+            cell_list_free(c);
+            return NULL;
+        }
+        return c;
+    }
+
+    c->n = c->nx*c->ny*c->nz;
     c->cell = malloc(sizeof(cell)*c->n);
     if (!c->cell) {
         cell_list_free(c);
@@ -212,6 +434,20 @@ cell_list_new(double cell_size,
     return c;
 }
 
+/**
+    Creates a cell list with provided cell-size assigning cells to
+    each of the provided coordinates. The created cell list should be
+    freed using cell_list_free().
+
+    Returns NULL if there are malloc fails.
+ */
+static cell_list*
+cell_list_new(double cell_size,
+              const coord_t *coord)
+{
+    return cell_list_new_grid(cell_size, coord, CELL_GRID_AUTO);
+}
+
 //! assumes max value in a is positive
 static double
 max_array(const double *a,
@@ -225,174 +461,119 @@ max_array(const double *a,
 }
 
 /**
-    Allocate memory for ::nb_list object. Tries to free everything
-    and returns NULL if malloc somewhere along the way.
+    Allocate memory for ::nb_list object. The number of neighbors of
+    each element is given by nn, and is copied. With ::NB_HALF there
+    is space for the distances of n_pairs pairs, else n_pairs is
+    ignored. If single is 1 the distance arrays are float. Returns
+    NULL if malloc fails.
  */
 static nb_list*
-freesasa_nb_alloc(int n)
+freesasa_nb_alloc(int n,
+                  const int *nn,
+                  nb_storage storage,
+                  int single,
+                  int n_pairs)
 {
     assert(n > 0);
     nb_list *nb = malloc(sizeof(nb_list));
     if (!nb) {mem_fail(); return NULL;}
 
     nb->n = n;
-    
-    // in case the mallocs break, we can clean up in a safer way
-    nb->nn = NULL;
-    nb->nb = NULL;
-    nb->capacity = NULL; 
-    nb->xyd = nb->xd = nb->yd = NULL;
-
+    nb->storage = storage;
+    nb->offset = malloc(sizeof(int)*(n+1));
     nb->nn = malloc(sizeof(int)*n);
-    nb->nb = malloc(sizeof(int *)*n);
-    nb->xyd = malloc(sizeof(double *)*n);
-    nb->xd = malloc(sizeof(double *)*n);
-    nb->yd = malloc(sizeof(double *)*n);
-    nb->capacity = malloc(sizeof(int)*n);
-
-    if (!nb->nn || !nb->nb || !nb->xyd || 
-        !nb->xd || !nb->yd || !nb->capacity) {
-        free(nb->nn); free(nb->nb); free(nb->xyd); 
-        free(nb->xd); free(nb->yd); free(nb->capacity);
-        free(nb);
-        mem_fail(); 
+    nb->block = NULL;
+    if (!nb->offset || !nb->nn) {
+        freesasa_nb_free(nb);
+        mem_fail();
         return NULL;
     }
 
-    for (int i=0; i < n; ++i) {
-        nb->nn[i] = 0;
-        nb->capacity[i] = FREESASA_NB_CHUNK;
-        // again prepare for a potential cleanup
-        nb->nb[i] = NULL;
-        nb->xyd[i] = nb->xd[i] = nb->yd[i] = NULL;
-    }
-    for (int i=0; i < n; ++i) {
-        nb->nb[i] = malloc(sizeof(int)*FREESASA_NB_CHUNK);
-        nb->xyd[i] = malloc(sizeof(double)*FREESASA_NB_CHUNK);
-        nb->xd[i] = malloc(sizeof(double)*FREESASA_NB_CHUNK);
-        nb->yd[i] = malloc(sizeof(double)*FREESASA_NB_CHUNK);
-        if (!nb->nb[i] || !nb->xyd[i] || !nb->xd[i] || !nb->yd[i]) {
-            freesasa_nb_free(nb);
-            mem_fail();
-            return NULL;
-        }
+    nb->offset[0] = 0;
+    for (int i = 0; i < n; ++i) {
+        nb->nn[i] = nn[i];
+        nb->offset[i+1] = nb->offset[i] + nn[i];
+    }
+
+    // one block for all arrays, each starting at a cache line
+    const size_t m = (nb->offset[n] + NB_ALIGN - 1)/NB_ALIGN*NB_ALIGN;
+    size_t md = 0; // length of the distance arrays
+    switch (storage) {
+    case NB_FULL: md = m; break;
+    case NB_HALF: md = ((size_t)n_pairs + NB_ALIGN - 1)/NB_ALIGN*NB_ALIGN; break;
+    case NB_INDICES: md = 0; break;
+    }
+    const size_t mi = storage == NB_HALF ? 2*m : m; // length of the integer arrays
+    const size_t size_d = single ? sizeof(float) : sizeof(double);
+    nb->block = malloc(3*size_d*md + sizeof(int)*mi + NB_ALIGN*sizeof(double));
+    if (!nb->block) {
+        freesasa_nb_free(nb);
+        mem_fail();
+        return NULL;
+    }
+    char *start = (char*)(((uintptr_t)nb->block + NB_ALIGN*sizeof(double) - 1)
+                          & ~(uintptr_t)(NB_ALIGN*sizeof(double) - 1));
+    nb->xyd = nb->xd = nb->yd = NULL;
+    nb->xydf = nb->xdf = nb->ydf = NULL;
+    if (storage != NB_INDICES && single) {
+        nb->xydf = (float*)start;
+        nb->xdf = nb->xydf + md;
+        nb->ydf = nb->xdf + md;
+    } else if (storage != NB_INDICES) {
+        nb->xyd = (double*)start;
+        nb->xd = nb->xyd + md;
+        nb->yd = nb->xd + md;
     }
+    nb->nb = (int*)(start + 3*size_d*md);
+    nb->pair = storage == NB_HALF ? nb->nb + m : NULL;
+
     return nb;
 }
 
+//! Stores distances at position k of the distance arrays, in the precision of the list
+static inline void
+nb_set_distances(nb_list *nb,
+                 int k,
+                 double xyd,
+                 double xd,
+                 double yd)
+{
+    if (nb->xydf) {
+        nb->xydf[k] = xyd;
+        nb->xdf[k] = xd;
+        nb->ydf[k] = yd;
+    } else {
+        nb->xyd[k] = xyd;
+        nb->xd[k] = xd;
+        nb->yd[k] = yd;
+    }
+}
+
 void
 freesasa_nb_free(nb_list *nb)
 {
-    int n;
     if (nb != NULL) {
-        n = nb->n;
-        if (nb->nb)  for (int i = 0; i < n; ++i) free(nb->nb[i]);
-        if (nb->xyd) for (int i = 0; i < n; ++i) free(nb->xyd[i]);
-        if (nb->xd)  for (int i = 0; i < n; ++i) free(nb->xd[i]);
-        if (nb->yd)  for (int i = 0; i < n; ++i) free(nb->yd[i]);
-        free(nb->nb);
+        free(nb->offset);
         free(nb->nn);
-        free(nb->capacity);
-        free(nb->xyd);
-        free(nb->xd);
-        free(nb->yd);
+        free(nb->block);
         free(nb);
     }
 }
 
 /**
-    Increases sizes of arrays when they cross a threshold. Returns
-    FREESASA_FAIL if realloc fails, FREESASA_SUCCESS else
- */
-static int
-chunk_up(nb_list *nb_list,
-         int i)
-{
-    int nni = nb_list->nn[i];
-
-    if (nni > nb_list->capacity[i]) {
-        int **nbi = &nb_list->nb[i];
-        int *nbi_b = *nbi;
-        double **xydi = &nb_list->xyd[i];
-        double **xdi = &nb_list->xd[i];
-        double **ydi = &nb_list->yd[i];
-        double *xydi_b = *xydi, *xdi_b = *xdi, *ydi_b = *ydi;
-        int new_cap = (nb_list->capacity[i] += FREESASA_NB_CHUNK);
-
-        *nbi = realloc(*nbi,sizeof(int)*new_cap);
-        if (*nbi == NULL)  { nb_list->nb[i]  = nbi_b;  return mem_fail(); }
-
-        *xydi = realloc(*xydi,sizeof(double)*new_cap);
-        if (*xydi == NULL) { nb_list->xyd[i] = xydi_b; return mem_fail(); }
-
-        *xdi = realloc(*xdi,sizeof(double)*new_cap);
-        if (*xdi == NULL)  { nb_list->xd[i]  = xdi_b;  return mem_fail(); }
-
-        *ydi = realloc(*ydi,sizeof(double)*new_cap);
-        if (*ydi == NULL)  { nb_list->yd[i]  = ydi_b;  return mem_fail(); }
-    }
-    return FREESASA_SUCCESS;
-}
-
-/**
-    Assumes the coordinates i and j have been determined to be
-    neighbors and adds them both to the provided nb lists,
-    symmetrically.
-
-    Returns FREESASA_FAIL if can't allocate memory. FREESASA_SUCCESS
-    else.
-*/
-static int
-nb_add_pair(nb_list *nb_list,
-            int i,
-            int j,
-            double dx,
-            double dy)
-{
-    assert(i != j);
-
-    int ** nb;
-    int * nn = nb_list->nn;
-    int nni, nnj;
-    double ** xyd;
-    double ** xd;
-    double ** yd;
-    double d;
-
-    nni = nn[i]++;
-    nnj = nn[j]++;
-
-    if (chunk_up(nb_list,i)) return mem_fail();
-    if (chunk_up(nb_list,j)) return mem_fail();
-
-    nb = nb_list->nb;
-    xyd = nb_list->xyd;
-    xd = nb_list->xd;
-    yd = nb_list->yd;
-
-    nb[i][nni] = j;
-    nb[j][nnj] = i;
-
-    d = sqrt(dx*dx+dy*dy);
-
-    xyd[i][nni] = d;
-    xyd[j][nnj] = d;
-
-    xd[i][nni] = dx;
-    xd[j][nnj] = -dx;
-    yd[i][nni] = dy;
-    yd[j][nnj] = -dy;
-
-    return FREESASA_SUCCESS;
-}
-
-/**
-    Fills the nb list for all contacts between coordinates
-    belonging to the cells ci and cj. Handles the case ci == cj
-    correctly.
+    Counts (if nb_list is NULL) or stores all contacts between
+    coordinates belonging to the cells ci and cj. Each pair is added
+    to both atoms. When storing, nn holds the position where the next
+    neighbor of each atom is stored. With ::NB_HALF storage each pair
+    belongs to its atom in ci, np then counts the pairs of each atom,
+    or holds the position where its next pair is stored (only ci is
+    written to, so np can be shared between threads that handle
+    different cells). Handles the case ci == cj correctly.
 */
-static int 
-nb_calc_cell_pair(nb_list *nb_list,
+static void
+nb_calc_cell_pair(int *nn,
+                  int *np,
+                  nb_list *nb_list,
                   const coord_t *coord,
                   const double *radii,
                   const cell *ci,
@@ -402,7 +583,7 @@ nb_calc_cell_pair(nb_list *nb_list,
     double ri, rj, xi, yi, zi, xj, yj, zj,
         dx, dy, dz, cut2;
     int i,j,ia,ja;
-    
+
     for (i = 0; i < ci->n_atoms; ++i) {
         ia = ci->atom[i];
         ri = radii[ia];
@@ -417,67 +598,438 @@ nb_calc_cell_pair(nb_list *nb_list,
             cut2 = (ri+rj)*(ri+rj);
             dx = xj-xi; dy = yj-yi; dz = zj-zi;
             if (dx*dx + dy*dy + dz*dz < cut2) {
-                if (nb_add_pair(nb_list,ia,ja,dx,dy))
-                    return mem_fail();
+                if (nb_list == NULL) {
+                    ++nn[ia];
+                    ++nn[ja];
+                    if (np) ++np[ia];
+                } else {
+                    const int pi = nn[ia]++, pj = nn[ja]++;
+                    nb_list->nb[pi] = ja;
+                    nb_list->nb[pj] = ia;
+                    if (nb_list->storage == NB_FULL) {
+                        const double d = sqrt(dx*dx+dy*dy);
+                        nb_set_distances(nb_list, pi, d, dx, dy);
+                        nb_set_distances(nb_list, pj, d, -dx, -dy);
+                    } else if (nb_list->storage == NB_HALF) {
+                        const int k = np[ia]++;
+                        nb_list->pair[pi] = k;
+                        nb_list->pair[pj] = ~k;
+                        nb_set_distances(nb_list, k, sqrt(dx*dx+dy*dy), dx, dy);
+                    }
+                }
             }
         }
     }
-    return FREESASA_SUCCESS;
 }
-                             
+
 /**
-    Iterates through the cells and records all contacts in the
-    provided nb list
+    Iterates through the cells first_cell to last_cell-1 and counts
+    the contacts of each coordinate (if nb_list is NULL), or records
+    them in the provided nb list, at the positions given by nn (and
+    np, see nb_calc_cell_pair()).
  */
-static int
-nb_fill_list(nb_list *nb_list,
-             cell_list *c,
+static void
+nb_fill_list(int *nn,
+             int *np,
+             nb_list *nb_list,
+             const cell_list *c,
+             int first_cell,
+             int last_cell,
              const coord_t *coord,
              const double *radii)
 {
-    int nc = c->n;
-    for (int ic = 0; ic < nc; ++ic) {
+    for (int ic = first_cell; ic < last_cell; ++ic) {
         const cell *ci = &c->cell[ic];
         for (int jc = 0; jc < ci->n_nb; ++jc) {
             const cell *cj = ci->nb[jc];
-            if (nb_calc_cell_pair(nb_list,coord,radii,ci,cj))
-                return mem_fail();
+            nb_calc_cell_pair(nn, np, nb_list, coord, radii, ci, cj);
         }
     }
-    return FREESASA_SUCCESS;
+}
+
+/**
+    Turns the number of pairs of each atom into the position of its
+    first pair, returns the total number of pairs.
+ */
+static int
+nb_pair_positions(int *np,
+                  int n)
+{
+    int n_pairs = 0;
+    for (int i = 0; i < n; ++i) {
+        const int count = np[i];
+        np[i] = n_pairs;
+        n_pairs += count;
+    }
+    return n_pairs;
+}
+
+#if USE_THREADS
+typedef struct {
+    int *nn; //! counts or positions of this thread
+    int *np; //! counts or positions of pairs, shared (NULL unless ::NB_HALF)
+    nb_list *nb_list; //! NULL when counting
+    const cell_list *c;
+    int first_cell, last_cell;
+    const coord_t *coord;
+    const double *radii;
+} nb_thread_interval;
+
+static void*
+nb_thread(void *arg)
+{
+    nb_thread_interval *ti = arg;
+    nb_fill_list(ti->nn, ti->np, ti->nb_list, ti->c, ti->first_cell, ti->last_cell,
+                 ti->coord, ti->radii);
+    return NULL;
+}
+
+//! Runs nb_thread() on each interval
+static int
+nb_do_threads(int n_threads,
+              nb_thread_interval *t_data)
+{
+    return freesasa_thread_run(n_threads, nb_thread, t_data, sizeof(nb_thread_interval));
+}
+
+/**
+    Builds the neighbor list using several threads. Each thread
+    handles a contiguous range of cells, with roughly the same number
+    of atoms, and has its own count of the neighbors of each atom. In
+    the second pass each thread stores its neighbors of an atom after
+    those of the threads before it, the list is therefore identical
+    to the one built by a single thread. The pairs of an atom are
+    all found by the thread that handles its cell.
+ */
+static nb_list*
+nb_new_threads(int n_threads,
+               const cell_list *c,
+               const coord_t *coord,
+               const double *radii,
+               nb_storage storage,
+               int single)
+{
+    const int n = freesasa_coord_n(coord);
+    const int half = storage == NB_HALF;
+    nb_thread_interval t_data[n_threads];
+    int *nn = malloc(sizeof(int)*n*(n_threads + 1 + half));
+    int *np = half ? nn + n*(n_threads + 1) : NULL;
+    nb_list *nb = NULL;
+
+    if (!nn) {
+        mem_fail();
+        return NULL;
+    }
+    memset(nn, 0, sizeof(int)*n*(n_threads + 1 + half));
+
+    for (int t = 0, ic = 0, n_atoms = 0; t < n_threads; ++t) {
+        t_data[t].nn = nn + n*(t + 1);
+        t_data[t].np = np;
+        t_data[t].nb_list = NULL;
+        t_data[t].c = c;
+        t_data[t].coord = coord;
+        t_data[t].radii = radii;
+        t_data[t].first_cell = ic;
+        if (t == n_threads - 1) {
+            ic = c->n;
+        } else {
+            while (ic < c->n && n_atoms < (long)n*(t + 1)/n_threads) {
+                n_atoms += c->cell[ic++].n_atoms;
+            }
+        }
+        t_data[t].last_cell = ic;
+    }
+
+    if (nb_do_threads(n_threads, t_data)) goto cleanup;
+
+    for (int t = 0; t < n_threads; ++t) {
+        for (int i = 0; i < n; ++i) nn[i] += t_data[t].nn[i];
+    }
+    nb = freesasa_nb_alloc(n, nn, storage, single, half ? nb_pair_positions(np, n) : 0);
+    if (nb == NULL) goto cleanup;
+
+    // turn the counts of each thread into positions
+    for (int i = 0; i < n; ++i) {
+        int pos = nb->offset[i];
+        for (int t = 0; t < n_threads; ++t) {
+            const int count = t_data[t].nn[i];
+            t_data[t].nn[i] = pos;
+            pos += count;
+        }
+    }
+    for (int t = 0; t < n_threads; ++t) t_data[t].nb_list = nb;
+
+    if (nb_do_threads(n_threads, t_data)) {
+        freesasa_nb_free(nb);
+        nb = NULL;
+    }
+
+ cleanup:
+    free(nn);
+    return nb;
+}
+#endif /* USE_THREADS */
+
+//! Builds the neighbor list in one thread, first counting the neighbors, then storing them
+static nb_list*
+nb_new_serial(const cell_list *c,
+              const coord_t *coord,
+              const double *radii,
+              nb_storage storage,
+              int single)
+{
+    const int n = freesasa_coord_n(coord);
+    const int half = storage == NB_HALF;
+    int *nn = malloc(sizeof(int)*n*(1 + half));
+    int *np = half ? nn + n : NULL;
+    nb_list *nb = NULL;
+
+    if (!nn) {
+        mem_fail();
+        return NULL;
+    }
+    memset(nn, 0, sizeof(int)*n*(1 + half));
+
+    nb_fill_list(nn, np, NULL, c, 0, c->n, coord, radii);
+    nb = freesasa_nb_alloc(n, nn, storage, single, half ? nb_pair_positions(np, n) : 0);
+    if (nb) {
+        memcpy(nn, nb->offset, sizeof(int)*n);
+        nb_fill_list(nn, np, nb, c, 0, c->n, coord, radii);
+    }
+
+    free(nn);
+    return nb;
 }
 
 nb_list*
-freesasa_nb_new(const coord_t *coord,
-                const double *radii)
+freesasa_nb_new_storage(const coord_t *coord,
+                        const double *radii,
+                        int n_threads,
+                        nb_storage storage,
+                        int single)
 {
     if (coord == NULL || radii == NULL) return NULL;
     double cell_size;
     cell_list *c;
     int n = freesasa_coord_n(coord);
-    nb_list *nb = freesasa_nb_alloc(n);
-    
-    if (!nb) {
-        mem_fail();
-        return NULL;
-    }
-    
+    nb_list *nb = NULL;
+
     cell_size = 2*max_array(radii,n);
     assert(cell_size > 0);
     c = cell_list_new(cell_size,coord);
-    if (c == NULL ||
-        nb_fill_list(nb,c,coord,radii)) {
-        mem_fail(); 
-        freesasa_nb_free(nb);
-        nb = NULL;
-    } 
-    
+    if (c == NULL) {
+        mem_fail();
+        return NULL;
+    }
+
+    // small lists are faster to build in one thread
+    if (n_threads > n/NB_ATOMS_PER_THREAD) n_threads = n/NB_ATOMS_PER_THREAD;
+
+    if (n_threads > 1) {
+#if USE_THREADS
+        nb = nb_new_threads(n_threads, c, coord, radii, storage, single);
+#else
+        nb = nb_new_serial(c, coord, radii, storage, single);
+#endif
+    } else {
+        nb = nb_new_serial(c, coord, radii, storage, single);
+    }
+
     // the cell lists are only a tool to generate the neighbor lists
     cell_list_free(c);
-    
+
     return nb;
 }
 
+nb_list*
+freesasa_nb_new(const coord_t *coord,
+                const double *radii,
+                int n_threads)
+{
+    return freesasa_nb_new_storage(coord, radii, n_threads, NB_FULL, 0);
+}
+
+struct freesasa_verlet_list {
+    double skin; //! margin added to the cutoff of the candidates
+    int single; //! are the distances of the neighbor list in single precision
+    int n; //! number of atoms, 0 before the first update
+    double *xyz; //! coordinates when the candidates were found
+    double *radii; //! radii when the candidates were found
+    int *offset; //! the candidates of atom i are cand[offset[i]] to cand[offset[i+1]-1]
+    int *cand; //! candidate neighbors
+    nb_list *nb; //! neighbor list of the latest coordinates
+    int n_builds; //! number of times the candidates have been found
+};
+
+freesasa_verlet_list*
+freesasa_verlet_list_new(double skin)
+{
+    freesasa_verlet_list *v;
+
+    if (skin < 0) {
+        fail_msg("skin %g invalid, must be >= 0", skin);
+        return NULL;
+    }
+    v = malloc(sizeof(freesasa_verlet_list));
+    if (v == NULL) {
+        mem_fail();
+        return NULL;
+    }
+    v->skin = skin;
+    v->single = 0;
+    v->n = 0;
+    v->xyz = v->radii = NULL;
+    v->offset = v->cand = NULL;
+    v->nb = NULL;
+    v->n_builds = 0;
+    return v;
+}
+
+void
+freesasa_verlet_list_free(freesasa_verlet_list *v)
+{
+    if (v) {
+        free(v->xyz);
+        free(v->radii);
+        free(v->offset);
+        free(v->cand);
+        freesasa_nb_free(v->nb);
+        free(v);
+    }
+}
+
+int
+freesasa_verlet_list_n_builds(const freesasa_verlet_list *v)
+{
+    assert(v);
+    return v->n_builds;
+}
+
+//! Have the radii or the precision changed, or has any atom moved more than half the skin?
+static int
+verlet_list_expired(const freesasa_verlet_list *v,
+                    const double *xyz,
+                    const double *radii,
+                    int n,
+                    int single)
+{
+    const double max2 = v->skin*v->skin/4;
+
+    if (n != v->n || single != v->single ||
+        memcmp(radii, v->radii, sizeof(double)*n) != 0) return 1;
+    for (int i = 0; i < 3*n; i += 3) {
+        const double dx = xyz[i] - v->xyz[i],
+            dy = xyz[i+1] - v->xyz[i+1],
+            dz = xyz[i+2] - v->xyz[i+2];
+        if (dx*dx + dy*dy + dz*dz > max2) return 1;
+    }
+    return 0;
+}
+
+/**
+    Finds the candidate neighbors, i.e. all pairs closer than the sum
+    of the radii plus the skin, using a regular neighbor list with the
+    radii increased by half the skin. Also allocates the neighbor list
+    to have room for all candidates.
+ */
+static int
+verlet_list_build(freesasa_verlet_list *v,
+                  const coord_t *coord,
+                  const double *radii,
+                  int n_threads,
+                  int single)
+{
+    const int n = freesasa_coord_n(coord);
+    double *r = malloc(sizeof(double)*n);
+    nb_list *cand = NULL;
+
+    free(v->xyz);
+    free(v->radii);
+    free(v->offset);
+    free(v->cand);
+    freesasa_nb_free(v->nb);
+    v->n = 0;
+    v->xyz = v->radii = NULL;
+    v->offset = v->cand = NULL;
+    v->nb = NULL;
+
+    if (r == NULL) return mem_fail();
+    for (int i = 0; i < n; ++i) r[i] = radii[i] + v->skin/2;
+    cand = freesasa_nb_new_storage(coord, r, n_threads, NB_INDICES, 0);
+    free(r);
+    if (cand == NULL) return FREESASA_FAIL;
+
+    v->xyz = malloc(sizeof(double)*3*n);
+    v->radii = malloc(sizeof(double)*n);
+    v->offset = malloc(sizeof(int)*(n+1));
+    v->cand = malloc(sizeof(int)*(cand->offset[n] > 0 ? cand->offset[n] : 1));
+    v->nb = freesasa_nb_alloc(n, cand->nn, NB_FULL, single, 0);
+    if (!v->xyz || !v->radii || !v->offset || !v->cand || !v->nb) {
+        freesasa_nb_free(cand);
+        return mem_fail();
+    }
+
+    memcpy(v->xyz, freesasa_coord_all(coord), sizeof(double)*3*n);
+    memcpy(v->radii, radii, sizeof(double)*n);
+    memcpy(v->offset, cand->offset, sizeof(int)*(n+1));
+    memcpy(v->cand, cand->nb, sizeof(int)*cand->offset[n]);
+    freesasa_nb_free(cand);
+
+    v->n = n;
+    v->single = single;
+    ++v->n_builds;
+    return FREESASA_SUCCESS;
+}
+
+/**
+    Stores the candidates that are neighbors for the current
+    coordinates, and their distances, in the neighbor list.
+ */
+static void
+verlet_list_refresh(freesasa_verlet_list *v,
+                    const double *xyz,
+                    const double *radii)
+{
+    nb_list *nb = v->nb;
+    int pos = 0;
+
+    for (int i = 0; i < v->n; ++i) {
+        const double xi = xyz[3*i], yi = xyz[3*i+1], zi = xyz[3*i+2], ri = radii[i];
+        nb->offset[i] = pos;
+        for (int p = v->offset[i]; p < v->offset[i+1]; ++p) {
+            const int j = v->cand[p];
+            const double dx = xyz[3*j] - xi, dy = xyz[3*j+1] - yi, dz = xyz[3*j+2] - zi,
+                cut = ri + radii[j];
+            if (dx*dx + dy*dy + dz*dz < cut*cut) {
+                nb->nb[pos] = j;
+                nb_set_distances(nb, pos, sqrt(dx*dx + dy*dy), dx, dy);
+                ++pos;
+            }
+        }
+        nb->nn[i] = pos - nb->offset[i];
+    }
+    nb->offset[v->n] = pos;
+}
+
+nb_list*
+freesasa_verlet_list_update(freesasa_verlet_list *v,
+                            const coord_t *coord,
+                            const double *radii,
+                            int n_threads,
+                            int single)
+{
+    assert(v); assert(coord); assert(radii);
+    const int n = freesasa_coord_n(coord);
+    const double *xyz = freesasa_coord_all(coord);
+
+    if (verlet_list_expired(v, xyz, radii, n, single) &&
+        verlet_list_build(v, coord, radii, n_threads, single)) {
+        return NULL;
+    }
+    verlet_list_refresh(v, xyz, radii);
+    return v->nb;
+}
+
 int 
 freesasa_nb_contact(const nb_list *nb,
                     int i,
@@ -486,12 +1038,606 @@ freesasa_nb_contact(const nb_list *nb,
     assert(nb != NULL);
     assert(i < nb->n && i >= 0);
     assert(j < nb->n && j >= 0);
-    for (int k = 0; k < nb->nn[i]; ++k) {
-        if (nb->nb[i][k] == j) return 1;
+    for (int k = nb->offset[i]; k < nb->offset[i+1]; ++k) {
+        if (nb->nb[k] == j) return 1;
     }
     return 0;
 }
 
+/* Number of classes of buried surface fraction used in
+   freesasa_nb_sort(). A counting sort with this many classes is much
+   faster than a full sort, and the order within a class is of little
+   consequence. */
+#define NB_SORT_CLASSES 32
+
+/* The fraction of the surface of sphere i (radius ri) buried by a
+   sphere of radius rj at distance d. The buried part is a cap with
+   height ri - h, where h = (ri^2 + d^2 - rj^2)/(2 d) is the distance
+   from the center of i to the plane of the intersection circle. */
+static double
+nb_buried_fraction(double ri,
+                   double rj,
+                   double d)
+{
+    double h;
+    if (d == 0) return rj >= ri ? 1 : 0;
+    h = (ri*ri + d*d - rj*rj)/(2*d);
+    if (h >= ri) return 0;
+    if (h <= -ri) return 1;
+    return (ri - h)/(2*ri);
+}
+
+/* Sorts the neighbors of sphere i, see freesasa_nb_sort(). The
+   buffers need room for nn[i] elements (3 nn[i] for tmp). */
+static void
+nb_sort_row(nb_list *nb,
+            const double *v,
+            const double *radii,
+            int i,
+            int *class,
+            int *nbi,
+            int *pair,
+            double *tmp)
+{
+    const int nni = nb->nn[i], o = nb->offset[i];
+    const double xi = v[3*i], yi = v[3*i+1], zi = v[3*i+2];
+    int count[NB_SORT_CLASSES+1];
+
+    // class 0 buries the largest fraction
+    memset(count, 0, sizeof(count));
+    for (int k = 0; k < nni; ++k) {
+        const int j = nb->nb[o + k];
+        const double dx = v[3*j] - xi, dy = v[3*j+1] - yi, dz = v[3*j+2] - zi;
+        const double f = nb_buried_fraction(radii[i], radii[j], sqrt(dx*dx + dy*dy + dz*dz));
+        int c = NB_SORT_CLASSES - 1 - (int)(f*NB_SORT_CLASSES);
+        if (c < 0) c = 0;
+        class[k] = c;
+        ++count[c+1];
+        nbi[k] = j;
+        if (nb->storage == NB_FULL) {
+            tmp[3*k] = freesasa_nb_xyd(nb, o + k);
+            tmp[3*k+1] = freesasa_nb_xd(nb, o + k);
+            tmp[3*k+2] = freesasa_nb_yd(nb, o + k);
+        } else if (nb->storage == NB_HALF) {
+            pair[k] = nb->pair[o + k];
+        }
+    }
+    // count[c] becomes the first position of class c
+    for (int c = 1; c < NB_SORT_CLASSES; ++c) count[c] += count[c-1];
+    for (int k = 0; k < nni; ++k) {
+        const int kk = count[class[k]]++;
+        nb->nb[o + kk] = nbi[k];
+        if (nb->storage == NB_FULL) {
+            nb_set_distances(nb, o + kk, tmp[3*k], tmp[3*k+1], tmp[3*k+2]);
+        } else if (nb->storage == NB_HALF) {
+            nb->pair[o + kk] = pair[k];
+        }
+    }
+}
+
+int
+freesasa_nb_sort(nb_list *nb,
+                 const coord_t *coord,
+                 const double *radii)
+{
+    const double *v = freesasa_coord_all(coord);
+    int max_nn = 0;
+    int *class, *nbi, *pair;
+    double *tmp;
+
+    assert(nb);
+    assert(freesasa_coord_n(coord) == nb->n);
+
+    for (int i = 0; i < nb->n; ++i) {
+        if (nb->nn[i] > max_nn) max_nn = nb->nn[i];
+    }
+    if (max_nn == 0) return FREESASA_SUCCESS;
+
+    class = malloc(sizeof(int)*max_nn);
+    nbi = malloc(sizeof(int)*max_nn);
+    pair = malloc(sizeof(int)*max_nn);
+    tmp = malloc(sizeof(double)*3*max_nn);
+    if (class == NULL || nbi == NULL || pair == NULL || tmp == NULL) {
+        free(class);
+        free(nbi);
+        free(pair);
+        free(tmp);
+        return mem_fail();
+    }
+
+    for (int i = 0; i < nb->n; ++i) {
+        nb_sort_row(nb, v, radii, i, class, nbi, pair, tmp);
+    }
+
+    free(class);
+    free(nbi);
+    free(pair);
+    free(tmp);
+    return FREESASA_SUCCESS;
+}
+
+// how many times the faces of the icosahedron are subdivided in nb_is_buried()
+#define NB_BURIAL_DEPTH 4
+
+// neighbors that cover parts of the surface of a sphere, see nb_is_buried()
+typedef struct {
+    int n;
+    double *ux, *uy, *uz; // directions
+    double *cos_a; // cosines of half-angles
+    int last; // the cap that covered the last triangle, tried first
+} nb_caps;
+
+// Returns 1 if the direction p (not necessarily normalized) is inside one of the caps
+static int
+nb_point_covered(const nb_caps *caps,
+                 const double *p)
+{
+    const double norm = sqrt(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+    for (int k = 0; k < caps->n; ++k) {
+        if (p[0]*caps->ux[k] + p[1]*caps->uy[k] + p[2]*caps->uz[k] >= caps->cos_a[k]*norm)
+            return 1;
+    }
+    return norm == 0;
+}
+
+/* Returns 1 if the spherical triangle abc (unit vectors) is covered
+   by the caps, 0 if it is not, or if it can't be determined. The
+   triangle is contained in the cap centered at its centroid with the
+   largest angle to a corner as half-angle (made slightly larger, to
+   be safe from round-off errors). A triangle with a bounding cap of
+   half-angle beta, at angle gamma from a cap with half-angle alpha,
+   is inside that cap if gamma + beta <= alpha. If no single cap
+   covers the triangle, it is divided in four, down to a given
+   depth. */
+static int
+nb_triangle_covered(nb_caps *caps,
+                    const double *a,
+                    const double *b,
+                    const double *c,
+                    int depth)
+{
+    double w[3], norm, cos_b = 1, sin_b;
+    int center_covered = 0;
+
+    for (int k = 0; k < 3; ++k) w[k] = a[k] + b[k] + c[k];
+    norm = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+    for (int k = 0; k < 3; ++k) w[k] /= norm;
+    cos_b = fmin(cos_b, w[0]*a[0] + w[1]*a[1] + w[2]*a[2]);
+    cos_b = fmin(cos_b, w[0]*b[0] + w[1]*b[1] + w[2]*b[2]);
+    cos_b = fmin(cos_b, w[0]*c[0] + w[1]*c[1] + w[2]*c[2]);
+    cos_b -= 1e-9;
+    sin_b = sqrt(fmax(0, 1 - cos_b*cos_b));
+
+    for (int kk = -1; kk < caps->n; ++kk) {
+        const int k = kk < 0 ? caps->last : kk;
+        const double cos_g = w[0]*caps->ux[k] + w[1]*caps->uy[k] + w[2]*caps->uz[k];
+        double sin_g;
+        if (kk == caps->last) continue;
+        // gamma <= alpha is necessary
+        if (cos_g < caps->cos_a[k]) continue;
+        center_covered = 1;
+        sin_g = sqrt(fmax(0, 1 - cos_g*cos_g));
+        if (cos_g >= -cos_b && cos_g*cos_b - sin_g*sin_b >= caps->cos_a[k]) {
+            caps->last = k;
+            return 1;
+        }
+    }
+
+    // the center is exposed, or we give up
+    if (!center_covered || depth == 0) return 0;
+
+    {
+        double ab[3], bc[3], ca[3], nab = 0, nbc = 0, nca = 0;
+        for (int k = 0; k < 3; ++k) {
+            ab[k] = a[k] + b[k]; nab += ab[k]*ab[k];
+            bc[k] = b[k] + c[k]; nbc += bc[k]*bc[k];
+            ca[k] = c[k] + a[k]; nca += ca[k]*ca[k];
+        }
+        nab = sqrt(nab); nbc = sqrt(nbc); nca = sqrt(nca);
+        for (int k = 0; k < 3; ++k) {
+            ab[k] /= nab; bc[k] /= nbc; ca[k] /= nca;
+        }
+        return nb_triangle_covered(caps, ab, bc, ca, depth-1) &&
+            nb_triangle_covered(caps, a, ab, ca, depth-1) &&
+            nb_triangle_covered(caps, ab, b, bc, depth-1) &&
+            nb_triangle_covered(caps, ca, bc, c, depth-1);
+    }
+}
+
+/* A neighbor j covers the cap of the surface of sphere i with
+   direction D/d and half-angle alpha, where D = x_j - x_i, d = |D| and
+   cos(alpha) = (r_i^2 + d^2 - r_j^2)/(2 r_i d). The sphere is buried
+   if all faces of an icosahedron, projected onto the sphere, are
+   covered. */
+static int
+nb_is_buried(const double ico[12][3],
+             const int face[20][3],
+             const double *v,
+             const double *radii,
+             const nb_list *nb,
+             int i)
+{
+    const int nni = nb->nn[i];
+    const double ri = radii[i];
+    double ux[nni+1], uy[nni+1], uz[nni+1], cos_a[nni+1];
+    double w[3] = {0, 0, 0};
+    nb_caps caps = {0, ux, uy, uz, cos_a, 0};
+
+    for (int k = 0; k < nni; ++k) {
+        const int j = nb->nb[nb->offset[i] + k];
+        const double x = v[3*j] - v[3*i], y = v[3*j+1] - v[3*i+1], z = v[3*j+2] - v[3*i+2];
+        const double d2 = x*x + y*y + z*z;
+        const double t = (ri*ri + d2 - radii[j]*radii[j])/(2*ri), d = sqrt(d2);
+        if (t*fabs(t) > d2) continue; // the neighbor doesn't touch the surface
+        if (-t*fabs(t) >= d2) return 1; // the neighbor covers the whole surface
+        ux[caps.n] = x/d; uy[caps.n] = y/d; uz[caps.n] = z/d; cos_a[caps.n] = t/d;
+        w[0] -= ux[caps.n]; w[1] -= uy[caps.n]; w[2] -= uz[caps.n];
+        ++caps.n;
+    }
+    if (caps.n == 0) return 0;
+
+    /* Most atoms that are not buried are exposed in the direction
+       opposite to their neighbors, or at a corner of the
+       icosahedron, check these first. */
+    if (!nb_point_covered(&caps, w)) return 0;
+    for (int a = 0; a < 12; ++a) {
+        if (!nb_point_covered(&caps, ico[a])) return 0;
+    }
+
+    for (int l = 0; l < 20; ++l) {
+        if (!nb_triangle_covered(&caps, ico[face[l][0]], ico[face[l][1]], ico[face[l][2]],
+                                 NB_BURIAL_DEPTH))
+            return 0;
+    }
+    return 1;
+}
+
+/* The vertices of an icosahedron, normalized, and its faces. */
+static void
+nb_icosahedron(double ico[12][3],
+               int face[20][3])
+{
+    const double phi = (1 + sqrt(5))/2;
+    const double v[12][3] = {{0,1,phi},{0,1,-phi},{0,-1,phi},{0,-1,-phi},
+                             {1,phi,0},{1,-phi,0},{-1,phi,0},{-1,-phi,0},
+                             {phi,0,1},{phi,0,-1},{-phi,0,1},{-phi,0,-1}};
+    int n_faces = 0;
+
+    // the faces of the icosahedron, its edges have length 2
+    for (int a = 0; a < 12; ++a) {
+        for (int b = a+1; b < 12; ++b) {
+            for (int c = b+1; c < 12; ++c) {
+                double dab = 0, dac = 0, dbc = 0;
+                for (int k = 0; k < 3; ++k) {
+                    dab += (v[a][k]-v[b][k])*(v[a][k]-v[b][k]);
+                    dac += (v[a][k]-v[c][k])*(v[a][k]-v[c][k]);
+                    dbc += (v[b][k]-v[c][k])*(v[b][k]-v[c][k]);
+                }
+                if (fabs(dab-4) < 1e-9 && fabs(dac-4) < 1e-9 && fabs(dbc-4) < 1e-9) {
+                    face[n_faces][0] = a; face[n_faces][1] = b; face[n_faces][2] = c;
+                    ++n_faces;
+                }
+            }
+        }
+    }
+    assert(n_faces == 20);
+    for (int a = 0; a < 12; ++a) {
+        const double norm = sqrt(1 + phi*phi);
+        for (int k = 0; k < 3; ++k) ico[a][k] = v[a][k]/norm;
+    }
+}
+
+int
+freesasa_nb_buried(char *buried,
+                   const coord_t *coord,
+                   const double *radii,
+                   const nb_list *nb)
+{
+    const double *v = freesasa_coord_all(coord);
+    double ico[12][3];
+    int face[20][3], n_buried = 0;
+
+    assert(buried);
+    assert(coord);
+    assert(radii);
+    assert(nb);
+
+    nb_icosahedron(ico, face);
+    for (int i = 0; i < nb->n; ++i) {
+        buried[i] = nb_is_buried((const double (*)[3]) ico, (const int (*)[3]) face,
+                                 v, radii, nb, i);
+        n_buried += buried[i];
+    }
+    return n_buried;
+}
+
+void
+freesasa_nb_sort_atom(nb_list *nb,
+                      const coord_t *coord,
+                      const double *radii,
+                      int i)
+{
+    const int m = nb->nn[i] > 0 ? nb->nn[i] : 1;
+    int class[m], nbi[m], pair[m];
+    double tmp[3*m];
+
+    assert(i >= 0 && i < nb->n);
+    nb_sort_row(nb, freesasa_coord_all(coord), radii, i, class, nbi, pair, tmp);
+}
+
+// initial capacity of the neighbor lists of nb_search
+#define NB_SEARCH_MIN_CAPACITY 64
+
+struct nb_search {
+    const coord_t *coord;
+    const double *radii;
+    cell_list *c;
+    nb_storage storage; //! NB_FULL or NB_INDICES
+    int n_threads;
+    int *first_cell; //! thread t handles the cells first_cell[t] to first_cell[t+1]-1
+    int *nn; //! number of neighbors of each atom, shared by the lists
+    int *offset; //! all zero, shared by the lists
+    nb_list *list; //! the list of each thread
+    int *capacity; //! the capacity of the arrays of each list
+    double ico[12][3]; //! for freesasa_nb_search_buried()
+    int face[20][3];
+};
+
+/* Increases the capacity of the list of thread t, keeping the n
+   first neighbors. */
+static int
+nb_search_grow(nb_search *s,
+               int t,
+               int n)
+{
+    nb_list *nb = &s->list[t];
+    const int full = s->storage == NB_FULL;
+    const size_t m = ((size_t)2*s->capacity[t] + NB_ALIGN - 1)/NB_ALIGN*NB_ALIGN;
+    void *block = malloc((3*full*sizeof(double) + sizeof(int))*m + NB_ALIGN*sizeof(double));
+    double *xyd;
+    int *nbi;
+
+    if (block == NULL) return mem_fail();
+    xyd = (double*)(((uintptr_t)block + NB_ALIGN*sizeof(double) - 1)
+                    & ~(uintptr_t)(NB_ALIGN*sizeof(double) - 1));
+    nbi = (int*)(xyd + 3*full*m);
+    if (n > 0) {
+        memcpy(nbi, nb->nb, sizeof(int)*n);
+        if (full) {
+            memcpy(xyd, nb->xyd, sizeof(double)*n);
+            memcpy(xyd + m, nb->xd, sizeof(double)*n);
+            memcpy(xyd + 2*m, nb->yd, sizeof(double)*n);
+        }
+    }
+    free(nb->block);
+    nb->block = block;
+    nb->nb = nbi;
+    if (full) {
+        nb->xyd = xyd;
+        nb->xd = xyd + m;
+        nb->yd = xyd + 2*m;
+    }
+    s->capacity[t] = m;
+    return FREESASA_SUCCESS;
+}
+
+/* Stores the neighbors of atom ia, in cell ci, in the list of thread
+   t. The neighbors are in the cell itself and its forward and
+   backward neighbors. */
+static int
+nb_search_gather(nb_search *s,
+                 int t,
+                 const cell *ci,
+                 int ia)
+{
+    const double * restrict v = freesasa_coord_all(s->coord);
+    const double *radii = s->radii;
+    const double xi = v[3*ia], yi = v[3*ia+1], zi = v[3*ia+2], ri = radii[ia];
+    nb_list *nb = &s->list[t];
+    int n = 0;
+
+    for (int k = 0; k < ci->n_nb + ci->n_bnb; ++k) {
+        const cell *cj = k < ci->n_nb ? ci->nb[k] : ci->bnb[k - ci->n_nb];
+        for (int j = 0; j < cj->n_atoms; ++j) {
+            const int ja = cj->atom[j];
+            const double dx = v[3*ja] - xi, dy = v[3*ja+1] - yi, dz = v[3*ja+2] - zi,
+                cut = ri + radii[ja];
+            if (ja == ia || dx*dx + dy*dy + dz*dz >= cut*cut) continue;
+            if (n == s->capacity[t] && nb_search_grow(s, t, n)) return FREESASA_FAIL;
+            nb->nb[n] = ja;
+            if (s->storage == NB_FULL) {
+                nb->xyd[n] = sqrt(dx*dx + dy*dy);
+                nb->xd[n] = dx;
+                nb->yd[n] = dy;
+            }
+            ++n;
+        }
+    }
+    nb->nn[ia] = n;
+    return FREESASA_SUCCESS;
+}
+
+nb_search*
+freesasa_nb_search_new(const coord_t *coord,
+                       const double *radii,
+                       int n_threads,
+                       nb_storage storage)
+{
+    assert(coord);
+    assert(radii);
+    assert(storage == NB_FULL || storage == NB_INDICES);
+
+    const int n = freesasa_coord_n(coord);
+    nb_search *s;
+
+    if (!USE_THREADS || n_threads < 1) n_threads = 1;
+    s = malloc(sizeof(nb_search));
+    if (s == NULL) {
+        mem_fail();
+        return NULL;
+    }
+    s->coord = coord;
+    s->radii = radii;
+    s->storage = storage;
+    s->n_threads = n_threads;
+    s->c = NULL;
+    s->nn = malloc(sizeof(int)*n);
+    s->offset = calloc(n+1, sizeof(int));
+    s->first_cell = malloc(sizeof(int)*(n_threads+1));
+    s->list = malloc(sizeof(nb_list)*n_threads);
+    s->capacity = malloc(sizeof(int)*n_threads);
+    if (!s->nn || !s->offset || !s->first_cell || !s->list || !s->capacity) {
+        free(s->list);
+        s->list = NULL;
+        freesasa_nb_search_free(s);
+        mem_fail();
+        return NULL;
+    }
+    for (int t = 0; t < n_threads; ++t) {
+        nb_list *nb = &s->list[t];
+        nb->n = n;
+        nb->storage = storage;
+        nb->offset = s->offset;
+        nb->nn = s->nn;
+        nb->nb = nb->pair = NULL;
+        nb->xyd = nb->xd = nb->yd = NULL;
+        nb->xydf = nb->xdf = nb->ydf = NULL;
+        nb->block = NULL;
+        s->capacity[t] = NB_SEARCH_MIN_CAPACITY/2;
+    }
+    for (int t = 0; t < n_threads; ++t) {
+        if (nb_search_grow(s, t, 0)) {
+            freesasa_nb_search_free(s);
+            return NULL;
+        }
+    }
+
+    s->c = cell_list_new(2*max_array(radii,n), coord);
+    if (s->c == NULL) {
+        freesasa_nb_search_free(s);
+        return NULL;
+    }
+    // contiguous ranges of cells with roughly the same number of atoms
+    for (int t = 0, ic = 0, n_atoms = 0; t < n_threads; ++t) {
+        s->first_cell[t] = ic;
+        while (ic < s->c->n && n_atoms < (long)n*(t + 1)/n_threads) {
+            n_atoms += s->c->cell[ic++].n_atoms;
+        }
+    }
+    s->first_cell[n_threads] = s->c->n;
+
+    nb_icosahedron(s->ico, s->face);
+
+    return s;
+}
+
+void
+freesasa_nb_search_free(nb_search *s)
+{
+    if (s) {
+        if (s->list) {
+            for (int t = 0; t < s->n_threads; ++t) free(s->list[t].block);
+        }
+        cell_list_free(s->c);
+        free(s->nn);
+        free(s->offset);
+        free(s->first_cell);
+        free(s->list);
+        free(s->capacity);
+        free(s);
+    }
+}
+
+int
+freesasa_nb_search_n_threads(const nb_search *s)
+{
+    assert(s);
+    return s->n_threads;
+}
+
+nb_list*
+freesasa_nb_search_list(nb_search *s,
+                        int t)
+{
+    assert(s);
+    assert(t >= 0 && t < s->n_threads);
+    return &s->list[t];
+}
+
+int
+freesasa_nb_search_buried(const nb_search *s,
+                          int t,
+                          int i)
+{
+    assert(s);
+    assert(t >= 0 && t < s->n_threads);
+    return nb_is_buried((const double (*)[3]) s->ico, (const int (*)[3]) s->face,
+                        freesasa_coord_all(s->coord), s->radii, &s->list[t], i);
+}
+
+typedef struct {
+    nb_search *s;
+    int t;
+    void (*atom)(void *data, int t, int i);
+    void *data;
+    int status;
+} nb_search_interval;
+
+//! Handles the cells of one thread
+static void*
+nb_search_cells(void *arg)
+{
+    nb_search_interval *si = arg;
+    const cell_list *c = si->s->c;
+
+    si->status = FREESASA_SUCCESS;
+    for (int ic = si->s->first_cell[si->t]; ic < si->s->first_cell[si->t+1]; ++ic) {
+        const cell *ci = &c->cell[ic];
+        for (int k = 0; k < ci->n_atoms; ++k) {
+            if (nb_search_gather(si->s, si->t, ci, ci->atom[k])) {
+                si->status = FREESASA_FAIL;
+                return NULL;
+            }
+            si->atom(si->data, si->t, ci->atom[k]);
+        }
+    }
+    return NULL;
+}
+
+int
+freesasa_nb_search_run(nb_search *s,
+                       void (*atom)(void *data, int t, int i),
+                       void *data)
+{
+    assert(s);
+    assert(atom);
+
+    const int n_threads = s->n_threads;
+    nb_search_interval si[n_threads];
+    int return_value = FREESASA_SUCCESS;
+
+    for (int t = 0; t < n_threads; ++t) {
+        si[t].s = s;
+        si[t].t = t;
+        si[t].atom = atom;
+        si[t].data = data;
+        si[t].status = FREESASA_SUCCESS;
+    }
+
+    if (n_threads == 1) {
+        nb_search_cells(&si[0]);
+    } else {
+#if USE_THREADS
+        return_value = freesasa_thread_run(n_threads, nb_search_cells, si,
+                                           sizeof(nb_search_interval));
+#endif
+    }
+    for (int t = 0; t < n_threads; ++t) {
+        if (si[t].status) return_value = FREESASA_FAIL;
+    }
+    return return_value;
+}
+
 #if USE_CHECK
 #include <math.h>
 #include <check.h>
@@ -543,11 +1689,63 @@ START_TEST (test_cell) {
 }
 END_TEST
 
+START_TEST (test_cell_sparse) {
+    // a cluster of atoms and one far away, the dense grid would be mostly empty
+    const int n = 300;
+    double v[3*n], r[n];
+    unsigned int seed = 1;
+    coord_t *coord = freesasa_coord_new();
+    cell_list *c[3];
+    nb_list *nb[3];
+
+    for (int i = 0; i < 3*n; ++i) {
+        seed = seed*1103515245 + 12345;
+        v[i] = 25.0*(seed >> 8)/(1 << 24);
+    }
+    for (int i = 0; i < n; ++i) r[i] = 1.5 + (i % 5)*0.2;
+    v[3*n-3] = 500; v[3*n-2] = -300; v[3*n-1] = 400;
+    freesasa_coord_append(coord,v,n);
+
+    c[0] = cell_list_new_grid(2*max_array(r,n),coord,CELL_GRID_DENSE);
+    c[1] = cell_list_new_grid(2*max_array(r,n),coord,CELL_GRID_SPARSE);
+    c[2] = cell_list_new(2*max_array(r,n),coord);
+    for (int k = 0; k < 3; ++k) {
+        int na = 0;
+        ck_assert(c[k] != NULL);
+        for (int i = 0; i < c[k]->n; ++i) na += c[k]->cell[i].n_atoms;
+        ck_assert_int_eq(na,n);
+        nb[k] = nb_new_serial(c[k],coord,r,NB_FULL,0);
+        ck_assert(nb[k] != NULL);
+    }
+    ck_assert_int_eq(c[0]->n, c[0]->nx*c[0]->ny*c[0]->nz);
+    // the automatic choice should be the sparse grid, with only occupied cells
+    ck_assert_int_eq(c[2]->n, c[1]->n);
+    ck_assert_int_lt(c[1]->n, c[0]->n/100);
+    for (int i = 0; i < c[1]->n; ++i) ck_assert_int_gt(c[1]->cell[i].n_atoms,0);
+
+    // the neighbor lists should be identical, including the order
+    for (int k = 1; k < 3; ++k) {
+        ck_assert(memcmp(nb[k]->offset, nb[0]->offset, sizeof(int)*(n+1)) == 0);
+        ck_assert(memcmp(nb[k]->nb, nb[0]->nb, sizeof(int)*nb[0]->offset[n]) == 0);
+        ck_assert(memcmp(nb[k]->xyd, nb[0]->xyd, sizeof(double)*nb[0]->offset[n]) == 0);
+    }
+    ck_assert_int_eq(nb[0]->nn[n-1],0);
+    ck_assert_int_gt(nb[0]->offset[n],n);
+
+    for (int k = 0; k < 3; ++k) {
+        cell_list_free(c[k]);
+        freesasa_nb_free(nb[k]);
+    }
+    freesasa_coord_free(coord);
+}
+END_TEST
+
 TCase *
 test_nb_static()
 {
     TCase *tc = tcase_create("nb.c static");
     tcase_add_test(tc, test_cell);
+    tcase_add_test(tc, test_cell_sparse);
 
     return tc;
 }
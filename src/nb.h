@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include "coord.h"
+#include "freesasa.h"
 /**
    @file
    @author Simon Mitternacht
@@ -13,17 +14,100 @@
    demonstrated in sasa_lr.c and sasa_sr.c).
  */
 
-//! Neighbor list
+/**
+   How the distances between neighbors are stored in ::nb_list.
+
+   With ::NB_FULL the distances are stored for each neighbor of each
+   element, i.e. twice for each pair. With ::NB_HALF they are stored
+   once for each pair, and the neighbors refer to them through
+   nb_list::pair, the opposite direction has the signs of xd and yd
+   flipped. This saves 16 of 56 bytes per pair, at the cost
+   of an indirection when reading the distances. With ::NB_INDICES
+   only the neighbors themselves are stored, for algorithms that don't
+   use the distances.
+
+   The distances of ::NB_FULL and ::NB_HALF can also be stored as
+   float instead of double (see freesasa_nb_new_storage()), which
+   halves their size (the list then uses 32 and 28 bytes per pair
+   respectively). This is intended for calculations in single
+   precision (::FREESASA_SINGLE_PRECISION).
+ */
+typedef enum {
+    NB_FULL=0, //!< Distances for each neighbor of each element
+    NB_HALF, //!< Distances for each pair, see nb_list::pair
+    NB_INDICES, //!< No distances
+} nb_storage;
+
+/**
+   Neighbor list, in compressed sparse row format.
+
+   The neighbors of element i are stored at positions offset[i] to
+   offset[i+1]-1 of the array nb, i.e. the neighbors of i are
+   nb[offset[i]], nb[offset[i]+1], etc. With ::NB_FULL storage the
+   arrays xyd, xd and yd are indexed the same way. With ::NB_HALF they
+   are indexed by pair: if k = pair[p] >= 0 the distances of neighbor
+   p are xyd[k], xd[k] and yd[k], else they are xyd[~k], -xd[~k] and
+   -yd[~k]. The functions freesasa_nb_xyd(), freesasa_nb_xd() and
+   freesasa_nb_yd() handle both cases, and also single precision,
+   where the distances are in xydf, xdf and ydf instead (indexed the
+   same way), and xyd, xd and yd are NULL. With ::NB_INDICES all the
+   distance arrays are NULL. The arrays are contiguous and aligned to
+   cache lines.
+ */
 typedef struct {
     int n; //!< number of elements
-    int **nb; //!< neighbors to each element
+    nb_storage storage; //!< how the distances are stored
+    int *offset; //!< start of the neighbors of each element in the arrays below (n+1 elements)
     int *nn; //!< number of neighbors to each element
-    double **xyd; //!< distance between neighbors in xy-plane
-    double **xd; //!< signed distance between neighbors along x-axis
-    double **yd; //!< signed distance between neighbors along y-axis
-    int *capacity; //!< keeps track of memory chunks (don't change this)
+    int *nb; //!< neighbors
+    int *pair; //!< pair of each neighbor, ~pair if reversed (only ::NB_HALF, else NULL)
+    double *xyd; //!< distance between neighbors in xy-plane
+    double *xd; //!< signed distance between neighbors along x-axis
+    double *yd; //!< signed distance between neighbors along y-axis
+    float *xydf; //!< xyd in single precision (only in single precision, else NULL)
+    float *xdf; //!< xd in single precision (only in single precision, else NULL)
+    float *ydf; //!< yd in single precision (only in single precision, else NULL)
+    void *block; //!< the memory block of the arrays (don't change this)
 } nb_list;
 
+//! Position of the distances of neighbor p in the distance arrays (::NB_FULL or ::NB_HALF)
+static inline int
+freesasa_nb_pos(const nb_list *nb,
+                int p)
+{
+    if (nb->pair == NULL) return p;
+    return nb->pair[p] >= 0 ? nb->pair[p] : ~nb->pair[p];
+}
+
+//! Distance in the xy-plane to neighbor p (::NB_FULL or ::NB_HALF)
+static inline double
+freesasa_nb_xyd(const nb_list *nb,
+                int p)
+{
+    const int k = freesasa_nb_pos(nb, p);
+    return nb->xydf ? nb->xydf[k] : nb->xyd[k];
+}
+
+//! Signed distance along the x-axis to neighbor p (::NB_FULL or ::NB_HALF)
+static inline double
+freesasa_nb_xd(const nb_list *nb,
+               int p)
+{
+    const int k = freesasa_nb_pos(nb, p);
+    const double xd = nb->xdf ? nb->xdf[k] : nb->xd[k];
+    return nb->pair && nb->pair[p] < 0 ? -xd : xd;
+}
+
+//! Signed distance along the y-axis to neighbor p (::NB_FULL or ::NB_HALF)
+static inline double
+freesasa_nb_yd(const nb_list *nb,
+               int p)
+{
+    const int k = freesasa_nb_pos(nb, p);
+    const double yd = nb->ydf ? nb->ydf[k] : nb->yd[k];
+    return nb->pair && nb->pair[p] < 0 ? -yd : yd;
+}
+
 /**
     Creates a neigbor list based on a set of coordinates with
     corresponding sphere radii. 
@@ -33,15 +117,43 @@ typedef struct {
     using this list the members of the returned struct should be used
     directly and not freesasa_nb_contact().
 
+    Large lists are built in parallel if n_threads > 1 and the
+    library was compiled with thread support. The result does not
+    depend on the number of threads. The distances are stored with
+    ::NB_FULL, see freesasa_nb_new_storage() for the alternatives.
+
     @param coord a set of coordinates
     @param radii radii for the coordinates
+    @param n_threads maximum number of threads to use
     @return a neigbor list. Returns NULL if either argument is null or
       if there were any problems constructing the list (see error
       messages).
  */
 nb_list *
 freesasa_nb_new(const coord_t *coord,
-                const double *radii);
+                const double *radii,
+                int n_threads);
+
+/**
+    Same as freesasa_nb_new(), but with a choice of how the distances
+    between neighbors are stored.
+
+    @param coord a set of coordinates
+    @param radii radii for the coordinates
+    @param n_threads maximum number of threads to use
+    @param storage how to store the distances
+    @param single if 1 the distances are stored in single precision,
+      in nb_list::xydf, nb_list::xdf and nb_list::ydf (ignored with
+      ::NB_INDICES)
+    @return a neigbor list, NULL if either argument is null or if
+      there were any problems constructing the list.
+ */
+nb_list *
+freesasa_nb_new_storage(const coord_t *coord,
+                        const double *radii,
+                        int n_threads,
+                        nb_storage storage,
+                        int single);
 
 /**
     Frees a neigbor list created by freesasa_nb_new().
@@ -51,6 +163,34 @@ freesasa_nb_new(const coord_t *coord,
 void
 freesasa_nb_free(nb_list *nb);
 
+/**
+    Updates a Verlet list for new coordinates and returns the
+    neighbor list for them.
+
+    The candidate neighbors are only searched for again if the radii
+    or the number of atoms have changed, or if any atom has moved more
+    than half the skin since the last search. Otherwise the neighbor
+    list is obtained by checking the distances of the candidates,
+    which is much cheaper.
+
+    @param v The Verlet list
+    @param coord a set of coordinates
+    @param radii radii for the coordinates
+    @param n_threads maximum number of threads to use if the
+      candidates have to be searched for again
+    @param single if 1 the distances are stored in single precision
+      (the list always has ::NB_FULL storage). The candidates are
+      searched for again if it differs from the previous update.
+    @return The neighbor list, which is owned by v and valid until the
+      next update, or NULL if memory allocation failed.
+ */
+nb_list *
+freesasa_verlet_list_update(freesasa_verlet_list *v,
+                            const coord_t *coord,
+                            const double *radii,
+                            int n_threads,
+                            int single);
+
 /**
     Checks if two atoms are in contact. Only included for reference.
 
@@ -64,4 +204,157 @@ freesasa_nb_contact(const nb_list *nb,
                     int i,
                     int j);
 
+/**
+    Sorts the neighbors of each sphere by the fraction of its surface
+    they bury, largest first.
+
+    Algorithms that stop at the first neighbor that buries a given
+    point (such as S&R) then usually need fewer tests. The fractions
+    are divided into a fixed number of classes, the order within each
+    class is the original one. The neighbors are only reordered, all
+    other properties of the list are preserved.
+
+    @param nb neighbor list to sort
+    @param coord the coordinates used to calculate the list
+    @param radii the radii used to calculate the list
+    @return ::FREESASA_SUCCESS. ::FREESASA_FAIL if memory allocation
+      failed, the list is then unchanged.
+ */
+int
+freesasa_nb_sort(nb_list *nb,
+                 const coord_t *coord,
+                 const double *radii);
+
+/**
+    Finds spheres that are completely buried by their neighbors.
+
+    The test is conservative: a sphere is only marked as buried if
+    its surface is covered by the neighbors with some margin, spheres
+    that are only barely buried might not be detected. The cost is
+    small compared to an S&R or L&R calculation for the same spheres.
+
+    @param buried Array where buried[i] is set to 1 if sphere i is
+      buried and 0 else. The user has to make sure it is large enough.
+    @param coord a set of coordinates
+    @param radii radii for the coordinates
+    @param nb neighbor list calculated with the same coordinates and radii
+    @return The number of buried spheres.
+ */
+int
+freesasa_nb_buried(char *buried,
+                   const coord_t *coord,
+                   const double *radii,
+                   const nb_list *nb);
+
+/**
+    Sorts the neighbors of sphere i, like freesasa_nb_sort() does for
+    all spheres.
+
+    @param nb neighbor list to sort
+    @param coord the coordinates used to calculate the list
+    @param radii the radii used to calculate the list
+    @param i the sphere
+ */
+void
+freesasa_nb_sort_atom(nb_list *nb,
+                      const coord_t *coord,
+                      const double *radii,
+                      int i);
+
+/**
+   Neighbor search without a stored neighbor list.
+
+   The neighbors of each sphere are found when it is processed, using
+   a cell list, and stored in a small list owned by the thread that
+   processes it. Each thread handles a contiguous range of cells.
+   The memory use is proportional to the number of spheres plus the
+   number of threads times the largest number of neighbors, instead
+   of the total number of neighbors.
+ */
+typedef struct nb_search nb_search;
+
+/**
+    Creates a neighbor search.
+
+    @param coord a set of coordinates
+    @param radii radii for the coordinates
+    @param n_threads number of threads to use (1 if the library was
+      compiled without thread support)
+    @param storage ::NB_FULL or ::NB_INDICES
+    @return the search, NULL if memory allocation failed.
+ */
+nb_search *
+freesasa_nb_search_new(const coord_t *coord,
+                       const double *radii,
+                       int n_threads,
+                       nb_storage storage);
+
+/**
+    Frees a neighbor search.
+
+    @param s The search, can be NULL
+ */
+void
+freesasa_nb_search_free(nb_search *s);
+
+/**
+    The number of threads of a neighbor search.
+
+    @param s The search
+    @return The number of threads
+ */
+int
+freesasa_nb_search_n_threads(const nb_search *s);
+
+/**
+    The neighbor list of thread t.
+
+    When thread t processes sphere i, the neighbors of i are stored in
+    the list as usual, i.e. nn[i] neighbors starting at offset[i]
+    (always 0). The other spheres have no valid neighbors in the list,
+    and offset[i+1] is not the end of the neighbors of i. The pointer
+    stays the same during the lifetime of the search, but the arrays
+    of the list can be reallocated when the neighbors of a new sphere
+    are stored.
+
+    @param s The search
+    @param t The thread
+    @return The list
+ */
+nb_list *
+freesasa_nb_search_list(nb_search *s,
+                        int t);
+
+/**
+    Runs a function for each sphere, in parallel. The neighbors of
+    the sphere are stored in the list of the thread before the
+    function is called, see freesasa_nb_search_list().
+
+    @param s The search
+    @param atom The function, called with data, the thread and the
+      sphere. Different threads call it simultaneously.
+    @param data Passed on to the function
+    @return ::FREESASA_SUCCESS. ::FREESASA_FAIL if memory allocation or
+      thread creation failed (then not all spheres are processed).
+ */
+int
+freesasa_nb_search_run(nb_search *s,
+                       void (*atom)(void *data, int t, int i),
+                       void *data);
+
+/**
+    Checks if sphere i is completely buried, using the same test as
+    freesasa_nb_buried(). Should only be called for the sphere that
+    thread t is processing.
+
+    @param s The search
+    @param t The thread
+    @param i The sphere
+    @return 1 if buried, 0 else.
+ */
+int
+freesasa_nb_search_buried(const nb_search *s,
+                          int t,
+                          int i);
+
 #endif /* FREESASA_NB_H*/
@@ -0,0 +1,860 @@
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "freesasa_internal.h"
+#include "nb.h"
+
+/* The area of each atom is calculated exactly, using the Gauss-Bonnet
+   theorem. Each neighbor covers a cap of the sphere of atom i (the
+   sphere is scaled to unit radius during the calculation). The
+   exposed part of the sphere, i.e. the complement of the union of the
+   caps, is bounded by arcs of the cap circles. If the caps are
+   described by the cosine g_j and sine s_j of their angular radius,
+   the exposed area is
+
+       A = 2 pi chi + sum_j g_j Phi_j - sum_v psi_v,
+
+   where Phi_j is the total exposed arc length (as an angle) along
+   circle j, psi_v is the exterior angle of the boundary at each
+   vertex v where two arcs meet, and chi is the Euler characteristic
+   of the exposed region. The latter is obtained as chi = B + 2 - 2N,
+   where B is the number of closed boundary curves and N the number of
+   connected components of the union of caps.
+
+   The arcs are found by calculating the interval of each circle that
+   is covered by each other cap. The vertices are labelled by the two
+   circles that intersect there, and on which side of the plane
+   through the centers of the two caps they are. The arc ending at a
+   vertex and the arc starting there have the same label, which is
+   used to link the arcs into closed curves.
+
+   In degenerate cases, for example when three circles intersect at
+   one point, or when two circles are tangent to each other, the
+   construction breaks down. This is detected by checking that the
+   arcs form closed curves and that vertices along a circle are well
+   separated. Those atoms are calculated with high resolution L&R
+   instead, which is the only approximation used.
+
+   The gradient of the area follows from how the exposed arcs move
+   when the neighbors move. If neighbor j is displaced by dx, the
+   boundary of the exposed region along circle j moves by
+   (x - x_j).dx / |P(x - x_j)| in the direction away from the cap,
+   where x is the point on the arc and P projects onto the tangent
+   plane of the sphere. The denominator is constant along the circle,
+   and integrating along the exposed arcs gives
+
+       dA_i/dx_j = -(R_i/d) [(R_i g_j - d) u_j Phi_j
+                             + R_i s_j (e1_j S_j + e2_j C_j)],
+
+   where d is the distance between the atoms, e1_j and e2_j span the
+   plane of the circle, and S_j and C_j are the sums of sin(b) -
+   sin(a) and cos(a) - cos(b) for the exposed arcs [a,b]. Since the
+   area doesn't change when all atoms move together, dA_i/dx_i is
+   minus the sum of the above. Atoms with degenerate geometry don't
+   contribute to the gradient. */
+
+// snap to 'fully covered' or 'not covered' if the cosine of half the
+// covered interval of a circle is this close to -1 or 1
+#define AN_EPS_COVER 1e-12
+// minimal separation (radians) between vertices along a circle
+#define AN_EPS_ARC 1e-9
+// caps with smaller sine of the angular radius than this are ignored
+#define AN_EPS_CAP 1e-6
+// caps with centers closer than this (sine of angle) are treated as concentric
+#define AN_EPS_AXIS 1e-10
+// allowed round-off in the area (unit sphere) before clamping
+#define AN_EPS_AREA 1e-6
+// resolution of the L&R calculation used for degenerate atoms
+#define AN_FALLBACK_SLICES 2000
+
+typedef struct {
+    int n_atoms;
+    double *radii; //including probe
+    const coord_t *xyz;
+    nb_list *adj;
+    freesasa_verlet_list *verlet; // adj belongs to it if not NULL
+    char *buried; // atoms known to be buried, skipped in the calculation
+    double *sasa; // results
+    double *gradient; // gradient of the total area (3 per atom), NULL if not needed
+} an_data;
+
+// an interval of circle 'circle' covered by cap 'cap'
+typedef struct {
+    int circle, cap;
+    double start, length; // angle where the interval starts, and its length
+    double psi; // exterior angle at the vertices of the interval
+} an_interval;
+
+// a pair of caps whose circles intersect, with the cosine of the
+// angle between the centers, and the cosines of half the intervals of
+// the circles that the other cap covers (see cap_pair())
+typedef struct {
+    int j, k;
+    double c, qjk, qkj;
+} an_pair;
+
+// an exposed arc, between two vertex labels
+typedef struct {
+    int start, end;
+} an_arc;
+
+// buffers reused between atoms, grown when needed
+typedef struct {
+    an_interval *iv, *iv_sorted;
+    an_pair *pair;
+    an_arc *arc;
+    int *next;
+    int capacity;
+} an_workspace;
+
+typedef struct {
+    int n_fallback;
+    int status;
+    double *gradient; // the contributions to the gradient from these atoms
+    an_data *an;
+} an_thread_interval;
+
+#if USE_THREADS
+static int an_do_threads(int n_threads, an_data *an, int *n_fallback);
+static void an_range(void *data, int first, int end);
+#endif
+
+static void
+release_an(an_data *an)
+{
+    free(an->radii);
+    free(an->buried);
+    if (!an->verlet) freesasa_nb_free(an->adj);
+    an->radii = NULL;
+    an->buried = NULL;
+    an->adj = NULL;
+}
+
+static int
+init_an(an_data *an,
+        double *sasa,
+        const coord_t *xyz,
+        const double *atom_radii,
+        double probe_radius,
+        int n_threads,
+        freesasa_verlet_list *verlet)
+{
+    const int n_atoms = freesasa_coord_n(xyz);
+
+    an->n_atoms = n_atoms;
+    an->xyz = xyz;
+    an->adj = NULL;
+    an->verlet = verlet;
+    an->buried = NULL;
+    an->sasa = sasa;
+    an->gradient = NULL;
+
+    an->radii = malloc(sizeof(double)*n_atoms);
+    if (an->radii == NULL) {
+        return mem_fail();
+    }
+
+    for (int i = 0; i < n_atoms; ++i) {
+        an->radii[i] = atom_radii[i] + probe_radius;
+        sasa[i] = 0.;
+    }
+
+    // only the neighbors are needed, not their distances
+    if (verlet) an->adj = freesasa_verlet_list_update(verlet, xyz, an->radii, n_threads, 0);
+    else an->adj = freesasa_nb_new_storage(xyz, an->radii, n_threads, NB_INDICES, 0);
+    if (an->adj == NULL) {
+        release_an(an);
+        return FREESASA_FAIL;
+    }
+
+    an->buried = malloc(n_atoms);
+    if (an->buried == NULL) {
+        release_an(an);
+        return mem_fail();
+    }
+    freesasa_debug("Analytical: %d of %d atoms completely buried, skipped",
+                   freesasa_nb_buried(an->buried, xyz, an->radii, an->adj), n_atoms);
+
+    return FREESASA_SUCCESS;
+}
+
+static void
+workspace_free(an_workspace *ws)
+{
+    free(ws->iv);
+    free(ws->iv_sorted);
+    free(ws->pair);
+    free(ws->arc);
+    free(ws->next);
+    ws->iv = ws->iv_sorted = NULL;
+    ws->pair = NULL;
+    ws->arc = NULL;
+    ws->next = NULL;
+    ws->capacity = 0;
+}
+
+/** Makes sure the buffers of the workspace can store n intervals
+    (and pairs) */
+static int
+workspace_reserve(an_workspace *ws,
+                  int n)
+{
+    if (n <= ws->capacity) return FREESASA_SUCCESS;
+
+    int capacity = 2*n;
+    an_interval *iv = realloc(ws->iv, sizeof(an_interval)*capacity);
+    if (iv == NULL) return mem_fail();
+    ws->iv = iv;
+    iv = realloc(ws->iv_sorted, sizeof(an_interval)*capacity);
+    if (iv == NULL) return mem_fail();
+    ws->iv_sorted = iv;
+    an_pair *pair = realloc(ws->pair, sizeof(an_pair)*capacity);
+    if (pair == NULL) return mem_fail();
+    ws->pair = pair;
+    an_arc *arc = realloc(ws->arc, sizeof(an_arc)*capacity);
+    if (arc == NULL) return mem_fail();
+    ws->arc = arc;
+    int *next = realloc(ws->next, sizeof(int)*capacity);
+    if (next == NULL) return mem_fail();
+    ws->next = next;
+    ws->capacity = capacity;
+
+    return FREESASA_SUCCESS;
+}
+
+/** Calculates the area of atom i with high resolution L&R, using only
+    the atom and its neighbors. Returns a negative value on failure. */
+static double
+atom_area_fallback(const an_data *an,
+                   int i)
+{
+    const int nn = an->adj->nn[i];
+    const int *nb = an->adj->nb + an->adj->offset[i];
+    double *xyz = malloc(sizeof(double)*3*(nn+1));
+    double *r = malloc(sizeof(double)*(nn+1));
+    double *sasa = malloc(sizeof(double)*(nn+1));
+    coord_t *c = NULL;
+    freesasa_parameters param = freesasa_default_parameters;
+    double area = -1;
+
+    if (xyz == NULL || r == NULL || sasa == NULL) {
+        mem_fail();
+        goto cleanup;
+    }
+
+    memcpy(xyz, freesasa_coord_i(an->xyz, i), sizeof(double)*3);
+    r[0] = an->radii[i];
+    for (int n = 0; n < nn; ++n) {
+        memcpy(xyz + 3*(n+1), freesasa_coord_i(an->xyz, nb[n]), sizeof(double)*3);
+        r[n+1] = an->radii[nb[n]];
+    }
+
+    c = freesasa_coord_new_linked(xyz, nn+1);
+    if (c == NULL) {
+        fail_msg("");
+        goto cleanup;
+    }
+
+    param.alg = FREESASA_LEE_RICHARDS;
+    param.probe_radius = 0;
+    param.lee_richards_n_slices = AN_FALLBACK_SLICES;
+    param.n_threads = 1;
+    if (freesasa_lee_richards(sasa, c, r, &param, NULL) != FREESASA_FAIL)
+        area = sasa[0];
+
+ cleanup:
+    freesasa_coord_free(c);
+    free(sasa);
+    free(r);
+    free(xyz);
+    return area;
+}
+
+static int
+uf_find(int *parent,
+        int i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static void
+uf_union(int *parent,
+         int i,
+         int j)
+{
+    i = uf_find(parent, i);
+    j = uf_find(parent, j);
+    if (i < j) parent[j] = i;
+    else parent[i] = j;
+}
+
+static int
+compare_arc(const void *a,
+            const void *b)
+{
+    const an_arc *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+// label of the vertex of circles j and k, sign is 1 if it's on the
+// positive side of u_min x u_max, with nc circles
+static inline int
+vertex_label(int j,
+             int k,
+             int sign,
+             int nc)
+{
+    return j < k ? 2*(j*nc + k) + sign : 2*(k*nc + j) + sign;
+}
+
+/** Determines how caps j and k overlap. Circles that are covered
+    completely by the other cap are marked, overlapping caps are
+    joined in the union-find structure, and if any of the circles is
+    partially covered, the pair is appended to pair. Returns 1 if the
+    geometry is degenerate, 0 else. */
+static int
+cap_pair(int j,
+         int k,
+         const double (*u)[3],
+         const double *g,
+         const double *s,
+         char *covered,
+         int *parent,
+         an_pair *pair,
+         int *n_pair)
+{
+    const double c = u[j][0]*u[k][0] + u[j][1]*u[k][1] + u[j][2]*u[k][2];
+
+    // quick exit for caps that are clearly disjoint (i.e. the angle
+    // between the centers is larger than the sum of the angular radii)
+    if (g[j] + g[k] > 0 && c < g[j]*g[k] - s[j]*s[k]) return 0;
+
+    const double cx = u[j][1]*u[k][2] - u[j][2]*u[k][1],
+        cy = u[j][2]*u[k][0] - u[j][0]*u[k][2],
+        cz = u[j][0]*u[k][1] - u[j][1]*u[k][0],
+        m = sqrt(cx*cx + cy*cy + cz*cz);
+
+    if (m < AN_EPS_AXIS) {
+        double wj = acos(g[j]), wk = acos(g[k]);
+        if (c > 0) {
+            // concentric, the smaller is covered, of equal caps the
+            // one with the larger index
+            if (fabs(wj - wk) >= AN_EPS_ARC && wj < wk) covered[j] = 1;
+            else covered[k] = 1;
+            uf_union(parent, j, k);
+        } else {
+            // antipodal, either disjoint or both circles covered
+            if (fabs(wj + wk - M_PI) < AN_EPS_ARC) return 1;
+            if (wj + wk > M_PI) {
+                covered[j] = covered[k] = 1;
+                uf_union(parent, j, k);
+            }
+        }
+        return 0;
+    }
+
+    // circle j is covered by cap k in the interval where the cosine
+    // of the angle to the projection of the center of k is larger than qjk
+    const double qjk = (g[k] - g[j]*c) / (s[j]*m),
+        qkj = (g[j] - g[k]*c) / (s[k]*m);
+
+    if (qjk >= 1 - AN_EPS_COVER && qkj >= 1 - AN_EPS_COVER) return 0;
+    uf_union(parent, j, k);
+
+    if (qjk <= -1 + AN_EPS_COVER) covered[j] = 1;
+    if (qkj <= -1 + AN_EPS_COVER) covered[k] = 1;
+    if (fabs(qjk) < 1 - AN_EPS_COVER || fabs(qkj) < 1 - AN_EPS_COVER) {
+        pair[*n_pair] = (an_pair){.j = j, .k = k, .c = c, .qjk = qjk, .qkj = qkj};
+        ++(*n_pair);
+    }
+    return 0;
+}
+
+/** Adds the intervals covered by the other cap, for the circles of a
+    pair that are not completely covered by any cap */
+static void
+pair_intervals(const an_pair *p,
+               const double (*u)[3],
+               const double (*e1)[3],
+               const double (*e2)[3],
+               const double *g,
+               const double *s,
+               const char *covered,
+               an_interval *iv,
+               int *n_iv)
+{
+    const int j = p->j, k = p->k;
+    const int partial_j = !covered[j] && fabs(p->qjk) < 1 - AN_EPS_COVER,
+        partial_k = !covered[k] && fabs(p->qkj) < 1 - AN_EPS_COVER;
+
+    if (!partial_j && !partial_k) return;
+
+    // exterior angle of the boundary where the circles intersect
+    double cos_psi = (p->c - g[j]*g[k]) / (s[j]*s[k]);
+    cos_psi = cos_psi > 1 ? 1 : (cos_psi < -1 ? -1 : cos_psi);
+    const double psi = acos(cos_psi);
+
+    if (partial_j) {
+        double tau = atan2(u[k][0]*e2[j][0] + u[k][1]*e2[j][1] + u[k][2]*e2[j][2],
+                           u[k][0]*e1[j][0] + u[k][1]*e1[j][1] + u[k][2]*e1[j][2]),
+            w = acos(p->qjk);
+        iv[*n_iv] = (an_interval){.circle = j, .cap = k, .start = tau - w,
+                                  .length = 2*w, .psi = psi};
+        ++(*n_iv);
+    }
+    if (partial_k) {
+        double tau = atan2(u[j][0]*e2[k][0] + u[j][1]*e2[k][1] + u[j][2]*e2[k][2],
+                           u[j][0]*e1[k][0] + u[j][1]*e1[k][1] + u[j][2]*e1[k][2]),
+            w = acos(p->qkj);
+        iv[*n_iv] = (an_interval){.circle = k, .cap = j, .start = tau - w,
+                                  .length = 2*w, .psi = psi};
+        ++(*n_iv);
+    }
+}
+
+/** Finds the exposed arcs of a circle, given the n intervals covered
+    by other caps (which are reordered). The arcs are appended to
+    arc. If trig is not NULL, the sums S_j and C_j needed for the
+    gradient are added to trig[0] and trig[1]. Returns 1 if the
+    geometry is degenerate, 0 else. */
+static int
+circle_arcs(int j,
+            int nc,
+            an_interval *restrict iv,
+            int n,
+            an_arc *restrict arc,
+            int *n_arc,
+            double *phi,
+            double *psi,
+            double *trig)
+{
+    const double ref = iv[0].start;
+    double max_end = -1;
+    int max_cap = -1;
+
+    // start angles relative to the first interval, in [0,2pi), sorted
+    for (int a = 0; a < n; ++a) {
+        double start = fmod(iv[a].start - ref, 2*M_PI);
+        if (start < 0) start += 2*M_PI;
+        iv[a].start = start;
+        if (start + iv[a].length > max_end) {
+            max_end = start + iv[a].length;
+            max_cap = iv[a].cap;
+        }
+    }
+    for (int a = 1; a < n; ++a) {
+        an_interval tmp = iv[a];
+        int b = a - 1;
+        while (b >= 0 && iv[b].start > tmp.start) {
+            iv[b+1] = iv[b];
+            --b;
+        }
+        iv[b+1] = tmp;
+    }
+
+    // sweep along the circle, starting with the coverage that wraps
+    // around from the end
+    double end = max_end - 2*M_PI;
+    int cap = max_cap;
+    for (int a = 0; a < n; ++a) {
+        double start = iv[a].start, new_end = start + iv[a].length;
+        if (start > end + AN_EPS_ARC) {
+            // exposed arc from the end of the cover of 'cap', to the
+            // start of the cover of iv[a].cap
+            int k = iv[a].cap;
+            arc[*n_arc].start = vertex_label(j, cap, j < cap, nc);
+            arc[*n_arc].end = vertex_label(j, k, j > k, nc);
+            ++(*n_arc);
+            *phi += start - end;
+            *psi += iv[a].psi;
+            if (trig) {
+                trig[0] += sin(start + ref) - sin(end + ref);
+                trig[1] += cos(end + ref) - cos(start + ref);
+            }
+        } else if (start > end - AN_EPS_ARC) {
+            return 1;
+        }
+        if (new_end > end + AN_EPS_ARC) {
+            end = new_end;
+            cap = iv[a].cap;
+        } else if (new_end > end - AN_EPS_ARC) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Counts the closed curves formed by the arcs. Returns -1 if they
+    don't form closed curves. */
+static int
+count_cycles(an_arc *arc,
+             int *next,
+             int n)
+{
+    int n_cycles = 0;
+
+    qsort(arc, n, sizeof(an_arc), compare_arc);
+    for (int a = 1; a < n; ++a) {
+        if (arc[a].start == arc[a-1].start) return -1;
+    }
+
+    // next[a] is the arc following arc a, marked by ~ when visited
+    for (int a = 0; a < n; ++a) next[a] = -1;
+    for (int a = 0; a < n; ++a) {
+        an_arc key = {.start = arc[a].end};
+        an_arc *b = bsearch(&key, arc, n, sizeof(an_arc), compare_arc);
+        if (b == NULL) return -1;
+        next[a] = b - arc;
+    }
+
+    for (int a = 0; a < n; ++a) {
+        if (next[a] < 0) continue;
+        int b = a, length = 0;
+        do {
+            int nb = next[b];
+            next[b] = ~nb;
+            b = nb;
+            ++length;
+        } while (b != a && next[b] >= 0 && length <= n);
+        if (b != a) return -1;
+        ++n_cycles;
+    }
+    return n_cycles;
+}
+
+/** Returns the area of atom i. If the geometry is degenerate,
+    *degenerate is set to 1 and the return value is undefined. On
+    memory failure a negative value is returned. If gradient is not
+    NULL, the derivatives of the area are added to it (3 per atom). */
+static double
+atom_area(const an_data *an,
+          an_workspace *ws,
+          int i,
+          int *degenerate,
+          double *gradient)
+{
+    const int nn = an->adj->nn[i];
+    const int *restrict nb = an->adj->nb + an->adj->offset[i];
+    const double *restrict v = freesasa_coord_all(an->xyz);
+    const double ri = an->radii[i];
+    const double xi = v[3*i], yi = v[3*i+1], zi = v[3*i+2];
+    double u[nn][3], e1[nn][3], e2[nn][3], g[nn], s[nn], dist[nn];
+    int parent[nn], cap_atom[nn];
+    char covered[nn];
+    int nc = 0;
+
+    *degenerate = 0;
+
+    // the caps, as seen from atom i
+    for (int n = 0; n < nn; ++n) {
+        const int j = nb[n];
+        const double rj = an->radii[j];
+        const double dx = v[3*j] - xi, dy = v[3*j+1] - yi, dz = v[3*j+2] - zi;
+        const double d = sqrt(dx*dx + dy*dy + dz*dz);
+
+        if (d + ri <= rj) return 0;
+        if (d + rj <= ri) continue;
+
+        const double gj = (ri*ri + d*d - rj*rj) / (2*ri*d);
+        if (gj >= 1) continue;
+        if (gj <= -1) return 0;
+        const double sj = sqrt(1 - gj*gj);
+        if (sj < AN_EPS_CAP) {
+            if (gj > 0) continue;
+            return 0;
+        }
+
+        g[nc] = gj;
+        s[nc] = sj;
+        dist[nc] = d;
+        cap_atom[nc] = j;
+        u[nc][0] = dx/d; u[nc][1] = dy/d; u[nc][2] = dz/d;
+
+        // right-handed orthonormal basis u, e1, e2
+        double a[3] = {0, 0, 0};
+        if (fabs(u[nc][0]) < fabs(u[nc][1]) && fabs(u[nc][0]) < fabs(u[nc][2])) a[0] = 1;
+        else if (fabs(u[nc][1]) < fabs(u[nc][2])) a[1] = 1;
+        else a[2] = 1;
+        double x = u[nc][1]*a[2] - u[nc][2]*a[1],
+            y = u[nc][2]*a[0] - u[nc][0]*a[2],
+            z = u[nc][0]*a[1] - u[nc][1]*a[0],
+            norm = sqrt(x*x + y*y + z*z);
+        e1[nc][0] = x/norm; e1[nc][1] = y/norm; e1[nc][2] = z/norm;
+        e2[nc][0] = u[nc][1]*e1[nc][2] - u[nc][2]*e1[nc][1];
+        e2[nc][1] = u[nc][2]*e1[nc][0] - u[nc][0]*e1[nc][2];
+        e2[nc][2] = u[nc][0]*e1[nc][1] - u[nc][1]*e1[nc][0];
+
+        parent[nc] = nc;
+        covered[nc] = 0;
+        ++nc;
+    }
+
+    if (nc == 0) return 4*M_PI*ri*ri;
+
+    double phi_j[nc], trig[nc][2];
+
+    // the overlapping caps, and then the covered intervals of each
+    // circle, skipping the circles that are completely covered
+    if (workspace_reserve(ws, nc*(nc-1))) return -1;
+    int n_pair = 0, n_iv = 0;
+    for (int j = 0; j < nc; ++j) {
+        for (int k = j + 1; k < nc; ++k) {
+            if (cap_pair(j, k, (const double (*)[3]) u, g, s, covered, parent,
+                         ws->pair, &n_pair)) {
+                *degenerate = 1;
+                return 0;
+            }
+        }
+    }
+    for (int p = 0; p < n_pair; ++p) {
+        pair_intervals(ws->pair + p, (const double (*)[3]) u, (const double (*)[3]) e1,
+                       (const double (*)[3]) e2, g, s, covered, ws->iv, &n_iv);
+    }
+
+    // sort the intervals by circle
+    int first[nc+1];
+    memset(first, 0, sizeof(int)*(nc+1));
+    for (int a = 0; a < n_iv; ++a) ++first[ws->iv[a].circle + 1];
+    for (int j = 0; j < nc; ++j) first[j+1] += first[j];
+    {
+        int pos[nc];
+        memcpy(pos, first, sizeof(int)*nc);
+        for (int a = 0; a < n_iv; ++a) ws->iv_sorted[pos[ws->iv[a].circle]++] = ws->iv[a];
+    }
+
+    // the exposed arcs
+    int n_arc = 0, n_full = 0, n_union = 0;
+    double sum = 0, psi = 0;
+    for (int j = 0; j < nc; ++j) {
+        if (parent[j] == j) ++n_union;
+        phi_j[j] = trig[j][0] = trig[j][1] = 0;
+        if (covered[j]) continue;
+        if (first[j] == first[j+1]) {
+            ++n_full;
+            phi_j[j] = 2*M_PI;
+        } else if (circle_arcs(j, nc, ws->iv_sorted + first[j], first[j+1] - first[j],
+                               ws->arc, &n_arc, &phi_j[j], &psi,
+                               gradient ? trig[j] : NULL)) {
+            *degenerate = 1;
+            return 0;
+        }
+        sum += g[j]*phi_j[j];
+    }
+
+    int n_cycles = count_cycles(ws->arc, ws->next, n_arc);
+    if (n_cycles < 0) {
+        *degenerate = 1;
+        return 0;
+    }
+
+    // uf_union() always links to the smaller index, so roots are the
+    // only elements with parent[j] == j
+    double area = 2*M_PI*(n_cycles + n_full + 2 - 2*n_union) + sum - psi;
+    if (area < -AN_EPS_AREA || area > 4*M_PI + AN_EPS_AREA) {
+        *degenerate = 1;
+        return 0;
+    }
+    if (area < 0) area = 0;
+    if (area > 4*M_PI) area = 4*M_PI;
+
+    if (gradient) {
+        for (int j = 0; j < nc; ++j) {
+            if (phi_j[j] == 0) continue;
+            const double a = (ri*g[j] - dist[j])*phi_j[j], b = ri*s[j],
+                f = -ri/dist[j];
+            double *gj = gradient + 3*cap_atom[j], *gi = gradient + 3*i;
+            for (int x = 0; x < 3; ++x) {
+                const double dA = f*(a*u[j][x] + b*(e1[j][x]*trig[j][0] + e2[j][x]*trig[j][1]));
+                gj[x] += dA;
+                gi[x] -= dA;
+            }
+        }
+    }
+
+    return area*ri*ri;
+}
+
+/** Calculates the areas of atoms first to last, and adds their
+    contributions to gradient, if not NULL. Returns FREESASA_FAIL on
+    memory failure, and stores the number of atoms that used the
+    fallback in n_fallback. */
+static int
+an_atom_range(an_data *an,
+              int first,
+              int last,
+              int *n_fallback,
+              double *gradient)
+{
+    an_workspace ws = {NULL, NULL, NULL, NULL, NULL, 0};
+    int return_value = FREESASA_SUCCESS, degenerate;
+
+    *n_fallback = 0;
+    for (int i = first; i <= last; ++i) {
+        if (an->buried[i]) {
+            an->sasa[i] = 0;
+            continue;
+        }
+        double area = atom_area(an, &ws, i, &degenerate, gradient);
+        if (degenerate) {
+            area = atom_area_fallback(an, i);
+            ++(*n_fallback);
+        }
+        if (area < 0) {
+            return_value = FREESASA_FAIL;
+            break;
+        }
+        an->sasa[i] = area;
+    }
+    workspace_free(&ws);
+    return return_value;
+}
+
+int
+freesasa_analytical(double *sasa,
+                    const coord_t *xyz,
+                    const double *atom_radii,
+                    const freesasa_parameters *param,
+                    freesasa_verlet_list *verlet)
+{
+    return freesasa_analytical_gradient(sasa, NULL, xyz, atom_radii, param, verlet);
+}
+
+int
+freesasa_analytical_gradient(double *sasa,
+                             double *gradient,
+                             const coord_t *xyz,
+                             const double *atom_radii,
+                             const freesasa_parameters *param,
+                             freesasa_verlet_list *verlet)
+{
+    assert(sasa);
+    assert(xyz);
+    assert(atom_radii);
+
+    if (param == NULL) param = &freesasa_default_parameters;
+
+    int return_value = FREESASA_SUCCESS,
+        n_atoms = freesasa_coord_n(xyz),
+        n_threads = param->n_threads,
+        n_fallback = 0;
+    an_data an;
+
+    if (n_atoms == 0) {
+        return freesasa_warn("in %s(): empty coordinates", __func__);
+    }
+    if (n_threads > n_atoms) {
+        n_threads = n_atoms;
+        freesasa_warn("no sense in having more threads than atoms, only using %d threads",
+                      n_threads);
+    }
+
+    if (init_an(&an, sasa, xyz, atom_radii, param->probe_radius, n_threads, verlet))
+        return FREESASA_FAIL;
+    if (gradient) {
+        an.gradient = gradient;
+        for (int i = 0; i < 3*n_atoms; ++i) gradient[i] = 0;
+    }
+
+    if (n_threads > 1) {
+#if USE_THREADS
+        if (an_do_threads(n_threads, &an, &n_fallback)) return_value = FREESASA_FAIL;
+#else
+        return_value = freesasa_warn("in %s(): program compiled for single-threaded use, "
+                                     "but multiple threads were requested, will "
+                                     "proceed in single-threaded mode\n",
+                                     __func__);
+        n_threads = 1;
+#endif /* pthread */
+    }
+    if (n_threads == 1) {
+        if (an_atom_range(&an, 0, n_atoms - 1, &n_fallback, an.gradient))
+            return_value = FREESASA_FAIL;
+    }
+    if (return_value != FREESASA_FAIL) {
+        freesasa_debug("Analytical: %d of %d atoms had degenerate geometry, "
+                       "calculated with L&R (%d slices)",
+                       n_fallback, n_atoms, AN_FALLBACK_SLICES);
+        if (gradient && n_fallback > 0)
+            return_value = freesasa_warn("%d atoms had degenerate geometry, their "
+                                         "contributions to the gradient are missing",
+                                         n_fallback);
+    }
+
+    release_an(&an);
+    return return_value;
+}
+
+#if USE_THREADS
+static int
+an_do_threads(int n_threads,
+              an_data *an,
+              int *n_fallback)
+{
+    an_thread_interval t_data[n_threads];
+    double imbalance;
+    int return_value = FREESASA_SUCCESS;
+
+    *n_fallback = 0;
+    for (int t = 0; t < n_threads; ++t) {
+        t_data[t].gradient = NULL;
+        t_data[t].status = FREESASA_SUCCESS;
+        t_data[t].n_fallback = 0;
+    }
+    for (int t = 0; t < n_threads; ++t) {
+        t_data[t].an = an;
+        // contributions to the gradient go to neighbors as well, so
+        // each thread except the first has its own array
+        if (an->gradient) {
+            t_data[t].gradient = t == 0 ? an->gradient : calloc(3*an->n_atoms, sizeof(double));
+            if (t_data[t].gradient == NULL) {
+                return_value = mem_fail();
+                break;
+            }
+        }
+    }
+    if (return_value == FREESASA_SUCCESS) {
+        // the atoms are distributed dynamically, weighted by number of neighbors
+        return_value = freesasa_thread_run_atoms(n_threads, an->n_atoms, an->adj->nn, an->buried,
+                                                 an_range, t_data, sizeof(an_thread_interval),
+                                                 &imbalance);
+        freesasa_debug("Analytical: load imbalance %.2f (slowest thread / mean)", imbalance);
+        for (int t = 0; t < n_threads; ++t) {
+            if (t_data[t].status) return_value = FREESASA_FAIL;
+            *n_fallback += t_data[t].n_fallback;
+        }
+    }
+    if (an->gradient) {
+        if (return_value == FREESASA_SUCCESS) {
+            for (int t = 1; t < n_threads; ++t) {
+                for (int i = 0; i < 3*an->n_atoms; ++i) an->gradient[i] += t_data[t].gradient[i];
+            }
+        }
+        for (int t = 1; t < n_threads; ++t) free(t_data[t].gradient);
+    }
+    return return_value;
+}
+
+static void
+an_range(void *data,
+         int first,
+         int end)
+{
+    an_thread_interval *ti = data;
+    int n_fallback;
+    /* the different threads write to different parts of the
+       array, so locking shouldn't be necessary */
+    if (an_atom_range(ti->an, first, end - 1, &n_fallback, ti->gradient))
+        ti->status = FREESASA_FAIL;
+    ti->n_fallback += n_fallback;
+}
+#endif /* USE_THREADS */
@@ -7,71 +7,186 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <math.h>
-#if USE_THREADS
-# include <pthread.h>
-#endif
+#include <stdint.h>
 
 #include "freesasa_internal.h"
 #include "nb.h"
 
+#if USE_SIMD && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define LR_X86_SIMD 1
+# include <immintrin.h>
+#else
+# define LR_X86_SIMD 0
+#endif
+
+// the SIMD kernels read up to this many entries beyond the neighbors in lr_sweep
+#define LR_SIMD_WIDTH 8
+
+// exposed_arc_length() uses bucket sort from this many arcs, and the
+// covered-bin bitmask from LR_ARCS_MASK arcs
+#define LR_ARCS_BUCKET 24
+#define LR_ARCS_MASK 32
+
+// the widest interval in z adaptive slicing accepts, as a fraction of
+// the diameter of the atom, Simpson's rule on longer intervals can
+// agree with itself by chance
+#define LR_ADAPTIVE_MAX_WIDTH 0.2
+
 const double TWOPI = 2*M_PI;
 
+typedef struct lr_data lr_data;
+
 //calculation parameters and data (results stored in *sasa)
-typedef struct {
+struct lr_data {
     int n_atoms;
     double *radii; //including probe
     const coord_t *xyz;
     nb_list *adj;
+    freesasa_verlet_list *verlet; // adj belongs to it if not NULL
+    nb_search *search; // if not NULL adj belongs to it, and only has the neighbors of one atom
+    char *buried; // atoms known to be buried, skipped in the calculation
     int n_slices_per_atom;
+    double tolerance; // for adaptive slicing, 0 for fixed slices
+    int *n_eval; // the number of slices evaluated per atom, if not NULL
     double *sasa; // results
-} lr_data;
-
-typedef struct {
-    int first_atom;
-    int last_atom;
-    lr_data *lr;
-} lr_thread_interval;
+    double (*atom_area)(lr_data *lr, int i); // the kernel
+};
 
 #if USE_THREADS
 static int lr_do_threads(int n_threads, lr_data*);
-static void *lr_thread(void *arg);
+static void lr_range(void *data, int first, int end);
 #endif
 
+static int
+lr_search(lr_data *lr);
+
 /** Returns the are of atom i */
 static double
 atom_area(lr_data *lr,int i);
 
+/** Returns the are of atom i, using adaptive slicing */
+static double
+atom_area_adaptive(lr_data *lr,int i);
+
+/** Returns the are of atom i, calculated in single precision */
+static double
+atom_area_single(lr_data *lr,int i);
+
+#if LR_X86_SIMD
+/** SIMD versions of atom_area() */
+static double
+atom_area_avx2(lr_data *lr,int i) __attribute__((target("avx2")));
+
+static double
+atom_area_avx512(lr_data *lr,int i) __attribute__((target("avx512f")));
+#endif
+
 /** Sum of exposed arcs based on buried arc intervals arc, assumes no
     intervals cross zero */
 static double
 exposed_arc_length(double *restrict arc, int n);
 
+/** Single precision version of exposed_arc_length() */
+static float
+exposed_arc_length_single(float *restrict arc, int n);
+
 /** Release contenst of lr_data pointer*/
 static void
 release_lr(lr_data *lr)
 {
     free(lr->radii);
-    freesasa_nb_free(lr->adj);
+    free(lr->buried);
+    free(lr->n_eval);
+    if (lr->search) freesasa_nb_search_free(lr->search);
+    else if (!lr->verlet) freesasa_nb_free(lr->adj);
     lr->radii = NULL;
+    lr->buried = NULL;
+    lr->n_eval = NULL;
     lr->adj = NULL;
+    lr->search = NULL;
 }
 
-/** Initialize object to be used for L&R calculation */
+/**
+    Chooses the kernel to use. Falls back on the scalar kernel with a
+    warning if the requested kernel is not available. In single
+    precision the scalar kernel is always used.
+ */
+static int
+lr_select_kernel(lr_data *lr,
+                 freesasa_lr_kernel kernel,
+                 freesasa_precision precision)
+{
+    int avx2 = 0, avx512 = 0;
+#if LR_X86_SIMD
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+    avx512 = __builtin_cpu_supports("avx512f");
+#endif
+
+    if (precision != FREESASA_DOUBLE_PRECISION && precision != FREESASA_SINGLE_PRECISION)
+        return fail_msg("illegal precision %d", precision);
+
+    lr->atom_area = atom_area;
+    switch (kernel) {
+    case FREESASA_LR_AUTO:
+#if LR_X86_SIMD
+        if (avx512) lr->atom_area = atom_area_avx512;
+        else if (avx2) lr->atom_area = atom_area_avx2;
+#endif
+        break;
+    case FREESASA_LR_SCALAR:
+        break;
+    case FREESASA_LR_AVX2:
+        if (!avx2) return freesasa_warn("AVX2 kernel for L&R not available, "
+                                        "will use scalar kernel");
+#if LR_X86_SIMD
+        lr->atom_area = atom_area_avx2;
+#endif
+        break;
+    case FREESASA_LR_AVX512:
+        if (!avx512) return freesasa_warn("AVX-512 kernel for L&R not available, "
+                                          "will use scalar kernel");
+#if LR_X86_SIMD
+        lr->atom_area = atom_area_avx512;
+#endif
+        break;
+    default:
+        return fail_msg("illegal L&R kernel %d", kernel);
+    }
+
+    if (precision == FREESASA_SINGLE_PRECISION) lr->atom_area = atom_area_single;
+
+    return FREESASA_SUCCESS;
+}
+
+/** Initialize object to be used for L&R calculation. If single is
+    set, the neighbor list stores the distances in single precision
+    (not when the neighbors are found during the calculation). */
 static int
 init_lr(lr_data *lr,
         double *sasa,
         const coord_t *xyz,
         const double *atom_radii,
         double probe_radius,
-        int n_slices_per_atom)
+        int n_slices_per_atom,
+        int n_threads,
+        freesasa_nb_storage storage,
+        int single,
+        freesasa_verlet_list *verlet)
 {
     const int n_atoms = freesasa_coord_n(xyz);
 
     lr->n_atoms = n_atoms;
     lr->xyz = xyz;
     lr->adj = NULL;
+    lr->verlet = verlet;
+    lr->search = NULL;
+    lr->buried = NULL;
     lr->n_slices_per_atom = n_slices_per_atom;
+    lr->tolerance = 0;
+    lr->n_eval = NULL;
     lr->sasa = sasa;
+    lr->atom_area = atom_area;
 
     lr->radii = malloc(sizeof(double)*n_atoms);
     if (lr->radii == NULL) {
@@ -84,13 +199,34 @@ init_lr(lr_data *lr,
         sasa[i] = 0.;
     }
 
+    lr->buried = malloc(n_atoms);
+    if (lr->buried == NULL) {
+        release_lr(lr);
+        return mem_fail();
+    }
+
+    // the neighbors are found during the calculation, see lr_search()
+    if (storage == FREESASA_NB_NONE && !verlet) {
+        lr->search = freesasa_nb_search_new(xyz, lr->radii, n_threads, NB_FULL);
+        if (lr->search == NULL) {
+            release_lr(lr);
+            return FREESASA_FAIL;
+        }
+        return FREESASA_SUCCESS;
+    }
+
     // determine which atoms are neighbours
-    lr->adj = freesasa_nb_new(xyz, lr->radii);
+    if (verlet) lr->adj = freesasa_verlet_list_update(verlet, xyz, lr->radii, n_threads, single);
+    else lr->adj = freesasa_nb_new_storage(xyz, lr->radii, n_threads,
+                                           storage == FREESASA_NB_HALF ? NB_HALF : NB_FULL,
+                                           single);
 
     if (lr->adj == NULL) {
         release_lr(lr);
         return FREESASA_FAIL;
     }
+    freesasa_debug("L&R: %d of %d atoms completely buried, skipped",
+                   freesasa_nb_buried(lr->buried, xyz, lr->radii, lr->adj), n_atoms);
 
     return FREESASA_SUCCESS;
 
@@ -100,7 +236,8 @@ int
 freesasa_lee_richards(double *sasa,
                       const coord_t *xyz,
                       const double *atom_radii,
-                      const freesasa_parameters *param)
+                      const freesasa_parameters *param,
+                      freesasa_verlet_list *verlet)
 {
     assert(sasa);
     assert(xyz);
@@ -113,11 +250,19 @@ freesasa_lee_richards(double *sasa,
         n_threads = param->n_threads,
         resolution = param->lee_richards_n_slices;
     double probe_radius = param->probe_radius;
+    freesasa_nb_storage storage = param->neighbor_storage;
     lr_data lr;
 
     if (resolution <= 0)
         return fail_msg("%f slices per atom invalid resolution in L&R, must be > 0\n", resolution);
 
+    if (param->lee_richards_tolerance < 0)
+        return fail_msg("L&R tolerance %g invalid, must be >= 0", param->lee_richards_tolerance);
+
+    if (param->neighbor_storage != FREESASA_NB_FULL && param->neighbor_storage != FREESASA_NB_HALF &&
+        param->neighbor_storage != FREESASA_NB_NONE)
+        return fail_msg("illegal neighbor list storage %d", param->neighbor_storage);
+
     if (n_atoms == 0) {
         return freesasa_warn("in %s(): empty coordinates", __func__);
     }
@@ -126,25 +271,60 @@ freesasa_lee_richards(double *sasa,
         freesasa_warn("no sense in having more threads than atoms, only using %d threads",
                       n_threads);
     }
-    
-    if(init_lr(&lr, sasa, xyz, atom_radii, probe_radius, resolution))
+    // the neighbor list is in single precision when atom_area_single() is used
+    if(init_lr(&lr, sasa, xyz, atom_radii, probe_radius, resolution, n_threads, storage,
+               param->precision == FREESASA_SINGLE_PRECISION &&
+               param->lee_richards_tolerance == 0,
+               verlet))
+        return FREESASA_FAIL;
+
+    switch (lr_select_kernel(&lr, param->lee_richards_kernel, param->precision)) {
+    case FREESASA_FAIL:
+        release_lr(&lr);
         return FREESASA_FAIL;
+    case FREESASA_WARN:
+        return_value = FREESASA_WARN;
+        break;
+    }
     
-    if (n_threads > 1) {
-#if USE_THREADS
-        return_value = lr_do_threads(n_threads, &lr);
-#else
+    if (n_threads > 1 && !USE_THREADS) {
         return_value = freesasa_warn("in %s(): program compiled for single-threaded use, "
                                      "but multiple threads were requested, will "
                                      "proceed in single-threaded mode\n",
                                      __func__);
         n_threads = 1;
-#endif /* pthread */
     }
-    if (n_threads == 1) {
+
+    if (param->lee_richards_tolerance > 0) {
+        // adaptive slicing replaces the kernel, and is always in double precision
+        lr.tolerance = param->lee_richards_tolerance;
+        lr.atom_area = atom_area_adaptive;
+        if (freesasa_get_verbosity() == FREESASA_V_DEBUG) {
+            lr.n_eval = calloc(n_atoms, sizeof(int));
+        }
+    }
+
+    if (lr.search) {
+        if (lr_search(&lr)) return_value = FREESASA_FAIL;
+    } else if (n_threads > 1) {
+#if USE_THREADS
+        if (lr_do_threads(n_threads, &lr)) return_value = FREESASA_FAIL;
+#endif
+    } else {
         for (int i = 0; i < lr.n_atoms; ++i) {
-            lr.sasa[i] = atom_area(&lr, i);
-        }        
+            lr.sasa[i] = lr.buried[i] ? 0 : lr.atom_area(&lr, i);
+        }
+    }
+    if (lr.n_eval) {
+        long n_eval = 0, n_calc = 0;
+        for (int i = 0; i < n_atoms; ++i) {
+            if (!lr.buried[i]) {
+                n_eval += lr.n_eval[i];
+                ++n_calc;
+            }
+        }
+        freesasa_debug("L&R: %.1f slices per atom with adaptive slicing",
+                       n_calc ? (double)n_eval/n_calc : 0.);
     }
     release_lr(&lr);
     return return_value;
@@ -155,96 +335,665 @@ static int
 lr_do_threads(int n_threads,
               lr_data *lr)
 {
-    pthread_t thread[n_threads];
-    lr_thread_interval t_data[n_threads];
-    int n_perthread = lr->n_atoms/n_threads, res;
-    int threads_created = 0, return_value = FREESASA_SUCCESS;
- 
-    for (int t = 0; t < n_threads; ++t) {
-        t_data[t].first_atom = t*n_perthread;
-        if (t == n_threads-1) {
-            t_data[t].last_atom = lr->n_atoms - 1;
-        } else {
-            t_data[t].last_atom = (t+1)*n_perthread - 1;
-        }
-        t_data[t].lr = lr;
-        res = pthread_create(&thread[t], NULL, lr_thread,
-                             (void *) &t_data[t]);
-        if (res) {
-            return_value = fail_msg(freesasa_thread_error(res));
-            break;
-        }
-        ++threads_created;
-    }
-    for (int t = 0; t < threads_created; ++t) {
-        res = pthread_join(thread[t],NULL);
-        if (res) {
-            return_value = fail_msg(freesasa_thread_error(res));
-        }
-    }
+    double imbalance;
+    int return_value;
+
+    // the atoms are distributed dynamically, weighted by number of
+    // neighbors, all threads share lr
+    return_value = freesasa_thread_run_atoms(n_threads, lr->n_atoms, lr->adj->nn, lr->buried,
+                                             lr_range, lr, 0, &imbalance);
+    freesasa_debug("L&R: load imbalance %.2f (slowest thread / mean)", imbalance);
     return return_value;
 }
 
-static void*
-lr_thread(void *arg)
+static void
+lr_range(void *data,
+         int first,
+         int end)
 {
-    lr_thread_interval *ti = ((lr_thread_interval*) arg);
-    for (int i = ti->first_atom; i <= ti->last_atom; ++i) {
+    lr_data *lr = data;
+    for (int i = first; i < end; ++i) {
         /* the different threads write to different parts of the
            array, so locking shouldn't be necessary */
-        ti->lr->sasa[i] = atom_area(ti->lr, i);
+        lr->sasa[i] = lr->buried[i] ? 0 : lr->atom_area(lr, i);
     }
-    pthread_exit(NULL);
 }
 #endif /* USE_THREADS */
 
+//! Calculates the area of atom i in thread t of lr_search()
+static void
+lr_search_atom(void *data,
+               int t,
+               int i)
+{
+    lr_data *lr = (lr_data*)data + t;
+    lr->buried[i] = freesasa_nb_search_buried(lr->search, t, i);
+    lr->sasa[i] = lr->buried[i] ? 0 : lr->atom_area(lr, i);
+}
+
+/** Calculates the areas without a stored neighbor list. Each thread
+    has its own copy of lr, where adj is the neighbor list of the
+    thread. */
+static int
+lr_search(lr_data *lr)
+{
+    const int n_threads = freesasa_nb_search_n_threads(lr->search);
+    lr_data lrt[n_threads];
+
+    for (int t = 0; t < n_threads; ++t) {
+        lrt[t] = *lr;
+        lrt[t].adj = freesasa_nb_search_list(lr->search, t);
+    }
+    return freesasa_nb_search_run(lr->search, lr_search_atom, lrt);
+}
+
+/* The slice-invariant quantities of the neighbors of an atom, stored
+   as a structure of arrays, with the neighbors ordered by the first
+   slice they can intersect. The slices are visited in order of
+   increasing z, and only the neighbors in a window [lo,hi) that moves
+   along the arrays need to be tested against each slice: hi passes
+   the neighbors as they start intersecting the slices, and lo the
+   ones that have stopped intersecting them. The window can contain
+   some neighbors that don't intersect the slice, if they are stuck
+   behind one that does, but it is cheap to test those. The arrays are
+   padded with LR_SIMD_WIDTH entries that never intersect any
+   slice. */
+typedef struct {
+    int lo, hi;     // the window
+    int n;          // number of neighbors that intersect any slice
+    double *z;      // z-coordinate, relative to atom i
+    double *R, *R2; // radius and radius squared
+    double *d, *d2; // distance to atom i in the xy-plane, and squared
+    double *beta;   // direction to the neighbor in the xy-plane, + pi
+    int *slice_in;  // the first slice the neighbor can intersect
+    int *slice_out; // the first slice after that it can't intersect
+} lr_sweep;
+
+// margin in Å for round-off errors when determining which slices a
+// neighbor intersects, larger than the errors in single precision
+#define LR_SWEEP_TOL 1e-4
+
+// sizes of the buffers passed to lr_sweep_init()
+#define LR_SWEEP_BUF(nni) (7*((nni) + LR_SIMD_WIDTH))
+#define LR_SWEEP_IBUF(nni) (5*(nni) + 1)
+
+/* Calculates beta, atan2(y,x) + pi, for each neighbor of atom i */
+static void
+lr_beta(const lr_data *lr,
+        int i,
+        double *beta)
+{
+    const int o = lr->adj->offset[i];
+    for (int j = 0; j < lr->adj->nn[i]; ++j) {
+        beta[j] = atan2(freesasa_nb_yd(lr->adj, o + j), freesasa_nb_xd(lr->adj, o + j)) + M_PI;
+    }
+}
+
+/* Initializes the sweep over the slices of atom i. The slices each
+   neighbor can intersect are determined with a margin, and the
+   kernels then test each neighbor in the window against the slice
+   exactly. The function beta should be lr_beta() or one of its SIMD
+   versions, the sizes of the buffers are given by LR_SWEEP_BUF and
+   LR_SWEEP_IBUF. */
+static void
+lr_sweep_init(lr_sweep *sw,
+              const lr_data *lr,
+              int i,
+              double delta,
+              void (*beta)(const lr_data*, int, double*),
+              double *buf,
+              int *ibuf)
+{
+    const int nni = lr->adj->nn[i], ns = lr->n_slices_per_atom;
+    const int n_max = nni + LR_SIMD_WIDTH;
+    const double *v = freesasa_coord_all(lr->xyz);
+    const int *nbi = lr->adj->nb + lr->adj->offset[i];
+    const double zi = v[3*i+2], Ri = lr->radii[i], inv_delta = 1/delta;
+    double *nb_beta = buf + 6*n_max;
+    int *nb_in = ibuf + 2*nni, *nb_out = ibuf + 3*nni, *order = ibuf + 4*nni;
+
+    sw->lo = sw->hi = sw->n = 0;
+    sw->z = buf;
+    sw->R = buf + n_max;
+    sw->R2 = buf + 2*n_max;
+    sw->d = buf + 3*n_max;
+    sw->d2 = buf + 4*n_max;
+    sw->beta = buf + 5*n_max;
+    sw->slice_in = ibuf;
+    sw->slice_out = ibuf + nni;
+
+    for (int j = 0; j < nni; ++j) {
+        const double zj = v[3*nbi[j]+2] - zi, Rj = lr->radii[nbi[j]];
+        // slice k, centered at -Ri + (k+0.5)*delta, is intersected if
+        // lo < k < hi, (int)(x+1) is floor(x)+1 for x >= -1
+        const double lo = (zj - Rj + Ri - LR_SWEEP_TOL)*inv_delta - 0.5,
+            hi = (zj + Rj + Ri + LR_SWEEP_TOL)*inv_delta - 0.5;
+        nb_in[j] = lo < 0 ? 0 : (lo >= ns ? ns : (int)(lo + 1));
+        nb_out[j] = hi < 0 ? 0 : (hi >= ns ? ns : (int)(hi + 1));
+        // insertion sort by the first slice, the number of slices
+        // can be large, so the buffers don't depend on it
+        if (nb_in[j] < nb_out[j]) {
+            int p = sw->n++;
+            while (p > 0 && nb_in[order[p-1]] > nb_in[j]) {
+                order[p] = order[p-1];
+                --p;
+            }
+            order[p] = j;
+        }
+    }
+
+    beta(lr, i, nb_beta);
+    for (int p = 0; p < sw->n; ++p) {
+        const int j = order[p], nb = nbi[j];
+        sw->z[p] = v[3*nb+2] - zi;
+        sw->R[p] = lr->radii[nb];
+        sw->R2[p] = sw->R[p]*sw->R[p];
+        sw->d[p] = freesasa_nb_xyd(lr->adj, lr->adj->offset[i] + j);
+        sw->d2[p] = sw->d[p]*sw->d[p];
+        sw->beta[p] = nb_beta[j];
+        sw->slice_in[p] = nb_in[j];
+        sw->slice_out[p] = nb_out[j];
+    }
+    for (int p = sw->n; p < sw->n + LR_SIMD_WIDTH; ++p) {
+        sw->z[p] = HUGE_VAL;
+        sw->R[p] = sw->R2[p] = 0;
+        sw->d[p] = sw->d2[p] = 1;
+        sw->beta[p] = 0;
+    }
+}
+
+/* Moves the window to slice k, the slices have to be visited in
+   order. */
+static inline void
+lr_sweep_update(lr_sweep *sw,
+                int k)
+{
+    while (sw->hi < sw->n && sw->slice_in[sw->hi] <= k) ++sw->hi;
+    while (sw->lo < sw->hi && sw->slice_out[sw->lo] <= k) ++sw->lo;
+}
+
+/* Stores the arcs of the circle of atom i at height z that are
+   buried by the neighbors lo to hi-1 in the sweep, and returns the
+   number of arcs, or -1 if the circle is completely buried. */
+static inline int
+lr_slice_arcs(const lr_sweep *sw,
+              int lo,
+              int hi,
+              double z,
+              double Ri_prime,
+              double Ri_prime2,
+              double *arc)
+{
+    int n_arcs = 0;
+    for (int j = lo; j < hi; ++j) {
+        const double dj = fabs(sw->z[j] - z);
+        const double Rj = sw->R[j];
+        if (dj < Rj) {
+            const double Rj_prime2 = sw->R2[j]-dj*dj;
+            const double Rj_prime = sqrt(Rj_prime2);
+            const double dij = sw->d[j];
+            double alpha, beta, inf, sup;
+            int narc2;
+            if (dij >= Ri_prime + Rj_prime) { // atoms aren't in contact
+                continue;
+            }
+            if (dij + Ri_prime < Rj_prime) { // circle i is completely inside j
+                return -1;
+            }
+            if (dij + Rj_prime < Ri_prime) { // circle j is completely inside i
+                continue;
+            }
+            // arc of circle i intersected by circle j, at the heights
+            // where the circles are tangent the cosine can be slightly
+            // out of range (or NaN for concentric circles)
+            const double cos_alpha = (Ri_prime2 + sw->d2[j] - Rj_prime2)/(2.0*Ri_prime*dij);
+            alpha = cos_alpha < 1 ? (cos_alpha > -1 ? acos(cos_alpha) : M_PI) : 0;
+            // position of mid-point of intersection along circle i
+            beta = sw->beta[j];
+            inf = beta - alpha;
+            sup = beta + alpha;
+            if (inf < 0) inf += TWOPI;
+            if (sup > 2*M_PI) sup -= TWOPI;
+            narc2 = 2*n_arcs;
+            // store the arc, if arc passes 2*PI split into two
+            if (sup < inf) {
+                //store arcs as contiguous pairs of angles
+                arc[narc2]   = 0;
+                arc[narc2+1] = sup;
+                //second arc
+                arc[narc2+2] = inf;
+                arc[narc2+3] = TWOPI;
+                n_arcs += 2;
+            } else {
+                arc[narc2]   = inf;
+                arc[narc2+1] = sup;
+                ++n_arcs;
+            }
+        }
+    }
+    return n_arcs;
+}
+
 static double
 atom_area(lr_data *lr,
           int i)
 {
-    /* This function is large because a large number of pre-calculated
-       arrays need to be accessed efficiently. Partially dereferenced
-       here to make access more efficient.
-    
-       Variables are named according to the documentation (see page
-       "Geometry of Lee & Richards' algorithm") */
+    /* Variables are named according to the documentation (see page
+       "Geometry of Lee & Richards' algorithm"), the z-coordinates are
+       relative to atom i. */
 
     const int nni = lr->adj->nn[i];
-    const double * restrict const v = freesasa_coord_all(lr->xyz);
-    const double * restrict const R = lr->radii;
-    const int * restrict const nbi = lr->adj->nb[i];
-    const double * restrict const xydi = lr->adj->xyd[i];
-    const double * restrict const xdi = lr->adj->xd[i];
-    const double * restrict const ydi = lr->adj->yd[i];
-    const double zi = v[3*i+2], Ri = R[i];
+    const double Ri = lr->radii[i];
     const int ns = lr->n_slices_per_atom;
-    double arc[nni*4], z_nb[nni], R_nb[nni];
-    double z, delta, sasa = 0;
-    
+    const double delta = 2*Ri/ns;
+    double arc[nni*4+1], buf[LR_SWEEP_BUF(nni)];
+    int ibuf[LR_SWEEP_IBUF(nni)];
+    double sasa = 0;
+    lr_sweep sw;
+
+    lr_sweep_init(&sw, lr, i, delta, lr_beta, buf, ibuf);
+    for (int islice = 0; islice < ns; ++islice) {
+        lr_sweep_update(&sw, islice);
+        const double z = -Ri + (islice + 0.5)*delta;
+        const double Ri_prime2 = Ri*Ri-z*z;
+        if (Ri_prime2 < 0 ) continue; // handle round-off errors
+        const double Ri_prime = sqrt(Ri_prime2);
+        if (Ri_prime <= 0) continue; // more round-off errors
+        const int n_arcs = lr_slice_arcs(&sw, sw.lo, sw.hi, z, Ri_prime, Ri_prime2, arc);
+        if (n_arcs >= 0) {
+            sasa += delta*Ri*exposed_arc_length(arc,n_arcs);
+        }
+    }
+    return sasa;
+}
+
+/* The neighbors of an atom for adaptive slicing. The neighbors are
+   stored like in ::lr_sweep, ordered by the lowest point of their
+   cap, i.e. the part of the surface of the atom that they bury, and
+   with the quantities needed to find the breakpoints in addition. */
+typedef struct {
+    lr_sweep sw;
+    int n;            // number of neighbors
+    double *x, *y;    // x- and y-coordinates, relative to the atom
+    double *nx, *ny, *nz; // unit vector towards the neighbor
+    double *a;        // distance from the center to the plane of the cap
+    double *rho;      // radius of the circle bounding the cap
+    double *lo, *hi;  // z-range of the cap
+    int last;         // the neighbor that buried the last point tested
+} lr_adaptive_nb;
+
+// size of the buffer passed to lr_adaptive_nb_init()
+#define LR_ADAPTIVE_BUF(nni) (15*(nni) + 1)
+
+// the maximal number of breakpoints lr_adaptive_breaks() stores, the
+// boundary of the exposed surface has at most 6 nni vertices
+#define LR_ADAPTIVE_BREAKS(nni) (8*(nni) + 2)
+
+/* Stores the neighbors of atom i that bury part of its surface, and
+   change the exposed surface. Returns -1 if the atom is found to be
+   completely buried, 0 else. */
+static int
+lr_adaptive_nb_init(lr_adaptive_nb *nb,
+                    const lr_data *lr,
+                    int i,
+                    double *buf,
+                    int *order)
+{
+    const int nni = lr->adj->nn[i], o = lr->adj->offset[i];
+    const int *nbi = lr->adj->nb + o;
+    const double *v = freesasa_coord_all(lr->xyz);
+    const double Ri = lr->radii[i];
+    double *tmp = buf + 14*nni;
+    lr_sweep *sw = &nb->sw;
+    int m = 0;
+
+    // the neighbors are first stored in the order they are found,
+    // and permuted to sorted order at the end, beta is used as
+    // temporary storage for that
+    nb->n = nb->last = 0;
+    nb->x = buf; nb->y = buf + nni; sw->z = buf + 2*nni;
+    nb->nx = buf + 3*nni; nb->ny = buf + 4*nni; nb->nz = buf + 5*nni;
+    nb->a = buf + 6*nni; nb->rho = buf + 7*nni;
+    nb->lo = buf + 8*nni; nb->hi = buf + 9*nni;
+    sw->R = buf + 10*nni; sw->R2 = buf + 11*nni;
+    sw->d = buf + 12*nni; sw->d2 = buf + 13*nni;
+    sw->beta = tmp;
+    sw->slice_in = sw->slice_out = NULL;
+    sw->lo = sw->hi = 0;
+
     for (int j = 0; j < nni; ++j) {
-        z_nb[j] = v[3*nbi[j]+2];
-        R_nb[j] = R[nbi[j]];
+        const double x = freesasa_nb_xd(lr->adj, o + j), y = freesasa_nb_yd(lr->adj, o + j),
+            z = v[3*nbi[j]+2] - v[3*i+2], Rj = lr->radii[nbi[j]],
+            D = sqrt(x*x + y*y + z*z);
+        if (D == 0) {
+            if (Rj >= Ri) return -1;
+            continue;
+        }
+        // the cap is the part of the surface where n.x > a
+        const double a = (Ri*Ri - Rj*Rj + D*D)/(2*D);
+        if (a <= -Ri) return -1;
+        if (a >= Ri) continue;
+        const int p = nb->n++;
+        nb->x[p] = x; nb->y[p] = y; sw->z[p] = z;
+        sw->R[p] = Rj;
+        nb->nx[p] = x/D; nb->ny[p] = y/D; nb->nz[p] = z/D;
+        nb->a[p] = a;
+        nb->rho[p] = sqrt(Ri*Ri - a*a);
+        {
+            // the circle reaches sqrt(1 - nz^2) rho above and below
+            // its center, the cap includes a pole if it is inside
+            const double zc = a*nb->nz[p], dz = nb->rho[p]*sqrt(x*x + y*y)/D;
+            nb->lo[p] = -Ri*nb->nz[p] > a ? -Ri : zc - dz;
+            nb->hi[p] = Ri*nb->nz[p] > a ? Ri : zc + dz;
+        }
     }
-    
-    delta = 2*Ri/ns;
-    z = zi-Ri-0.5*delta;
+
+    // drop the neighbors whose circle is inside the cap of another
+    // neighbor, their cap is then either inside that cap, and doesn't
+    // change the exposed surface, or the two caps cover the whole
+    // atom, and sort the rest by the lowest point of the cap
+    for (int p = 0; p < nb->n; ++p) {
+        int q;
+        for (q = 0; q < nb->n; ++q) {
+            // the circle is inside cap q if a_p g - rho_p sqrt(1 - g^2) > a_q
+            const double g = nb->nx[p]*nb->nx[q] + nb->ny[p]*nb->ny[q] + nb->nz[p]*nb->nz[q],
+                h = nb->a[p]*g - nb->a[q];
+            if (q != p && h > 0 && h*h > nb->rho[p]*nb->rho[p]*(1 - g*g)) {
+                // the rest of the surface is in cap p if -n_q is
+                if (-g*Ri > nb->a[p]) return -1;
+                break;
+            }
+        }
+        if (q < nb->n) continue;
+        q = m++;
+        while (q > 0 && nb->lo[order[q-1]] > nb->lo[p]) {
+            order[q] = order[q-1];
+            --q;
+        }
+        order[q] = p;
+    }
+    nb->n = m;
+
+    // permute to the sorted order, using tmp for one array at a time
+    double *arrays[] = {nb->x, nb->y, sw->z, nb->nx, nb->ny, nb->nz,
+                        nb->a, nb->rho, nb->lo, nb->hi, sw->R};
+    for (int k = 0; k < sizeof(arrays)/sizeof(double*); ++k) {
+        for (int p = 0; p < nb->n; ++p) tmp[p] = arrays[k][order[p]];
+        for (int p = 0; p < nb->n; ++p) arrays[k][p] = tmp[p];
+    }
+    for (int p = 0; p < nb->n; ++p) {
+        sw->R2[p] = sw->R[p]*sw->R[p];
+        sw->d2[p] = nb->x[p]*nb->x[p] + nb->y[p]*nb->y[p];
+        sw->d[p] = sqrt(sw->d2[p]);
+        sw->beta[p] = atan2(nb->y[p], nb->x[p]) + M_PI;
+    }
+    sw->n = nb->n;
+
+    return 0;
+}
+
+/* Is the point (x,y,z) on the surface of the atom outside all
+   neighbors except j and k? Points close to the surface of a neighbor
+   count as exposed, so that no breakpoints are lost to round-off
+   errors. Only the neighbors whose caps reach the height z are
+   tested, and the neighbor that buried the previous point is tested
+   first, since nearby points tend to be buried by the same
+   neighbor. */
+static int
+lr_adaptive_exposed(lr_adaptive_nb *nb,
+                    double x,
+                    double y,
+                    double z,
+                    int j,
+                    int k)
+{
+    const lr_sweep *sw = &nb->sw;
+    int m = nb->last;
+    double dx = x - nb->x[m], dy = y - nb->y[m], dz = z - sw->z[m];
+
+    if (m != j && m != k && dx*dx + dy*dy + dz*dz < sw->R2[m]*(1 - 1e-9)) return 0;
+    for (m = 0; m < nb->n && nb->lo[m] <= z; ++m) {
+        if (nb->hi[m] < z || m == j || m == k) continue;
+        dx = x - nb->x[m]; dy = y - nb->y[m]; dz = z - sw->z[m];
+        if (dx*dx + dy*dy + dz*dz < sw->R2[m]*(1 - 1e-9)) {
+            nb->last = m;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Stores the heights where the exposed surface of the atom changes
+   character in z, sorted and without duplicates, and returns their
+   number. These are the ends of the atom, the top and bottom of
+   each exposed circle bounding the cap of a neighbor, where the
+   exposed arc length has a square-root singularity, and the exposed
+   intersections of two such circles, where it has a kink. Between
+   the breakpoints the exposed arc length is smooth, and exposed bands
+   start and end at the breakpoints. */
+static int
+lr_adaptive_breaks(lr_adaptive_nb *nb,
+                   double R,
+                   double *z)
+{
+    const int max = LR_ADAPTIVE_BREAKS(nb->n);
+    int n = 0, m = 1;
+
+    z[n++] = -R;
+    z[n++] = R;
+    for (int j = 0; j < nb->n; ++j) {
+        const double s = sqrt(1 - nb->nz[j]*nb->nz[j]);
+        if (s == 0) {
+            // a horizontal circle
+            z[n++] = nb->a[j]*nb->nz[j];
+            continue;
+        }
+        for (int sign = -1; sign <= 1; sign += 2) {
+            // the unit vector in the plane of the circle with largest z is (e_z - nz n)/s
+            const double c = sign*nb->rho[j]/s, ca = nb->a[j] - c*nb->nz[j];
+            const double x = ca*nb->nx[j], y = ca*nb->ny[j], zp = ca*nb->nz[j] + c;
+            if (lr_adaptive_exposed(nb, x, y, zp, j, j)) z[n++] = zp;
+        }
+    }
+    for (int j = 0; j < nb->n; ++j) {
+        // the neighbors are sorted by the lowest point of the caps
+        for (int k = j + 1; k < nb->n && nb->lo[k] < nb->hi[j] && n < max - 1; ++k) {
+            // the intersections are a nj + b nk + c (nj x nk), where
+            // c^2 = (R^2 s2 - aj^2 - ak^2 + 2 aj ak g)/s2^2
+            const double g = nb->nx[j]*nb->nx[k] + nb->ny[j]*nb->ny[k] + nb->nz[j]*nb->nz[k],
+                s2 = 1 - g*g,
+                c2 = R*R*s2 - nb->a[j]*nb->a[j] - nb->a[k]*nb->a[k] + 2*nb->a[j]*nb->a[k]*g;
+            if (s2 <= 1e-12 || c2 <= 0) continue;
+            const double inv = 1/s2,
+                a = (nb->a[j] - g*nb->a[k])*inv, b = (nb->a[k] - g*nb->a[j])*inv,
+                c = sqrt(c2)*inv,
+                cx = nb->ny[j]*nb->nz[k] - nb->nz[j]*nb->ny[k],
+                cy = nb->nz[j]*nb->nx[k] - nb->nx[j]*nb->nz[k],
+                cz = nb->nx[j]*nb->ny[k] - nb->ny[j]*nb->nx[k];
+            for (int sign = -1; sign <= 1; sign += 2) {
+                const double x = a*nb->nx[j] + b*nb->nx[k] + sign*c*cx,
+                    y = a*nb->ny[j] + b*nb->ny[k] + sign*c*cy,
+                    zp = a*nb->nz[j] + b*nb->nz[k] + sign*c*cz;
+                if (lr_adaptive_exposed(nb, x, y, zp, j, k)) z[n++] = zp;
+            }
+        }
+    }
+
+    // insertion sort, there are usually few breakpoints
+    for (int k = 1; k < n; ++k) {
+        const double t = z[k];
+        int l = k;
+        while (l > 0 && z[l-1] > t) {
+            z[l] = z[l-1];
+            --l;
+        }
+        z[l] = t;
+    }
+    for (int k = 1; k < n; ++k) {
+        if (z[k] - z[m-1] > 1e-10*R) z[m++] = z[k];
+    }
+    z[m-1] = R;
+    return m;
+}
+
+/* State of the adaptive integration of one atom. Each panel [z0, z0
+   + 2 half] between two breakpoints is integrated in the variable t,
+   see lr_adaptive_eval_panel(). */
+typedef struct {
+    const lr_sweep *sw; // the neighbors, the window has the caps that overlap the panel
+    double R;
+    double *arc;
+    double z0, half;  // the current panel
+    double tol_per_t; // the tolerance per unit of t in the current panel
+    double t_min;     // the shortest interval in t that is subdivided
+    int n_eval;       // the number of slices evaluated
+} lr_adaptive;
+
+/* The exposed length of the circle at height z, times the radius of
+   the atom, i.e. the exposed area per Å along the z-axis. At the
+   poles the circle is a point, which is either exposed or buried. */
+static double
+lr_adaptive_eval(lr_adaptive *ad,
+                 double z)
+{
+    const lr_sweep *sw = ad->sw;
+    const double Ri = ad->R, Ri_prime2 = Ri*Ri - z*z;
+
+    ++ad->n_eval;
+    if (Ri_prime2 <= 0) {
+        for (int j = sw->lo; j < sw->hi; ++j) {
+            const double dz = sw->z[j] - z;
+            if (dz*dz + sw->d2[j] < sw->R2[j]) return 0;
+        }
+        return TWOPI*Ri;
+    }
+    const int n_arcs = lr_slice_arcs(sw, sw->lo, sw->hi, z, sqrt(Ri_prime2), Ri_prime2, ad->arc);
+    if (n_arcs < 0) return 0;
+    return Ri*exposed_arc_length(ad->arc, n_arcs);
+}
+
+/* The integrand in the current panel after the substitution z = z0 +
+   half*(1 - cos t), with t from 0 to pi. The factor sin t cancels the
+   square-root singularities at the ends of the panel, and is 0 at
+   the ends, where the exposed arc length therefore isn't needed. */
+static double
+lr_adaptive_eval_panel(lr_adaptive *ad,
+                       double t)
+{
+    return ad->half*sin(t)*lr_adaptive_eval(ad, ad->z0 + ad->half*(1 - cos(t)));
+}
+
+/* Adaptive Simpson's rule on [a,b], where whole is the estimate using
+   the end- and mid-points. The interval is split in two until the
+   difference between the two estimates is small enough, and the
+   difference is then used to correct the result. */
+static double
+lr_adaptive_simpson(lr_adaptive *ad,
+                    double a,
+                    double b,
+                    double fa,
+                    double fm,
+                    double fb,
+                    double whole)
+{
+    const double m = 0.5*(a + b), h = b - a;
+    const double flm = lr_adaptive_eval_panel(ad, 0.5*(a + m)),
+        frm = lr_adaptive_eval_panel(ad, 0.5*(m + b));
+    const double left = h/12*(fa + 4*flm + fm), right = h/12*(fm + 4*frm + fb),
+        err = left + right - whole;
+
+    // the interval is at most h*half wide in z
+    if (0.5*h <= ad->t_min ||
+        (fabs(err) <= 15*ad->tol_per_t*h && h*ad->half <= LR_ADAPTIVE_MAX_WIDTH*2*ad->R)) {
+        return left + right + err/15;
+    }
+    return lr_adaptive_simpson(ad, a, m, fa, flm, fm, left) +
+        lr_adaptive_simpson(ad, m, b, fm, frm, fb, right);
+}
+
+/* Integrates the exposed arc length over z with adaptive Simpson's
+   rule. The atom is divided in panels at the breakpoints from
+   lr_adaptive_breaks(), and each panel gets its share of the
+   tolerance, proportional to its length. Within a panel the integrand
+   has no singularities, and after the substitution in
+   lr_adaptive_eval_panel() it has none at the ends either. A panel that is buried
+   in the middle is buried everywhere, and is not integrated. Each
+   slice only tests the neighbors whose caps overlap the panel. The
+   error estimates are only estimates, the tolerance is not a bound on
+   the error of each atom. The resolution n_slices_per_atom limits how
+   short intervals can get, if that limit is reached the error can
+   also be larger than the tolerance. */
+static double
+atom_area_adaptive(lr_data *lr,
+                   int i)
+{
+    const int nni = lr->adj->nn[i], ns = lr->n_slices_per_atom;
+    const double Ri = lr->radii[i];
+    double arc[nni*4+1], buf[LR_ADAPTIVE_BUF(nni)], z[LR_ADAPTIVE_BREAKS(nni)];
+    int order[nni+1];
+    double sasa = 0;
+    int n_breaks;
+    lr_adaptive_nb nb;
+    lr_adaptive ad = {&nb.sw, Ri, arc, 0, 0, 0, 0, 0};
+
+    if (lr_adaptive_nb_init(&nb, lr, i, buf, order)) return 0;
+    n_breaks = lr_adaptive_breaks(&nb, Ri, z);
+    for (int k = 0; k < n_breaks - 1; ++k) {
+        double fm;
+        // move the window to the caps that overlap the panel
+        while (nb.sw.hi < nb.n && nb.lo[nb.sw.hi] < z[k+1]) ++nb.sw.hi;
+        while (nb.sw.lo < nb.sw.hi && nb.hi[nb.sw.lo] <= z[k]) ++nb.sw.lo;
+        ad.z0 = z[k];
+        ad.half = 0.5*(z[k+1] - z[k]);
+        ad.tol_per_t = lr->tolerance/(2*Ri)*2*ad.half/M_PI;
+        ad.t_min = 2*Ri/ns/ad.half;
+        fm = lr_adaptive_eval_panel(&ad, M_PI/2);
+        if (fm == 0) continue;
+        sasa += lr_adaptive_simpson(&ad, 0, M_PI, 0, fm, 0, M_PI/6*4*fm);
+    }
+    if (lr->n_eval) lr->n_eval[i] = ad.n_eval;
+
+    return sasa;
+}
+
+/* Same as atom_area(), but in single precision. The neighbor list
+   stores the distances in single precision (see nb_list::xydf), the
+   other slice-invariant quantities are calculated in double precision
+   and then rounded. Since the coordinates are relative to atom i,
+   only the precision relative to the atom radii is lost, and the area
+   of each slice is accumulated in double precision. */
+static double
+atom_area_single(lr_data *lr,
+                 int i)
+{
+    const int nni = lr->adj->nn[i];
+    const float twopi = TWOPI;
+    const float Ri = lr->radii[i];
+    const int ns = lr->n_slices_per_atom;
+    const float delta = 2*Ri/ns;
+    float arc[nni*4+1];
+    double buf[LR_SWEEP_BUF(nni)];
+    int ibuf[LR_SWEEP_IBUF(nni)];
+    double sasa = 0;
+    lr_sweep sw;
+
+    lr_sweep_init(&sw, lr, i, delta, lr_beta, buf, ibuf);
     for (int islice = 0; islice < ns; ++islice) {
-        z += delta;
-        const double di = fabs(zi - z);
-        const double Ri_prime2 = Ri*Ri-di*di;
+        lr_sweep_update(&sw, islice);
+        const float z = -Ri + (islice + 0.5f)*delta;
+        const float Ri_prime2 = Ri*Ri-z*z;
         if (Ri_prime2 < 0 ) continue; // handle round-off errors
-        const double Ri_prime = sqrt(Ri_prime2);
+        const float Ri_prime = sqrtf(Ri_prime2);
         if (Ri_prime <= 0) continue; // more round-off errors
         int n_arcs = 0, is_buried = 0;
-        for (int j = 0; j < nni; ++j) {
-            const double zj = z_nb[j];
-            const double dj = fabs(zj - z);
-            const double Rj = R_nb[j];
+        for (int j = sw.lo; j < sw.hi; ++j) {
+            const float dj = fabsf((float)sw.z[j] - z);
+            const float Rj = sw.R[j];
             if (dj < Rj) {
-                const double Rj_prime2 = Rj*Rj-dj*dj;
-                const double Rj_prime = sqrt(Rj_prime2);
-                const double dij = xydi[j];
-                double alpha, beta, inf, sup;
+                const float Rj_prime2 = (float)sw.R2[j]-dj*dj;
+                const float Rj_prime = sqrtf(Rj_prime2);
+                const float dij = sw.d[j];
+                float alpha, beta, inf, sup;
                 int narc2;
                 if (dij >= Ri_prime + Rj_prime) { // atoms aren't in contact
                     continue;
@@ -256,37 +1005,406 @@ atom_area(lr_data *lr,
                 if (dij + Rj_prime < Ri_prime) { // circle j is completely inside i
                     continue;
                 }
-                // arc of circle i intersected by circle j
-                alpha = acos ((Ri_prime2 + dij*dij - Rj_prime2)/(2.0*Ri_prime*dij));
-                // position of mid-point of intersection along circle i
-                beta = atan2 (ydi[j],xdi[j]) + M_PI;
+                alpha = acosf((Ri_prime2 + (float)sw.d2[j] - Rj_prime2)/(2.0f*Ri_prime*dij));
+                beta = sw.beta[j];
                 inf = beta - alpha;
                 sup = beta + alpha;
-                if (inf < 0) inf += TWOPI;
-                if (sup > 2*M_PI) sup -= TWOPI;
+                if (inf < 0) inf += twopi;
+                if (sup > twopi) sup -= twopi;
                 narc2 = 2*n_arcs;
-                // store the arc, if arc passes 2*PI split into two
                 if (sup < inf) {
-                    //store arcs as contiguous pairs of angles
                     arc[narc2]   = 0;
                     arc[narc2+1] = sup;
-                    //second arc
                     arc[narc2+2] = inf;
-                    arc[narc2+3] = TWOPI;
+                    arc[narc2+3] = twopi;
                     n_arcs += 2;
-                } else { 
+                } else {
                     arc[narc2]   = inf;
                     arc[narc2+1] = sup;
                     ++n_arcs;
                 }
             }
         }
+        if (is_buried == 0) {
+            sasa += delta*Ri*exposed_arc_length_single(arc,n_arcs);
+        }
+    }
+    return sasa;
+}
+
+#if LR_X86_SIMD
+// lr_pair_mask[m] has bits 2k and 2k+1 set for each bit k set in m (m < 16)
+static const unsigned char lr_pair_mask[16] = {
+    0x00, 0x03, 0x0C, 0x0F, 0x30, 0x33, 0x3C, 0x3F,
+    0xC0, 0xC3, 0xCC, 0xCF, 0xF0, 0xF3, 0xFC, 0xFF
+};
+
+/* The SIMD kernels follow atom_area() closely, but test a block of
+   neighbors against each slice at a time. The arcs of the neighbors
+   that intersect the slice are then computed for the whole block,
+   using a vectorized version of acos(), and the ones that are needed
+   are appended to the list of arcs. The directions to the neighbors
+   (beta) are calculated for all neighbors at once, using a vectorized
+   atan2().
+
+   atan() uses the range reduction and rational approximation from the
+   Cephes library, which is accurate to within a few ulp. acos(c) is
+   calculated as 2 atan(sqrt((1-c)/(1+c))), which is well-conditioned
+   for all c in [-1,1]. */
+
+// Cephes coefficients, atan(x) = x + x^3 P(x^2)/Q(x^2) for |x| <= 0.66
+#define LR_ATAN_P0 -8.750608600031904122785E-1
+#define LR_ATAN_P1 -1.615753718733365076637E1
+#define LR_ATAN_P2 -7.500855792314704667340E1
+#define LR_ATAN_P3 -1.228866684490136173410E2
+#define LR_ATAN_P4 -6.485021904942025371773E1
+#define LR_ATAN_Q0 2.485846490142306297962E1
+#define LR_ATAN_Q1 1.650270098316988542046E2
+#define LR_ATAN_Q2 4.328810604912902668951E2
+#define LR_ATAN_Q3 4.853903996359136964868E2
+#define LR_ATAN_Q4 1.945506571482613964425E2
+#define LR_ATAN_T3P8 2.41421356237309504880 // tan(3 pi/8)
+#define LR_ATAN_MOREBITS 6.123233995736765886130E-17 // pi/2 - (double)(pi/2)
+
+static inline __m256d __attribute__((target("avx2")))
+lr_atan_avx2(__m256d x)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0), one = _mm256_set1_pd(1),
+        zero = _mm256_setzero_pd();
+    const __m256d ax = _mm256_andnot_pd(sign, x);
+    // range reduction, to [-tan(pi/8), tan(pi/8)]
+    const __m256d big = _mm256_cmp_pd(ax, _mm256_set1_pd(LR_ATAN_T3P8), _CMP_GT_OQ),
+        mid = _mm256_andnot_pd(big, _mm256_cmp_pd(ax, _mm256_set1_pd(0.66), _CMP_GT_OQ));
+    const __m256d xr = _mm256_blendv_pd(_mm256_blendv_pd(ax, _mm256_div_pd(_mm256_sub_pd(ax, one),
+                                                                           _mm256_add_pd(ax, one)),
+                                                         mid),
+                                        _mm256_div_pd(_mm256_set1_pd(-1), ax), big);
+    const __m256d y0 = _mm256_blendv_pd(_mm256_blendv_pd(zero, _mm256_set1_pd(M_PI_4), mid),
+                                        _mm256_set1_pd(M_PI_2), big),
+        y1 = _mm256_blendv_pd(_mm256_blendv_pd(zero, _mm256_set1_pd(0.5*LR_ATAN_MOREBITS), mid),
+                              _mm256_set1_pd(LR_ATAN_MOREBITS), big);
+    const __m256d z = _mm256_mul_pd(xr, xr);
+    __m256d p = _mm256_set1_pd(LR_ATAN_P0), q = _mm256_add_pd(z, _mm256_set1_pd(LR_ATAN_Q0));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(LR_ATAN_P1));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(LR_ATAN_P2));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(LR_ATAN_P3));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(LR_ATAN_P4));
+    q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(LR_ATAN_Q1));
+    q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(LR_ATAN_Q2));
+    q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(LR_ATAN_Q3));
+    q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(LR_ATAN_Q4));
+    p = _mm256_div_pd(_mm256_mul_pd(z, p), q);
+    p = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(xr, p), xr), y1);
+    // restore the sign
+    return _mm256_or_pd(_mm256_add_pd(y0, p), _mm256_and_pd(sign, x));
+}
+
+// atan2(y, x) + pi, i.e. in [0, 2 pi]
+static inline __m256d __attribute__((target("avx2")))
+lr_atan2_pi_avx2(__m256d y,
+                 __m256d x)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0), pi = _mm256_set1_pd(M_PI);
+    // -0 + 0 = +0, atan2(y, -0) is pi/2 for y > 0 (the neighbor list has -0 entries)
+    const __m256d t = lr_atan_avx2(_mm256_div_pd(y, _mm256_add_pd(x, _mm256_setzero_pd())));
+    // for x < 0 the result is shifted by pi, towards the sign of y
+    const __m256d shift = _mm256_and_pd(_mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LT_OQ),
+                                        _mm256_or_pd(pi, _mm256_and_pd(sign, y)));
+    return _mm256_add_pd(_mm256_add_pd(t, shift), pi);
+}
+
+static inline __m256d __attribute__((target("avx2")))
+lr_acos_avx2(__m256d c)
+{
+    const __m256d one = _mm256_set1_pd(1);
+    const __m256d t = lr_atan_avx2(_mm256_sqrt_pd(_mm256_div_pd(_mm256_sub_pd(one, c),
+                                                                _mm256_add_pd(one, c))));
+    return _mm256_add_pd(t, t);
+}
+
+static inline __m512d __attribute__((target("avx512f")))
+lr_atan_avx512(__m512d x)
+{
+    const __m512d one = _mm512_set1_pd(1), zero = _mm512_setzero_pd();
+    const __m512d ax = _mm512_abs_pd(x);
+    const __mmask8 big = _mm512_cmp_pd_mask(ax, _mm512_set1_pd(LR_ATAN_T3P8), _CMP_GT_OQ),
+        mid = ~big & _mm512_cmp_pd_mask(ax, _mm512_set1_pd(0.66), _CMP_GT_OQ),
+        neg = _mm512_cmp_pd_mask(x, zero, _CMP_LT_OQ);
+    __m512d xr = _mm512_mask_div_pd(ax, mid, _mm512_sub_pd(ax, one), _mm512_add_pd(ax, one));
+    xr = _mm512_mask_div_pd(xr, big, _mm512_set1_pd(-1), ax);
+    const __m512d y0 = _mm512_mask_blend_pd(big, _mm512_mask_blend_pd(mid, zero, _mm512_set1_pd(M_PI_4)),
+                                            _mm512_set1_pd(M_PI_2)),
+        y1 = _mm512_mask_blend_pd(big, _mm512_mask_blend_pd(mid, zero,
+                                                            _mm512_set1_pd(0.5*LR_ATAN_MOREBITS)),
+                                  _mm512_set1_pd(LR_ATAN_MOREBITS));
+    const __m512d z = _mm512_mul_pd(xr, xr);
+    __m512d p = _mm512_set1_pd(LR_ATAN_P0), q = _mm512_add_pd(z, _mm512_set1_pd(LR_ATAN_Q0));
+    p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(LR_ATAN_P1));
+    p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(LR_ATAN_P2));
+    p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(LR_ATAN_P3));
+    p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(LR_ATAN_P4));
+    q = _mm512_add_pd(_mm512_mul_pd(q, z), _mm512_set1_pd(LR_ATAN_Q1));
+    q = _mm512_add_pd(_mm512_mul_pd(q, z), _mm512_set1_pd(LR_ATAN_Q2));
+    q = _mm512_add_pd(_mm512_mul_pd(q, z), _mm512_set1_pd(LR_ATAN_Q3));
+    q = _mm512_add_pd(_mm512_mul_pd(q, z), _mm512_set1_pd(LR_ATAN_Q4));
+    p = _mm512_div_pd(_mm512_mul_pd(z, p), q);
+    p = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(xr, p), xr), y1);
+    p = _mm512_add_pd(y0, p);
+    return _mm512_mask_sub_pd(p, neg, zero, p);
+}
+
+static inline __m512d __attribute__((target("avx512f")))
+lr_atan2_pi_avx512(__m512d y,
+                   __m512d x)
+{
+    const __m512d zero = _mm512_setzero_pd(), pi = _mm512_set1_pd(M_PI);
+    const __m512d t = lr_atan_avx512(_mm512_div_pd(y, _mm512_add_pd(x, zero))); // -0 to +0
+    // the sign of y, including -0
+    const __mmask8 neg_y = _mm512_test_epi64_mask(_mm512_castpd_si512(y),
+                                                  _mm512_set1_epi64(INT64_MIN));
+    const __mmask8 neg_x = _mm512_cmp_pd_mask(x, zero, _CMP_LT_OQ);
+    __m512d shift = _mm512_maskz_mov_pd(neg_x, pi);
+    shift = _mm512_mask_sub_pd(shift, neg_x & neg_y, zero, shift);
+    return _mm512_add_pd(_mm512_add_pd(t, shift), pi);
+}
+
+static inline __m512d __attribute__((target("avx512f")))
+lr_acos_avx512(__m512d c)
+{
+    const __m512d one = _mm512_set1_pd(1);
+    const __m512d t = lr_atan_avx512(_mm512_sqrt_pd(_mm512_div_pd(_mm512_sub_pd(one, c),
+                                                                  _mm512_add_pd(one, c))));
+    return _mm512_add_pd(t, t);
+}
+
+/* The signed distances along x and y to the neighbors of atom i, as
+   contiguous arrays. They are read directly from the neighbor list,
+   unless it has half storage or single precision, then they are
+   gathered into xbuf and ybuf (which need room for nn[i] elements). */
+static void
+lr_nb_xy(const nb_list *adj,
+         int i,
+         double *xbuf,
+         double *ybuf,
+         const double **xd,
+         const double **yd)
+{
+    const int o = adj->offset[i];
+    if (adj->pair == NULL && adj->xd != NULL) {
+        *xd = adj->xd + o;
+        *yd = adj->yd + o;
+        return;
+    }
+    for (int j = 0; j < adj->nn[i]; ++j) {
+        xbuf[j] = freesasa_nb_xd(adj, o + j);
+        ybuf[j] = freesasa_nb_yd(adj, o + j);
+    }
+    *xd = xbuf;
+    *yd = ybuf;
+}
+
+/* SIMD versions of lr_beta(), the array beta has to have room for
+   padding */
+static void __attribute__((target("avx2")))
+lr_beta_avx2(const lr_data *lr,
+             int i,
+             double *beta)
+{
+    const int nni = lr->adj->nn[i];
+    const int nbuf = (lr->adj->pair || lr->adj->xdf) && nni > 0 ? nni : 1;
+    double xbuf[nbuf], ybuf[nbuf];
+    const double *xd, *yd;
+    lr_nb_xy(lr->adj, i, xbuf, ybuf, &xd, &yd);
+    for (int j = 0; j < nni; j += 4) {
+        const __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(nni - j),
+                                                _mm256_set_epi64x(3, 2, 1, 0));
+        _mm256_storeu_pd(beta + j, lr_atan2_pi_avx2(_mm256_maskload_pd(yd + j, mask),
+                                                    _mm256_maskload_pd(xd + j, mask)));
+    }
+}
+
+static void __attribute__((target("avx512f")))
+lr_beta_avx512(const lr_data *lr,
+               int i,
+               double *beta)
+{
+    const int nni = lr->adj->nn[i];
+    const int nbuf = (lr->adj->pair || lr->adj->xdf) && nni > 0 ? nni : 1;
+    double xbuf[nbuf], ybuf[nbuf];
+    const double *xd, *yd;
+    lr_nb_xy(lr->adj, i, xbuf, ybuf, &xd, &yd);
+    for (int j = 0; j < nni; j += 8) {
+        const __mmask8 mask = nni - j >= 8 ? 0xFF : (1 << (nni - j)) - 1;
+        _mm512_storeu_pd(beta + j, lr_atan2_pi_avx512(_mm512_maskz_loadu_pd(mask, yd + j),
+                                                      _mm512_maskz_loadu_pd(mask, xd + j)));
+    }
+}
+
+static double
+atom_area_avx2(lr_data *lr,
+               int i)
+{
+    const int nni = lr->adj->nn[i];
+    const double Ri = lr->radii[i];
+    const int ns = lr->n_slices_per_atom;
+    const double delta = 2*Ri/ns;
+    double arc[nni*4+1], buf[LR_SWEEP_BUF(nni)];
+    int ibuf[LR_SWEEP_IBUF(nni)];
+    double sasa = 0;
+    lr_sweep sw;
+    const __m256d sign = _mm256_set1_pd(-0.0), zero = _mm256_setzero_pd(),
+        twopi = _mm256_set1_pd(TWOPI);
+
+    lr_sweep_init(&sw, lr, i, delta, lr_beta_avx2, buf, ibuf);
+    for (int islice = 0; islice < ns; ++islice) {
+        lr_sweep_update(&sw, islice);
+        const double z = -Ri + (islice + 0.5)*delta;
+        const double Ri_prime2 = Ri*Ri-z*z;
+        if (Ri_prime2 < 0 ) continue; // handle round-off errors
+        const double Ri_prime = sqrt(Ri_prime2);
+        if (Ri_prime <= 0) continue; // more round-off errors
+        const __m256d vz = _mm256_set1_pd(z), vRi_prime = _mm256_set1_pd(Ri_prime),
+            vRi_prime2 = _mm256_set1_pd(Ri_prime2);
+        int n_arcs = 0, is_buried = 0;
+        for (int j = sw.lo; j < sw.hi; j += 4) {
+            const __m256d dj = _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(sw.z+j), vz)),
+                Rj = _mm256_loadu_pd(sw.R+j);
+            int in_slice = _mm256_movemask_pd(_mm256_cmp_pd(dj, Rj, _CMP_LT_OQ));
+            if (in_slice == 0) continue;
+            const __m256d Rj_prime2 = _mm256_sub_pd(_mm256_loadu_pd(sw.R2+j), _mm256_mul_pd(dj, dj)),
+                Rj_prime = _mm256_sqrt_pd(_mm256_max_pd(Rj_prime2, zero)),
+                dij = _mm256_loadu_pd(sw.d+j);
+            // the same tests as in atom_area()
+            const int contact = in_slice &
+                _mm256_movemask_pd(_mm256_cmp_pd(dij, _mm256_add_pd(vRi_prime, Rj_prime), _CMP_LT_OQ));
+            if (contact & _mm256_movemask_pd(_mm256_cmp_pd(_mm256_add_pd(dij, vRi_prime), Rj_prime,
+                                                           _CMP_LT_OQ))) {
+                is_buried = 1;
+                break;
+            }
+            const int intersect = contact &
+                ~_mm256_movemask_pd(_mm256_cmp_pd(_mm256_add_pd(dij, Rj_prime), vRi_prime,
+                                                  _CMP_LT_OQ));
+            if (intersect == 0) continue;
+            const __m256d alpha =
+                lr_acos_avx2(_mm256_div_pd(_mm256_sub_pd(_mm256_add_pd(vRi_prime2, _mm256_loadu_pd(sw.d2+j)),
+                                                         Rj_prime2),
+                                           _mm256_mul_pd(_mm256_set1_pd(2.0),
+                                                         _mm256_mul_pd(vRi_prime, dij))));
+            const __m256d beta = _mm256_loadu_pd(sw.beta+j);
+            __m256d inf = _mm256_sub_pd(beta, alpha), sup = _mm256_add_pd(beta, alpha);
+            double inf_j[4], sup_j[4];
+            inf = _mm256_add_pd(inf, _mm256_and_pd(_mm256_cmp_pd(inf, zero, _CMP_LT_OQ), twopi));
+            sup = _mm256_sub_pd(sup, _mm256_and_pd(_mm256_cmp_pd(sup, twopi, _CMP_GT_OQ), twopi));
+            _mm256_storeu_pd(inf_j, inf);
+            _mm256_storeu_pd(sup_j, sup);
+            // append the arcs, split in two if they pass 2*PI
+            for (int m = intersect; m != 0; m &= m - 1) {
+                const int k = __builtin_ctz(m), narc2 = 2*n_arcs;
+                if (sup_j[k] < inf_j[k]) {
+                    arc[narc2]   = 0;
+                    arc[narc2+1] = sup_j[k];
+                    arc[narc2+2] = inf_j[k];
+                    arc[narc2+3] = TWOPI;
+                    n_arcs += 2;
+                } else {
+                    arc[narc2]   = inf_j[k];
+                    arc[narc2+1] = sup_j[k];
+                    ++n_arcs;
+                }
+            }
+        }
+        if (is_buried == 0) {
+            sasa += delta*Ri*exposed_arc_length(arc,n_arcs);
+        }
+    }
+    return sasa;
+}
+
+/* Like atom_area_avx2(), but the arcs are appended to the list using
+   compressing masked stores: each neighbor contributes the arc
+   [inf,sup], or [0,sup] and [inf,2 pi] if it passes 2 pi. */
+static double
+atom_area_avx512(lr_data *lr,
+                 int i)
+{
+    const int nni = lr->adj->nn[i];
+    const double Ri = lr->radii[i];
+    const int ns = lr->n_slices_per_atom;
+    const double delta = 2*Ri/ns;
+    double arc[nni*4+1], buf[LR_SWEEP_BUF(nni)];
+    int ibuf[LR_SWEEP_IBUF(nni)];
+    double sasa = 0;
+    lr_sweep sw;
+    const __m512d zero = _mm512_setzero_pd(), twopi = _mm512_set1_pd(TWOPI);
+    // for interleaving the start- and endpoints of 4 arcs at a time
+    const __m512i lo = _mm512_set_epi64(11, 3, 10, 2, 9, 1, 8, 0),
+        hi = _mm512_set_epi64(15, 7, 14, 6, 13, 5, 12, 4);
+
+    lr_sweep_init(&sw, lr, i, delta, lr_beta_avx512, buf, ibuf);
+    for (int islice = 0; islice < ns; ++islice) {
+        lr_sweep_update(&sw, islice);
+        const double z = -Ri + (islice + 0.5)*delta;
+        const double Ri_prime2 = Ri*Ri-z*z;
+        if (Ri_prime2 < 0 ) continue; // handle round-off errors
+        const double Ri_prime = sqrt(Ri_prime2);
+        if (Ri_prime <= 0) continue; // more round-off errors
+        const __m512d vz = _mm512_set1_pd(z), vRi_prime = _mm512_set1_pd(Ri_prime),
+            vRi_prime2 = _mm512_set1_pd(Ri_prime2);
+        int n_arcs = 0, is_buried = 0;
+        for (int j = sw.lo; j < sw.hi; j += 8) {
+            const __m512d dj = _mm512_abs_pd(_mm512_sub_pd(_mm512_loadu_pd(sw.z+j), vz)),
+                Rj = _mm512_loadu_pd(sw.R+j);
+            const __mmask8 in_slice = _mm512_cmp_pd_mask(dj, Rj, _CMP_LT_OQ);
+            if (in_slice == 0) continue;
+            const __m512d Rj_prime2 = _mm512_sub_pd(_mm512_loadu_pd(sw.R2+j), _mm512_mul_pd(dj, dj)),
+                Rj_prime = _mm512_sqrt_pd(_mm512_max_pd(Rj_prime2, zero)),
+                dij = _mm512_loadu_pd(sw.d+j);
+            const __mmask8 contact =
+                _mm512_mask_cmp_pd_mask(in_slice, dij, _mm512_add_pd(vRi_prime, Rj_prime), _CMP_LT_OQ);
+            if (_mm512_mask_cmp_pd_mask(contact, _mm512_add_pd(dij, vRi_prime), Rj_prime, _CMP_LT_OQ)) {
+                is_buried = 1;
+                break;
+            }
+            const __mmask8 intersect = contact &
+                ~_mm512_cmp_pd_mask(_mm512_add_pd(dij, Rj_prime), vRi_prime, _CMP_LT_OQ);
+            if (intersect == 0) continue;
+            const __m512d alpha =
+                lr_acos_avx512(_mm512_div_pd(_mm512_sub_pd(_mm512_add_pd(vRi_prime2, _mm512_loadu_pd(sw.d2+j)),
+                                                           Rj_prime2),
+                                             _mm512_mul_pd(_mm512_set1_pd(2.0),
+                                                           _mm512_mul_pd(vRi_prime, dij))));
+            const __m512d beta = _mm512_loadu_pd(sw.beta+j);
+            __m512d inf = _mm512_sub_pd(beta, alpha), sup = _mm512_add_pd(beta, alpha);
+            inf = _mm512_mask_add_pd(inf, _mm512_cmp_pd_mask(inf, zero, _CMP_LT_OQ), inf, twopi);
+            sup = _mm512_mask_sub_pd(sup, _mm512_cmp_pd_mask(sup, twopi, _CMP_GT_OQ), sup, twopi);
+            const __mmask8 wrap = intersect & _mm512_cmp_pd_mask(sup, inf, _CMP_LT_OQ);
+            // [inf,sup], or [0,sup] for the arcs that pass 2 pi
+            const __m512d start = _mm512_mask_mov_pd(inf, wrap, zero);
+            const __m512d a_lo = _mm512_permutex2var_pd(start, lo, sup),
+                a_hi = _mm512_permutex2var_pd(start, hi, sup),
+                b_lo = _mm512_permutex2var_pd(inf, lo, twopi),
+                b_hi = _mm512_permutex2var_pd(inf, hi, twopi);
+            // each bit of the mask is doubled, for the pairs
+            const __mmask8 m_lo = lr_pair_mask[intersect & 0xF], m_hi = lr_pair_mask[intersect >> 4],
+                w_lo = lr_pair_mask[wrap & 0xF], w_hi = lr_pair_mask[wrap >> 4];
+            double *a = arc + 2*n_arcs;
+            _mm512_mask_compressstoreu_pd(a, m_lo, a_lo);
+            a += 2*__builtin_popcount(intersect & 0xF);
+            _mm512_mask_compressstoreu_pd(a, m_hi, a_hi);
+            a += 2*__builtin_popcount(intersect >> 4);
+            _mm512_mask_compressstoreu_pd(a, w_lo, b_lo);
+            a += 2*__builtin_popcount(wrap & 0xF);
+            _mm512_mask_compressstoreu_pd(a, w_hi, b_hi);
+            n_arcs += __builtin_popcount(intersect) + __builtin_popcount(wrap);
+        }
         if (is_buried == 0) {
             sasa += delta*Ri*exposed_arc_length(arc,n_arcs);
         }
     }
     return sasa;
 }
+#endif /* LR_X86_SIMD */
 
 //insertion sort (faster than qsort for these short lists)
 inline static void
@@ -313,28 +1431,164 @@ sort_arcs(double * restrict arc,
     }
 }
 
-// sort arcs by start-point, loop through them to sum parts of circle
-// not covered by any of the arcs
+// sum of the parts of the circle not covered by any of the arcs,
+// which have to be sorted by start-point
+inline static double
+uncovered_arc_length(const double * restrict arc,
+                     int n)
+{
+    double sum = arc[0], sup = arc[1], tmp;
+    // in the following it is assumed that the arc[i2] <= arc[i2+1]
+    for (int i2 = 2; i2 < 2*n; i2 += 2) {
+        if (sup < arc[i2]) sum += arc[i2] - sup;
+        tmp = arc[i2+1];
+        if (tmp > sup) sup = tmp;
+    }
+    return sum + TWOPI - sup;
+}
+
+// counting sort on the start-point, with one bucket per arc, the
+// buckets are then sorted by insertion sort, which is linear for
+// nearly sorted input. tmp should have room for n arcs.
+static void
+sort_arcs_bucket(double * restrict arc,
+                 int n,
+                 double * restrict tmp)
+{
+    const double scale = n/TWOPI;
+    int first[n+1];
+
+    memset(first, 0, sizeof(int)*(n+1));
+    for (int i = 0; i < n; ++i) {
+        int b = (int)(arc[2*i]*scale);
+        if (b >= n) b = n - 1;
+        ++first[b+1];
+    }
+    for (int b = 0; b < n; ++b) first[b+1] += first[b];
+    for (int i = 0; i < n; ++i) {
+        int b = (int)(arc[2*i]*scale);
+        if (b >= n) b = n - 1;
+        tmp[2*first[b]] = arc[2*i];
+        tmp[2*first[b]+1] = arc[2*i+1];
+        ++first[b];
+    }
+    memcpy(arc, tmp, sizeof(double)*2*n);
+    sort_arcs(arc, n);
+}
+
+// the circle is divided into 64 bins, and a bitmask keeps track of
+// the bins that are completely covered by at least one arc. Arcs that
+// only touch covered bins are replaced by one arc per run of covered
+// bins, the result is exact. In crowded slices most arcs are removed
+// this way, or the whole circle is found to be covered.
+static double
+exposed_arc_length_mask(double * restrict arc,
+                        int n)
+{
+    const double scale = 64/TWOPI, bin = TWOPI/64;
+    double buf[2*(n+32)], tmp[2*(n+32)];
+    uint64_t mask = 0;
+    int m = 0;
+
+    // the arcs are within [0,2pi], so casting to int rounds down
+    for (int i = 0; i < n; ++i) {
+        const double x = arc[2*i]*scale;
+        const int hi = (int) (arc[2*i+1]*scale), lo = (int) x + ((int) x < x);
+        if (hi - lo >= 64) return 0;
+        if (hi > lo) mask |= (UINT64_MAX >> (64 - (hi - lo))) << lo;
+    }
+    if (mask == UINT64_MAX) return 0;
+
+    for (int i = 0; i < n; ++i) {
+        const double x = arc[2*i+1]*scale;
+        int lo = (int) (arc[2*i]*scale), hi = (int) x + ((int) x < x);
+        if (lo > 63) lo = 63;
+        if (hi <= lo) hi = lo + 1;
+        if (hi > 64) hi = 64;
+        const uint64_t touched = (UINT64_MAX >> (64 - (hi - lo))) << lo;
+        if ((mask & touched) != touched) {
+            buf[2*m] = arc[2*i];
+            buf[2*m+1] = arc[2*i+1];
+            ++m;
+        }
+    }
+    for (int b = 0; b < 64; ) {
+        if (!(mask >> b & 1)) {
+            ++b;
+            continue;
+        }
+        const int lo = b;
+        while (b < 64 && (mask >> b & 1)) ++b;
+        buf[2*m] = lo*bin;
+        buf[2*m+1] = b*bin;
+        ++m;
+    }
+
+    sort_arcs_bucket(buf, m, tmp);
+    return uncovered_arc_length(buf, m);
+}
+
+// the arcs are sorted by start-point, using insertion sort for short
+// lists and a bucket sort for longer ones. For long lists the arcs
+// are first filtered using exposed_arc_length_mask(). The thresholds
+// are based on the microbenchmark in test_arc_union_benchmark.
 inline static double
 exposed_arc_length(double * restrict arc,
                    int n)
 {
     if (n == 0) return TWOPI;
-    double sum, sup, tmp;
-    sort_arcs(arc,n);
+    if (n < LR_ARCS_BUCKET) {
+        sort_arcs(arc,n);
+    } else if (n < LR_ARCS_MASK) {
+        double tmp[2*n];
+        sort_arcs_bucket(arc, n, tmp);
+    } else {
+        return exposed_arc_length_mask(arc, n);
+    }
+    return uncovered_arc_length(arc, n);
+}
+
+inline static void
+sort_arcs_single(float * restrict arc,
+                 int n)
+{
+    float tmp[2];
+    float *end = arc+2*n, *arcj, *arci;
+    for (arci = arc+2; arci < end; arci += 2) {
+        tmp[0] = arci[0];
+        tmp[1] = arci[1];
+        arcj = arci;
+        while (arcj > arc && *(arcj-2) > tmp[0]) {
+            arcj[0] = arcj[-2];
+            arcj[1] = arcj[-1];
+            arcj -= 2;
+        }
+        arcj[0] = tmp[0];
+        arcj[1] = tmp[1];
+    }
+}
+
+inline static float
+exposed_arc_length_single(float * restrict arc,
+                          int n)
+{
+    const float twopi = TWOPI;
+    if (n == 0) return twopi;
+    float sum, sup, tmp;
+    sort_arcs_single(arc,n);
     sum = arc[0];
     sup = arc[1];
-    // in the following it is assumed that the arc[i2] <= arc[i2+1]
     for (int i2 = 2; i2 < 2*n; i2 += 2) {
         if (sup < arc[i2]) sum += arc[i2] - sup;
         tmp = arc[i2+1];
         if (tmp > sup) sup = tmp;
-    } 
-    return sum + TWOPI - sup;
+    }
+    return sum + twopi - sup;
 }
 
 #if USE_CHECK
 #include <check.h>
+#include <time.h>
 
 static int
 is_identical(const double *l1, const double *l2, int n) {
@@ -391,12 +1645,135 @@ START_TEST (test_exposed_arc_length)
 }
 END_TEST
 
+/* Stores the arc of width 2*alpha centered at beta, splitting it in
+   two if it passes 0, returns the new number of arcs */
+static int
+lr_add_arc(double *arc,
+           int n_arcs,
+           double alpha,
+           double beta)
+{
+    double inf = beta - alpha, sup = beta + alpha;
+    if (inf < 0) inf += TWOPI;
+    if (sup > TWOPI) sup -= TWOPI;
+    if (sup < inf) {
+        arc[2*n_arcs]   = 0;
+        arc[2*n_arcs+1] = sup;
+        arc[2*n_arcs+2] = inf;
+        arc[2*n_arcs+3] = TWOPI;
+        return n_arcs + 2;
+    }
+    arc[2*n_arcs]   = inf;
+    arc[2*n_arcs+1] = sup;
+    return n_arcs + 1;
+}
+
+// n random arcs, with half-widths up to max_alpha <= pi
+static void
+random_arcs(double *arc,
+            int n,
+            double max_alpha,
+            unsigned int *seed)
+{
+    double buf[2*(n+1)];
+    int m = 0;
+    while (m < n) {
+        double beta, alpha;
+        *seed = *seed*1103515245 + 12345;
+        beta = TWOPI*(*seed >> 8)/(1 << 24);
+        *seed = *seed*1103515245 + 12345;
+        alpha = max_alpha*(*seed >> 8)/(1 << 24);
+        m = lr_add_arc(buf, m, alpha, beta);
+    }
+    // a split arc at the end can give one arc too many
+    memcpy(arc, buf, sizeof(double)*2*n);
+}
+
+// reference implementation, using insertion sort for all lengths
+static double
+exposed_arc_length_insertion(double *arc,
+                             int n)
+{
+    if (n == 0) return TWOPI;
+    sort_arcs(arc, n);
+    return uncovered_arc_length(arc, n);
+}
+
+START_TEST (test_arc_union)
+{
+    // the different algorithms should give the same results, for
+    // sparse and crowded circles
+    unsigned int seed = 1;
+    for (int n = 1; n <= 300; n += (n < 80 ? 1 : 17)) {
+        double arc[2*n], a1[2*n], a2[2*n], a3[2*n];
+        for (int rep = 0; rep < 10; ++rep) {
+            // from sparse to crowded circles
+            random_arcs(arc, n, fmin(M_PI, (rep + 1)*TWOPI/n), &seed);
+            memcpy(a1, arc, sizeof(arc));
+            memcpy(a2, arc, sizeof(arc));
+            memcpy(a3, arc, sizeof(arc));
+            const double ref = exposed_arc_length_insertion(a1, n);
+            double tmp[2*n];
+            sort_arcs_bucket(a2, n, tmp);
+            ck_assert(is_identical(a1, a2, 2*n));
+            ck_assert(fabs(exposed_arc_length_mask(a3, n) - ref) < 1e-12);
+        }
+    }
+}
+END_TEST
+
+START_TEST (test_arc_union_benchmark)
+{
+    // Prints the time per call for the three ways of calculating the
+    // union of arcs. LR_ARCS_BUCKET and LR_ARCS_MASK are chosen from
+    // where the lines cross. In sparse circles the arcs cover about
+    // 1 - 1/e of the circle, in crowded ones the half-widths are
+    // typical for buried atoms. Doesn't test anything.
+    const int n_arcs[] = {4, 8, 16, 24, 32, 48, 64, 96, 128, 256};
+    const int n_sets = 64, total = 100000;
+    unsigned int seed = 1;
+    double sum = 0;
+
+    printf("\nArc union, ns per call (insertion / bucket / mask):\n");
+    printf("          %-26s %s\n", "sparse", "crowded");
+    for (int k = 0; k < sizeof(n_arcs)/sizeof(int); ++k) {
+        const int n = n_arcs[k], reps = total/n + 1;
+        double arcs[n_sets][2*n], a[2*n], tmp[2*n], t[2][3];
+        for (int crowded = 0; crowded < 2; ++crowded) {
+            for (int s = 0; s < n_sets; ++s) {
+                random_arcs(arcs[s], n, crowded ? 1.0 : TWOPI/n, &seed);
+            }
+            for (int method = 0; method < 3; ++method) {
+                clock_t start = clock();
+                for (int r = 0; r < reps; ++r) {
+                    memcpy(a, arcs[r % n_sets], sizeof(a));
+                    switch (method) {
+                    case 0: sum += exposed_arc_length_insertion(a, n); break;
+                    case 1: sort_arcs_bucket(a, n, tmp); sum += uncovered_arc_length(a, n); break;
+                    default: sum += exposed_arc_length_mask(a, n);
+                    }
+                }
+                t[crowded][method] = 1e9*(clock() - start)/CLOCKS_PER_SEC/reps;
+            }
+        }
+        printf("%4d arcs: %8.1f %8.1f %8.1f  %8.1f %8.1f %8.1f\n", n,
+               t[0][0], t[0][1], t[0][2], t[1][0], t[1][1], t[1][2]);
+    }
+    ck_assert(sum > 0);
+}
+END_TEST
+
 TCase *
 test_LR_static()
 {
     TCase *tc = tcase_create("sasa_lr.c static");
     tcase_add_test(tc, test_sort_arcs);
     tcase_add_test(tc, test_exposed_arc_length);
+    tcase_add_test(tc, test_arc_union);
+    // the benchmark only prints timings, only run it on request
+    if (getenv("FREESASA_BENCHMARK")) {
+        tcase_add_test(tc, test_arc_union_benchmark);
+    }
 
     return tc;
 }
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdint.h>
 #if USE_THREADS
 # include <pthread.h>
 #endif
@@ -13,36 +14,187 @@
 #include "freesasa_internal.h"
 #include "nb.h"
 
+#if USE_SIMD && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define SR_X86_SIMD 1
+# include <immintrin.h>
+#else
+# define SR_X86_SIMD 0
+#endif
+
 #ifdef __GNUC__
 #define __attrib_pure__ __attribute__((pure))
 #else
 #define __attrib_pure__
 #endif
 
-// calculation parameters (results stored in *sasa)
+/* The SIMD kernels should give exactly the same surface points as
+   the scalar one, i.e. the distances have to be rounded the same
+   way. Therefore the compiler is not allowed to fuse multiplications
+   and additions, in the scalar kernel or in the SIMD kernels (AVX-512
+   implies FMA). */
+#if defined(__GNUC__) && !defined(__clang__)
+#define __attrib_nocontract__ __attribute__((optimize("fp-contract=off")))
+#else
+#define __attrib_nocontract__
+#endif
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+// the test-point arrays are padded to a multiple of the widest SIMD kernel
+#define SR_SIMD_WIDTH 16
+
+/* Atoms that are completely buried are found before the calculation
+   (see freesasa_nb_buried()) if there are at least this many test
+   points. With fewer points the kernels are faster also for buried
+   atoms, since the first neighbor tested usually buries each point. */
+#define SR_BURIAL_MIN_POINTS 2000
+
+/* The test points are divided into regions, the cells of a cube map
+   with this many cells along each side of the faces. The NSOL
+   kernels remember the last neighbor that buried a point in each
+   region, and test it when the neighbor that buried the previous
+   point doesn't bury the current one. */
+#define SR_REGION_GRID 2
+#define SR_N_REGIONS (6*SR_REGION_GRID*SR_REGION_GRID)
+
+// the smallest number of test points used for adaptive resolution
+#define SR_ADAPTIVE_MIN_POINTS 16
+
+// angular resolution of the lookup table of occlusion masks (radians)
+#define SR_LUT_STEP 0.05
+// maximum size of a lookup table (in bytes), the resolution is reduced if necessary
+#define SR_LUT_MAX_SIZE (256 << 20)
+
+typedef struct sr_data sr_data;
+typedef struct sr_lut sr_lut;
+
+// patches of test points, each with a bounding cap on the unit sphere
 typedef struct {
-    int i1,i2; // for multithreading, range of atoms
+    int n;
+    int *first; // the points of patch l are first[l] .. first[l+1]-1
+    double *x, *y, *z; // centers of the bounding caps
+    double *cos_r, *sin_r; // half-angles of the bounding caps
+} sr_patches;
+
+/* Lookup table of occlusion masks for a given set of test points. A
+   neighbor buries a cap of the unit sphere of test points, which is
+   determined by its direction and the half-angle of the cap. The
+   direction is quantized using a cube map (the 6 faces of the cube
+   are divided into n_grid x n_grid cells), the half-angle in n_theta
+   levels between 0 and pi. For each combination the table stores a
+   bitmask of the test points inside the cap. */
+struct sr_lut {
+    int n_points;
+    freesasa_sr_point_set point_set;
+    int n_words; // 64-bit words per mask
+    int n_grid;
+    int n_theta;
+    double d_theta;
+    uint64_t *mask; // [6][n_grid][n_grid][n_theta][n_words]
+    sr_lut *next;
+};
+
+// one table per number of test points, built on demand and kept until exit
+static sr_lut *sr_lut_cache = NULL;
+#if USE_THREADS
+static pthread_mutex_t sr_lut_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// calculation parameters (results stored in *sasa)
+struct sr_data {
     int n_atoms;
     int n_points;
+    freesasa_sr_point_set point_set;
     double probe_radius;
     const coord_t *xyz;
     coord_t *srp; // test-points
+    sr_patches patches; // only for the icosahedral point set, else patches.n == 0
+    double *tpx, *tpy, *tpz; // test-points as structure of arrays (padded)
+    float *tpxf, *tpyf, *tpzf; // the same in single precision
+    int *region; // the region of each test point, see SR_REGION_GRID
     double *r;
     double *r2;
     nb_list *nb;
+    freesasa_verlet_list *verlet; // nb belongs to it if not NULL
+    nb_search *search; // if not NULL nb belongs to it, and only has the neighbors of one atom
+    char *buried; // atoms known to be buried, skipped by the kernels
     double *sasa;
-} sr_data;
+    const sr_lut *lut; // only used by the lookup-table kernel
+    // adaptive resolution, levels of test points from coarse to fine
+    int n_levels;
+    sr_data *levels;
+    double tolerance;
+    double (*atom_area)(int i, const sr_data *sr); // the kernel
+};
 
 #if USE_THREADS
 static int sr_do_threads(int n_threads, sr_data *sr);
-static void *sr_thread(void *arg);
+static void sr_range(void *data, int first, int end);
 #endif
 
+static int
+sr_search(sr_data *sr);
+
+static double
+sr_atom_area(int i, const sr_data *sr) __attrib_pure__ __attrib_nocontract__;
+
+static double
+sr_atom_area_single(int i, const sr_data *sr) __attrib_pure__ __attrib_nocontract__;
+
+static double
+sr_atom_area_cap(int i, const sr_data *sr) __attrib_pure__;
+
+static double
+sr_atom_area_lut(int i, const sr_data *sr) __attrib_pure__;
+
+static double
+sr_atom_area_patch(int i, const sr_data *sr) __attrib_pure__;
+
+static double
+sr_atom_area_adaptive(int i, const sr_data *sr) __attrib_pure__;
+
+static double
+sr_distance_tests(const sr_data *sr, int hints);
+
+static void
+release_sr_points(sr_data *sr);
+
+static void
+release_sr_levels(sr_data *levels, int first, int last);
+
+#if SR_X86_SIMD
 static double
-sr_atom_area(int i, const sr_data *sr) __attrib_pure__;
+sr_atom_area_avx2(int i, const sr_data *sr)
+    __attrib_pure__ __attrib_nocontract__ __attribute__((target("avx2")));
+
+static double
+sr_atom_area_avx512(int i, const sr_data *sr)
+    __attrib_pure__ __attrib_nocontract__ __attribute__((target("avx512f")));
+
+static double
+sr_atom_area_avx2_single(int i, const sr_data *sr)
+    __attrib_pure__ __attrib_nocontract__ __attribute__((target("avx2")));
+
+static double
+sr_atom_area_avx512_single(int i, const sr_data *sr)
+    __attrib_pure__ __attrib_nocontract__ __attribute__((target("avx512f")));
+#endif
+
+static inline int
+sr_popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1) ++n;
+    return n;
+#endif
+}
 
 static coord_t *
-test_points(int N) 
+spiral_points(int N)
 {
     // Golden section spiral on a sphere
     // from http://web.archive.org/web/20120421191837/http://www.cgafaq.info/wiki/Evenly_distributed_points_on_sphere
@@ -77,16 +229,500 @@ test_points(int N)
     return NULL;
 }
 
+/* Geodesic grid with frequency f (10f^2 + 2 points), each face of the
+   icosahedron is divided into f^2 triangles and the vertices of these
+   are projected onto the unit sphere. Stores the points in p and
+   returns their number. */
+static int
+geodesic_points(int f,
+                double *p)
+{
+    const double phi = (1 + sqrt(5))/2;
+    const double v[12][3] = {{0,1,phi},{0,1,-phi},{0,-1,phi},{0,-1,-phi},
+                             {1,phi,0},{1,-phi,0},{-1,phi,0},{-1,-phi,0},
+                             {phi,0,1},{phi,0,-1},{-phi,0,1},{-phi,0,-1}};
+    int n = 0;
+
+// the edges of the icosahedron have length 2
+#define ICO_EDGE(a,b) (fabs((v[a][0]-v[b][0])*(v[a][0]-v[b][0]) + \
+                            (v[a][1]-v[b][1])*(v[a][1]-v[b][1]) + \
+                            (v[a][2]-v[b][2])*(v[a][2]-v[b][2]) - 4) < 1e-9)
+#define ICO_ADD(x,y,z) do {                                     \
+        double norm_ = sqrt((x)*(x) + (y)*(y) + (z)*(z));       \
+        p[3*n] = (x)/norm_; p[3*n+1] = (y)/norm_; p[3*n+2] = (z)/norm_; \
+        ++n;                                                    \
+    } while (0)
+
+    // vertices, points on edges and points inside faces
+    for (int a = 0; a < 12; ++a)
+        ICO_ADD(v[a][0], v[a][1], v[a][2]);
+    for (int a = 0; a < 12; ++a) {
+        for (int b = a+1; b < 12; ++b) {
+            if (!ICO_EDGE(a,b)) continue;
+            for (int s = 1; s < f; ++s)
+                ICO_ADD((f-s)*v[a][0] + s*v[b][0],
+                        (f-s)*v[a][1] + s*v[b][1],
+                        (f-s)*v[a][2] + s*v[b][2]);
+        }
+    }
+    for (int a = 0; a < 12; ++a) {
+        for (int b = a+1; b < 12; ++b) {
+            if (!ICO_EDGE(a,b)) continue;
+            for (int c = b+1; c < 12; ++c) {
+                if (!ICO_EDGE(a,c) || !ICO_EDGE(b,c)) continue;
+                for (int s = 1; s < f; ++s) {
+                    for (int t = 1; s + t < f; ++t) {
+                        const int u = f - s - t;
+                        ICO_ADD(s*v[a][0] + t*v[b][0] + u*v[c][0],
+                                s*v[a][1] + t*v[b][1] + u*v[c][1],
+                                s*v[a][2] + t*v[b][2] + u*v[c][2]);
+                    }
+                }
+            }
+        }
+    }
+#undef ICO_EDGE
+#undef ICO_ADD
+    assert(n == 10*f*f + 2);
+    return n;
+}
+
+static void
+release_patches(sr_patches *patches)
+{
+    free(patches->first);
+    free(patches->x);
+    free(patches->y);
+    free(patches->z);
+    free(patches->cos_r);
+    free(patches->sin_r);
+    memset(patches, 0, sizeof(sr_patches));
+}
+
+/* Geodesic grid with the number of points closest to N. The points
+   are grouped in patches around the points of a coarser grid (about
+   64 points per patch), and ordered by patch. */
+static coord_t *
+icosahedral_points(int N,
+                   sr_patches *patches)
+{
+    int f = (int)sqrt((N-2)/10.0), g, n, m;
+    double *p = NULL, *c = NULL, *tp = NULL;
+    int *patch = NULL, *count = NULL;
+    coord_t *coord = NULL;
+
+    if (f < 1) f = 1;
+    if (abs(10*(f+1)*(f+1) + 2 - N) < abs(10*f*f + 2 - N)) ++f;
+    g = (f + 4)/8;
+    if (g < 1) g = 1;
+    n = 10*f*f + 2;
+    m = 10*g*g + 2;
+
+    p = malloc(sizeof(double)*3*n);
+    tp = malloc(sizeof(double)*3*n);
+    c = malloc(sizeof(double)*3*m);
+    patch = malloc(sizeof(int)*n);
+    count = calloc(m+1, sizeof(int));
+    coord = freesasa_coord_new();
+    patches->n = m;
+    patches->first = malloc(sizeof(int)*(m+1));
+    patches->x = malloc(sizeof(double)*m);
+    patches->y = malloc(sizeof(double)*m);
+    patches->z = malloc(sizeof(double)*m);
+    patches->cos_r = malloc(sizeof(double)*m);
+    patches->sin_r = malloc(sizeof(double)*m);
+    if (!p || !tp || !c || !patch || !count || !coord || !patches->first ||
+        !patches->x || !patches->y || !patches->z ||
+        !patches->cos_r || !patches->sin_r) {
+        mem_fail();
+        goto cleanup;
+    }
+
+    geodesic_points(f, p);
+    geodesic_points(g, c);
+
+    // assign each point to the closest patch center, and sort by patch
+    for (int j = 0; j < n; ++j) {
+        double max = -2;
+        for (int l = 0; l < m; ++l) {
+            double dot = p[3*j]*c[3*l] + p[3*j+1]*c[3*l+1] + p[3*j+2]*c[3*l+2];
+            if (dot > max) {
+                max = dot;
+                patch[j] = l;
+            }
+        }
+        ++count[patch[j]+1];
+    }
+    patches->first[0] = 0;
+    for (int l = 0; l < m; ++l) {
+        patches->first[l+1] = patches->first[l] + count[l+1];
+        count[l+1] = patches->first[l];
+        patches->x[l] = c[3*l];
+        patches->y[l] = c[3*l+1];
+        patches->z[l] = c[3*l+2];
+        patches->cos_r[l] = 1;
+    }
+    for (int j = 0; j < n; ++j) {
+        const int l = patch[j], k = count[l+1]++;
+        const double dot = p[3*j]*c[3*l] + p[3*j+1]*c[3*l+1] + p[3*j+2]*c[3*l+2];
+        memcpy(tp+3*k, p+3*j, sizeof(double)*3);
+        if (dot < patches->cos_r[l]) patches->cos_r[l] = dot;
+    }
+    // the caps are made slightly larger, to be safe from round-off errors
+    for (int l = 0; l < m; ++l) {
+        const double r = acos(patches->cos_r[l] > -1 ? patches->cos_r[l] : -1) + 1e-9;
+        patches->cos_r[l] = cos(r);
+        patches->sin_r[l] = sin(r);
+    }
+
+    if (freesasa_coord_append(coord, tp, n) == FREESASA_FAIL) {
+        fail_msg("");
+        goto cleanup;
+    }
+    free(p);
+    free(tp);
+    free(c);
+    free(patch);
+    free(count);
+    return coord;
+
+ cleanup:
+    free(p);
+    free(tp);
+    free(c);
+    free(patch);
+    free(count);
+    freesasa_coord_free(coord);
+    release_patches(patches);
+    return NULL;
+}
+
+static coord_t *
+test_points(int N,
+            freesasa_sr_point_set point_set,
+            sr_patches *patches)
+{
+    memset(patches, 0, sizeof(sr_patches));
+    switch (point_set) {
+    case FREESASA_SR_SPIRAL:
+        return spiral_points(N);
+    case FREESASA_SR_ICOSAHEDRAL:
+        return icosahedral_points(N, patches);
+    default:
+        fail_msg("illegal test-point set %d", point_set);
+        return NULL;
+    }
+}
+
+static void
+release_sr_points(sr_data *sr)
+{
+    freesasa_coord_free(sr->srp);
+    release_patches(&sr->patches);
+    free(sr->tpx);
+    free(sr->tpy);
+    free(sr->tpz);
+    free(sr->tpxf);
+    free(sr->tpyf);
+    free(sr->tpzf);
+    free(sr->region);
+    sr->srp = NULL;
+    sr->region = NULL;
+    sr->tpx = sr->tpy = sr->tpz = NULL;
+    sr->tpxf = sr->tpyf = sr->tpzf = NULL;
+}
+
+// free the levels of adaptive resolution, with test points in first .. last-1
+static void
+release_sr_levels(sr_data *levels,
+                  int first,
+                  int last)
+{
+    for (int l = first; l < last; ++l) release_sr_points(&levels[l]);
+    free(levels);
+}
+
 // free contents
 void
 release_sr(sr_data *sr)
 {
-    freesasa_coord_free(sr->srp);
-    freesasa_nb_free(sr->nb);
+    // the finest level shares the test points with sr
+    if (sr->levels) release_sr_levels(sr->levels, 0, sr->n_levels - 1);
+    release_sr_points(sr);
+    if (sr->search) freesasa_nb_search_free(sr->search);
+    else if (!sr->verlet) freesasa_nb_free(sr->nb);
+    free(sr->buried);
     free(sr->r);
     free(sr->r2);
 }
 
+static void
+sr_lut_free_all(void)
+{
+    sr_lut *lut = sr_lut_cache, *next;
+    while (lut) {
+        next = lut->next;
+        free(lut->mask);
+        free(lut);
+        lut = next;
+    }
+    sr_lut_cache = NULL;
+}
+
+/* Index of the cell containing the direction (x,y,z), not necessarily
+   normalized, in a cube map with n x n cells per face. */
+static inline int
+sr_cube_cell(int n,
+             double x,
+             double y,
+             double z)
+{
+    const double ax = fabs(x), ay = fabs(y), az = fabs(z);
+    int face, ia, ib;
+    double a, b;
+
+    if (ax >= ay && ax >= az) {
+        face = x < 0; a = y/ax; b = z/ax;
+    } else if (ay >= az) {
+        face = 2 + (y < 0); a = z/ay; b = x/ay;
+    } else {
+        face = 4 + (z < 0); a = x/az; b = y/az;
+    }
+    ia = (int)((a + 1)*0.5*n);
+    ib = (int)((b + 1)*0.5*n);
+    if (ia >= n) ia = n-1;
+    if (ib >= n) ib = n-1;
+    return (face*n + ia)*n + ib;
+}
+
+static sr_lut *
+sr_lut_new(const sr_data *sr)
+{
+    const int n_points = sr->n_points, n_words = (n_points + 63)/64;
+    double step = SR_LUT_STEP;
+    sr_lut *lut = malloc(sizeof(sr_lut));
+    uint64_t *mask;
+    size_t size;
+
+    if (lut == NULL) return NULL;
+    lut->n_points = n_points;
+    lut->point_set = sr->point_set;
+    lut->n_words = n_words;
+    for (;;) {
+        lut->n_grid = (int)ceil(2/step);
+        lut->n_theta = (int)ceil(M_PI/step) + 1;
+        size = sizeof(uint64_t)*6*lut->n_grid*lut->n_grid*lut->n_theta*n_words;
+        if (size <= SR_LUT_MAX_SIZE) break;
+        step *= 1.25;
+    }
+    lut->d_theta = M_PI/(lut->n_theta - 1);
+    lut->mask = calloc(1, size);
+    lut->next = NULL;
+    if (lut->mask == NULL) {
+        free(lut);
+        return NULL;
+    }
+
+    for (int face = 0; face < 6; ++face) {
+        const int axis = face/2;
+        const double sign = face % 2 ? -1 : 1;
+        for (int ia = 0; ia < lut->n_grid; ++ia) {
+            for (int ib = 0; ib < lut->n_grid; ++ib) {
+                // direction through the center of the cell
+                double u[3], norm;
+                u[axis] = sign;
+                u[(axis+1)%3] = -1 + (ia + 0.5)*2/lut->n_grid;
+                u[(axis+2)%3] = -1 + (ib + 0.5)*2/lut->n_grid;
+                norm = sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+                for (int l = 0; l < 3; ++l) u[l] /= norm;
+                /* A point is in the caps with half-angles larger than
+                   its angle to u. Mark it in the smallest one, and
+                   then accumulate the masks for increasing angles. */
+                mask = lut->mask +
+                    (size_t)((face*lut->n_grid + ia)*lut->n_grid + ib)*lut->n_theta*n_words;
+                for (int j = 0; j < n_points; ++j) {
+                    double c = sr->tpx[j]*u[0] + sr->tpy[j]*u[1] + sr->tpz[j]*u[2];
+                    int m;
+                    if (c > 1) c = 1;
+                    if (c < -1) c = -1;
+                    m = (int)ceil(acos(c)/lut->d_theta);
+                    if (m < lut->n_theta)
+                        mask[(size_t)m*n_words + j/64] |= (uint64_t)1 << (j%64);
+                }
+                for (int m = 1; m < lut->n_theta; ++m) {
+                    for (int w = 0; w < n_words; ++w)
+                        mask[(size_t)m*n_words + w] |= mask[(size_t)(m-1)*n_words + w];
+                }
+            }
+        }
+    }
+    if (step > SR_LUT_STEP)
+        freesasa_warn("lookup table for %d test points limited to %d MB, "
+                      "will be less accurate", n_points, SR_LUT_MAX_SIZE >> 20);
+    return lut;
+}
+
+/* Returns the lookup table for the test points of sr, builds it if
+   it is not already in the cache. */
+static const sr_lut *
+sr_lut_get(const sr_data *sr)
+{
+    sr_lut *lut;
+
+#if USE_THREADS
+    pthread_mutex_lock(&sr_lut_lock);
+#endif
+    for (lut = sr_lut_cache; lut != NULL; lut = lut->next) {
+        if (lut->n_points == sr->n_points && lut->point_set == sr->point_set) break;
+    }
+    if (lut == NULL) {
+        lut = sr_lut_new(sr);
+        if (lut != NULL) {
+            if (sr_lut_cache == NULL) atexit(sr_lut_free_all);
+            lut->next = sr_lut_cache;
+            sr_lut_cache = lut;
+        }
+    }
+#if USE_THREADS
+    pthread_mutex_unlock(&sr_lut_lock);
+#endif
+    return lut;
+}
+
+/**
+    Chooses the kernel to use. Falls back on the scalar kernel with a
+    warning if the requested kernel is not available. In single
+    precision the scalar and SIMD kernels are replaced by their single
+    precision versions, the others are not affected.
+ */
+static int
+sr_select_kernel(sr_data *sr,
+                 freesasa_sr_kernel kernel,
+                 freesasa_precision precision)
+{
+    int avx2 = 0, avx512 = 0, ret = FREESASA_SUCCESS;
+#if SR_X86_SIMD
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+    avx512 = __builtin_cpu_supports("avx512f");
+#endif
+
+    if (precision != FREESASA_DOUBLE_PRECISION && precision != FREESASA_SINGLE_PRECISION)
+        return fail_msg("illegal precision %d", precision);
+
+    sr->atom_area = sr_atom_area;
+    switch (kernel) {
+    case FREESASA_SR_AUTO:
+#if SR_X86_SIMD
+        if (avx512) sr->atom_area = sr_atom_area_avx512;
+        else if (avx2) sr->atom_area = sr_atom_area_avx2;
+#endif
+        break;
+    case FREESASA_SR_SCALAR:
+        break;
+    case FREESASA_SR_AVX2:
+        if (!avx2) {
+            ret = freesasa_warn("AVX2 kernel for S&R not available, "
+                                "will use scalar kernel");
+            break;
+        }
+#if SR_X86_SIMD
+        sr->atom_area = sr_atom_area_avx2;
+#endif
+        break;
+    case FREESASA_SR_AVX512:
+        if (!avx512) {
+            ret = freesasa_warn("AVX-512 kernel for S&R not available, "
+                                "will use scalar kernel");
+            break;
+        }
+#if SR_X86_SIMD
+        sr->atom_area = sr_atom_area_avx512;
+#endif
+        break;
+    case FREESASA_SR_CAP:
+        sr->atom_area = sr_atom_area_cap;
+        break;
+    case FREESASA_SR_LUT:
+        sr->lut = sr_lut_get(sr);
+        if (sr->lut == NULL) return fail_msg("failed to initialize lookup table");
+        sr->atom_area = sr_atom_area_lut;
+        break;
+    case FREESASA_SR_PATCH:
+        if (sr->patches.n == 0) {
+            sr->atom_area = sr_atom_area_cap;
+            return freesasa_warn("patch kernel for S&R requires icosahedral test points, "
+                                 "will use cap kernel");
+        }
+        sr->atom_area = sr_atom_area_patch;
+        break;
+    default:
+        return fail_msg("illegal S&R kernel %d", kernel);
+    }
+
+    if (precision == FREESASA_SINGLE_PRECISION) {
+        if (sr->atom_area == sr_atom_area) sr->atom_area = sr_atom_area_single;
+#if SR_X86_SIMD
+        else if (sr->atom_area == sr_atom_area_avx2) sr->atom_area = sr_atom_area_avx2_single;
+        else if (sr->atom_area == sr_atom_area_avx512) sr->atom_area = sr_atom_area_avx512_single;
+#endif
+    }
+    return ret;
+}
+
+
+/* Initializes the test points of sr (and the patches for the
+   icosahedral set). The icosahedral point set doesn't necessarily
+   have the requested number of points, the actual number is stored
+   in sr->n_points. */
+static int
+init_sr_points(sr_data *sr,
+               int n_points,
+               freesasa_sr_point_set point_set)
+{
+    int n_padded;
+    const double *p;
+
+    sr->tpx = sr->tpy = sr->tpz = NULL;
+    sr->tpxf = sr->tpyf = sr->tpzf = NULL;
+    sr->region = NULL;
+    sr->srp = test_points(n_points, point_set, &sr->patches);
+    if (sr->srp == NULL) return fail_msg("failed to initialize test points");
+
+    n_points = freesasa_coord_n(sr->srp);
+    n_padded = SR_SIMD_WIDTH*((n_points + SR_SIMD_WIDTH - 1)/SR_SIMD_WIDTH);
+    sr->n_points = n_points;
+    sr->point_set = point_set;
+    sr->tpx = malloc(sizeof(double)*n_padded);
+    sr->tpy = malloc(sizeof(double)*n_padded);
+    sr->tpz = malloc(sizeof(double)*n_padded);
+    sr->tpxf = malloc(sizeof(float)*n_padded);
+    sr->tpyf = malloc(sizeof(float)*n_padded);
+    sr->tpzf = malloc(sizeof(float)*n_padded);
+    sr->region = malloc(sizeof(int)*n_points);
+    if (sr->tpx == NULL || sr->tpy == NULL || sr->tpz == NULL ||
+        sr->tpxf == NULL || sr->tpyf == NULL || sr->tpzf == NULL ||
+        sr->region == NULL) {
+        release_sr_points(sr);
+        return mem_fail();
+    }
+
+    // the padding is never counted as surface
+    p = freesasa_coord_all(sr->srp);
+    for (int j = 0; j < n_padded; ++j) {
+        sr->tpx[j] = j < n_points ? p[3*j]   : 0;
+        sr->tpy[j] = j < n_points ? p[3*j+1] : 0;
+        sr->tpz[j] = j < n_points ? p[3*j+2] : 0;
+        sr->tpxf[j] = sr->tpx[j];
+        sr->tpyf[j] = sr->tpy[j];
+        sr->tpzf[j] = sr->tpz[j];
+    }
+    for (int j = 0; j < n_points; ++j) {
+        sr->region[j] = sr_cube_cell(SR_REGION_GRID, p[3*j], p[3*j+1], p[3*j+2]);
+    }
+
+    return FREESASA_SUCCESS;
+}
 
 int
 init_sr(sr_data *sr,
@@ -94,21 +730,30 @@ init_sr(sr_data *sr,
         const coord_t *xyz,
         const double *r,
         double probe_radius,
-        int n_points)
+        int n_points,
+        freesasa_sr_point_set point_set,
+        int n_threads,
+        freesasa_nb_storage storage,
+        freesasa_verlet_list *verlet)
 {
     int n_atoms = freesasa_coord_n(xyz);
-    coord_t *srp = test_points(n_points);
 
-    if (srp == NULL) return fail_msg("failed to initialize test points");
-    
+    if (init_sr_points(sr, n_points, point_set)) return FREESASA_FAIL;
+
     //store parameters and reference arrays
     sr->n_atoms = n_atoms;
-    sr->n_points = n_points;
     sr->probe_radius = probe_radius;
     sr->xyz = xyz;
-    sr->srp = srp;
     sr->sasa = sasa;
     sr->nb = NULL;
+    sr->verlet = verlet;
+    sr->search = NULL;
+    sr->buried = NULL;
+    sr->lut = NULL;
+    sr->n_levels = 0;
+    sr->levels = NULL;
+    sr->tolerance = 0;
+    sr->atom_area = sr_atom_area;
 
     sr->r =  malloc(sizeof(double)*n_atoms);
     sr->r2 = malloc(sizeof(double)*n_atoms);
@@ -121,10 +766,36 @@ init_sr(sr_data *sr,
         sr->r2[i] = ri * ri;
     }
 
-    //calculate distances
-    sr->nb = freesasa_nb_new(xyz, sr->r);
+    // the neighbors are found during the calculation, see sr_search()
+    if (storage == FREESASA_NB_NONE && !verlet) {
+        sr->search = freesasa_nb_search_new(xyz, sr->r, n_threads, NB_INDICES);
+        if (sr->search == NULL) goto cleanup;
+        return FREESASA_SUCCESS;
+    }
+
+    // find the neighbors, the kernels don't use the distances stored in the list
+    if (verlet) sr->nb = freesasa_verlet_list_update(verlet, xyz, sr->r, n_threads, 0);
+    else sr->nb = freesasa_nb_new_storage(xyz, sr->r, n_threads, NB_INDICES, 0);
     if (sr->nb == NULL) goto cleanup;
 
+    // the neighbors that bury most of the surface are tested first
+    if (freesasa_get_verbosity() == FREESASA_V_DEBUG) {
+        double before = sr_distance_tests(sr, 0);
+        if (freesasa_nb_sort(sr->nb, xyz, sr->r)) goto cleanup;
+        freesasa_debug("S&R: %.2f distance tests per test point, "
+                       "%.2f without sorted neighbors and region hints",
+                       sr_distance_tests(sr, 1), before);
+    } else if (freesasa_nb_sort(sr->nb, xyz, sr->r)) {
+        goto cleanup;
+    }
+
+    if (sr->n_points >= SR_BURIAL_MIN_POINTS) {
+        sr->buried = malloc(n_atoms);
+        if (sr->buried == NULL) goto cleanup;
+        freesasa_debug("S&R: %d of %d atoms completely buried, skipped",
+                       freesasa_nb_buried(sr->buried, xyz, sr->r, sr->nb), n_atoms);
+    }
+
     return FREESASA_SUCCESS;
 
  cleanup:
@@ -132,11 +803,58 @@ init_sr(sr_data *sr,
     return mem_fail();
 }
 
+/* Sets up the coarser levels of test points for adaptive resolution,
+   each level has a quarter of the points of the next one. The levels
+   share everything but the test points with sr, and use the same
+   kernel. With fewer than 16*SR_ADAPTIVE_MIN_POINTS test points there
+   are too few levels, and the tolerance is ignored with a warning. */
+static int
+init_sr_levels(sr_data *sr,
+               double tolerance)
+{
+    int n_levels = 1;
+
+    for (int n = sr->n_points; n/4 >= SR_ADAPTIVE_MIN_POINTS; n /= 4) ++n_levels;
+    // the coarsest level is only used to choose one of the others
+    if (n_levels < 3)
+        return freesasa_warn("S&R tolerance ignored, adaptive resolution needs at least "
+                             "%d test points, %d requested",
+                             16*SR_ADAPTIVE_MIN_POINTS, sr->n_points);
+
+    sr->levels = malloc(sizeof(sr_data)*n_levels);
+    if (sr->levels == NULL) return mem_fail();
+    sr->levels[n_levels-1] = *sr;
+    for (int l = n_levels-2; l >= 0; --l) {
+        sr_data *level = &sr->levels[l];
+        *level = *sr;
+        level->lut = NULL;
+        if (init_sr_points(level, sr->levels[l+1].n_points/4, sr->point_set)) {
+            release_sr_levels(sr->levels, l+1, n_levels-1);
+            sr->levels = NULL;
+            return FREESASA_FAIL;
+        }
+        if (level->atom_area == sr_atom_area_lut) {
+            level->lut = sr_lut_get(level);
+            if (level->lut == NULL) {
+                release_sr_levels(sr->levels, l, n_levels-1);
+                sr->levels = NULL;
+                return fail_msg("failed to initialize lookup table");
+            }
+        }
+    }
+    sr->n_levels = n_levels;
+    sr->tolerance = tolerance;
+    sr->atom_area = sr_atom_area_adaptive;
+
+    return FREESASA_SUCCESS;
+}
+
 int
 freesasa_shrake_rupley(double *sasa,
                        const coord_t *xyz,
                        const double *r,
-		       const freesasa_parameters *param)
+		       const freesasa_parameters *param,
+                       freesasa_verlet_list *verlet)
 {
     assert(sasa);
     assert(xyz);
@@ -144,6 +862,10 @@ freesasa_shrake_rupley(double *sasa,
 
     if (param == NULL) param = &freesasa_default_parameters;
     
+    if (param->neighbor_storage != FREESASA_NB_FULL && param->neighbor_storage != FREESASA_NB_HALF &&
+        param->neighbor_storage != FREESASA_NB_NONE)
+        return fail_msg("illegal neighbor list storage %d", param->neighbor_storage);
+
     int n_atoms = freesasa_coord_n(xyz),
         n_threads = param->n_threads,
         resolution = param->shrake_rupley_n_points,
@@ -160,13 +882,41 @@ freesasa_shrake_rupley(double *sasa,
                       n_threads);
     }
     
-    if (init_sr(&sr, sasa, xyz, r, probe_radius, resolution))
+    if (init_sr(&sr, sasa, xyz, r, probe_radius, resolution,
+                param->shrake_rupley_point_set, n_threads, param->neighbor_storage, verlet))
         return FREESASA_FAIL;
+
+    switch (sr_select_kernel(&sr, param->shrake_rupley_kernel, param->precision)) {
+    case FREESASA_FAIL:
+        release_sr(&sr);
+        return FREESASA_FAIL;
+    case FREESASA_WARN:
+        return_value = FREESASA_WARN;
+        break;
+    }
+
+    if (param->shrake_rupley_tolerance > 0) {
+        switch (init_sr_levels(&sr, param->shrake_rupley_tolerance)) {
+        case FREESASA_FAIL:
+            release_sr(&sr);
+            return FREESASA_FAIL;
+        case FREESASA_WARN:
+            return_value = FREESASA_WARN;
+            break;
+        }
+    }
     
     //calculate SASA
-    if (n_threads > 1) {
+    if (sr.search) {
+        if (n_threads > 1 && !USE_THREADS)
+            return_value = freesasa_warn("in %s(): program compiled for single-threaded use, "
+                                         "but multiple threads were requested, will "
+                                         "proceed in single-threaded mode\n",
+                                         __func__);
+        if (sr_search(&sr)) return_value = FREESASA_FAIL;
+    } else if (n_threads > 1) {
 #if USE_THREADS
-        return_value = sr_do_threads(n_threads, &sr);
+        if (sr_do_threads(n_threads, &sr)) return_value = FREESASA_FAIL;
 #else
         return_value = freesasa_warn("in %s(): program compiled for single-threaded use, "
                                      "but multiple threads were requested, will "
@@ -175,10 +925,10 @@ freesasa_shrake_rupley(double *sasa,
         n_threads = 1;
 #endif
     }
-    if (n_threads == 1) {
+    if (!sr.search && n_threads == 1) {
         // don't want the overhead of generating threads if only one is used
         for (int i = 0; i < n_atoms; ++i) {
-            sasa[i] = sr_atom_area(i, &sr);
+            sasa[i] = sr.buried && sr.buried[i] ? 0 : sr.atom_area(i, &sr);
         }
     }
     release_sr(&sr);
@@ -190,46 +940,71 @@ static int
 sr_do_threads(int n_threads,
               sr_data *sr)
 {
-    pthread_t thread[n_threads];
     sr_data srt[n_threads];
-    int thread_block_size = sr->n_atoms/n_threads;
-    int res, return_value = FREESASA_SUCCESS;
-    int threads_created = 0;
+    double imbalance;
+    int return_value;
 
-    // divide atoms evenly over threads
-    for (int t = 0; t < n_threads; ++t) {
-        srt[t] = *sr;
-        srt[t].i1 = t*thread_block_size;
-        if (t == n_threads-1) srt[t].i2 = sr->n_atoms;
-        else srt[t].i2 = (t+1)*thread_block_size;
-        res = pthread_create(&thread[t], NULL, sr_thread, (void *) &srt[t]);
-        if (res) {
-            return_value = fail_msg(freesasa_thread_error(res));
-            break;
-        }
-        ++threads_created;
-    }
-    for (int t = 0; t < threads_created; ++t) {
-        int res = pthread_join(thread[t], NULL);
-        if (res) {
-            return_value = fail_msg(freesasa_thread_error(res));
-        }
-    }
+    // the atoms are distributed dynamically, weighted by number of neighbors
+    for (int t = 0; t < n_threads; ++t) srt[t] = *sr;
+    return_value = freesasa_thread_run_atoms(n_threads, sr->n_atoms, sr->nb->nn, sr->buried,
+                                             sr_range, srt, sizeof(sr_data), &imbalance);
+    freesasa_debug("S&R: load imbalance %.2f (slowest thread / mean)", imbalance);
     return return_value;
 }
 
-static void *
-sr_thread(void *arg)
+static void
+sr_range(void *data,
+         int first,
+         int end)
 {
-    sr_data *sr = ((sr_data*) arg);
-    for (int i = sr->i1; i < sr->i2; ++i) {
+    sr_data *sr = data;
+    for (int i = first; i < end; ++i) {
         // mutex should not be necessary, writes to non-overlapping regions
-        sr->sasa[i] = sr_atom_area(i, sr);
+        sr->sasa[i] = sr->buried && sr->buried[i] ? 0 : sr->atom_area(i, sr);
     }
-    pthread_exit(NULL);
 }
 #endif
 
+//! Calculates the area of atom i in thread t of sr_search()
+static void
+sr_search_atom(void *data,
+               int t,
+               int i)
+{
+    sr_data *sr = (sr_data*)data + t;
+    if (sr->n_points >= SR_BURIAL_MIN_POINTS &&
+        freesasa_nb_search_buried(sr->search, t, i)) {
+        sr->sasa[i] = 0;
+        return;
+    }
+    freesasa_nb_sort_atom(sr->nb, sr->xyz, sr->r, i);
+    sr->sasa[i] = sr->atom_area(i, sr);
+}
+
+/* Calculates the areas without a stored neighbor list. Each thread
+   has its own copy of sr, and of the levels of adaptive resolution,
+   where nb is the neighbor list of the thread. */
+static int
+sr_search(sr_data *sr)
+{
+    const int n_threads = freesasa_nb_search_n_threads(sr->search);
+    const int n_levels = sr->n_levels;
+    sr_data srt[n_threads], levels[n_threads*n_levels + 1];
+
+    for (int t = 0; t < n_threads; ++t) {
+        srt[t] = *sr;
+        srt[t].nb = freesasa_nb_search_list(sr->search, t);
+        if (n_levels > 0) {
+            srt[t].levels = levels + t*n_levels;
+            for (int l = 0; l < n_levels; ++l) {
+                srt[t].levels[l] = sr->levels[l];
+                srt[t].levels[l].nb = srt[t].nb;
+            }
+        }
+    }
+    return freesasa_nb_search_run(sr->search, sr_search_atom, srt);
+}
+
 static double
 sr_atom_area(int i,
              const sr_data *sr)
@@ -239,16 +1014,22 @@ sr_atom_area(int i,
        a certain atom do not overlap with any other atoms */
     int spcount[n_points];
     const int nni = sr->nb->nn[i];
-    const int * restrict nbi = sr->nb->nb[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
     const double ri = sr->r[i];
     const double * restrict r2 = sr->r2;
     const double * restrict v = freesasa_coord_all(sr->xyz);
     const double * restrict vi = v+3*i;
     const double * restrict tp;
     int n_surface = 0, current_nb, a;
+    int region_nb[SR_N_REGIONS] = {0};
     double dx, dy, dz;
+    coord_t * restrict tp_coord_ri;
+
+    // isolated atom
+    if (nni == 0) return 4.0*M_PI*ri*ri;
+
     /* testpoints for this atom */
-    coord_t * restrict tp_coord_ri = freesasa_coord_copy(sr->srp);
+    tp_coord_ri = freesasa_coord_copy(sr->srp);
 
     freesasa_coord_scale(tp_coord_ri, ri);
     freesasa_coord_translate(tp_coord_ri, vi);
@@ -258,32 +1039,45 @@ sr_atom_area(int i,
     memset(spcount, 0, n_points*sizeof(int));
 
     /* Using the trick from NSOL to check points one by one for all
-       atoms, start comparing with the first neighbor. If there is no
-       overlap for a given test-point, try with other neighbors
-       instead. Would probably work even better if test points were
-       organized in patches and not spirals. */
+       atoms, start comparing with the neighbor that buried the
+       previous point, then with the one that last buried a point in
+       the same region. If there is no overlap for a given test-point,
+       try with other neighbors instead, they are sorted so that the
+       ones most likely to bury a point come first (see
+       freesasa_nb_sort()). The patches of the icosahedral point set
+       are used in the same spirit in sr_atom_area_patch(). */
     current_nb = 0;
     for (int j = 0; j < n_points; ++j) {
+        const int region = sr->region[j];
         //a is the index of the atom under consideration
         a = nbi[current_nb];
         dx = tp[j*3]   - v[a*3];
         dy = tp[j*3+1] - v[a*3+1];
         dz = tp[j*3+2] - v[a*3+2];
-        if (dx*dx + dy*dy + dz*dz > r2[a]) {
-            int k = 0;
-            for (; k < nni; ++k) {
-                a = nbi[k];
-                dx = tp[j*3]   - v[a*3];
-                dy = tp[j*3+1] - v[a*3+1];
-                dz = tp[j*3+2] - v[a*3+2];
-                if (dx*dx + dy*dy + dz*dz <= r2[a]) {
-                    current_nb = k;
-                    break;
-                }
+        if (dx*dx + dy*dy + dz*dz <= r2[a]) continue;
+        if (region_nb[region] != current_nb) {
+            a = nbi[region_nb[region]];
+            dx = tp[j*3]   - v[a*3];
+            dy = tp[j*3+1] - v[a*3+1];
+            dz = tp[j*3+2] - v[a*3+2];
+            if (dx*dx + dy*dy + dz*dz <= r2[a]) {
+                current_nb = region_nb[region];
+                continue;
+            }
+        }
+        int k = 0;
+        for (; k < nni; ++k) {
+            a = nbi[k];
+            dx = tp[j*3]   - v[a*3];
+            dy = tp[j*3+1] - v[a*3+1];
+            dz = tp[j*3+2] - v[a*3+2];
+            if (dx*dx + dy*dy + dz*dz <= r2[a]) {
+                current_nb = region_nb[region] = k;
+                break;
             }
-            // we have gone through the whole list without overlap
-            if (k == nni) spcount[j] = 1;
         }
+        // we have gone through the whole list without overlap
+        if (k == nni) spcount[j] = 1;
     }
     for (int k = 0; k < n_points; ++k) {
         if (spcount[k]) ++n_surface;
@@ -291,3 +1085,590 @@ sr_atom_area(int i,
     freesasa_coord_free(tp_coord_ri);
     return (4.0*M_PI*ri*ri*n_surface)/n_points;
 }
+
+/* Single precision version of sr_atom_area(). The neighbors are
+   stored relative to atom i, so that the coordinates are small and
+   the loss of precision is only relative to the atom radii, not to
+   the size of the molecule. The test points are scaled but never
+   translated. The arithmetic is the same as in the single precision
+   SIMD kernels below, which give identical results. */
+static double
+sr_atom_area_single(int i,
+                    const sr_data *sr)
+{
+    const int n_points = sr->n_points;
+    const int nni = sr->nb->nn[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+    const double ri = sr->r[i];
+    const float rif = ri;
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    const double * restrict vi = v+3*i;
+    float nbx[nni+1], nby[nni+1], nbz[nni+1], nbr2[nni+1];
+    int n_surface = 0, current_nb = 0;
+    int region_nb[SR_N_REGIONS] = {0};
+
+    // isolated atom
+    if (nni == 0) return 4.0*M_PI*ri*ri;
+
+    for (int k = 0; k < nni; ++k) {
+        const int a = nbi[k];
+        nbx[k] = v[3*a]   - vi[0];
+        nby[k] = v[3*a+1] - vi[1];
+        nbz[k] = v[3*a+2] - vi[2];
+        nbr2[k] = sr->r2[a];
+    }
+
+    // the NSOL trick, as in sr_atom_area()
+    for (int j = 0; j < n_points; ++j) {
+        const float x = sr->tpxf[j]*rif, y = sr->tpyf[j]*rif, z = sr->tpzf[j]*rif;
+        const int region = sr->region[j];
+        float dx = x - nbx[current_nb], dy = y - nby[current_nb], dz = z - nbz[current_nb];
+        int k = region_nb[region];
+        if (dx*dx + dy*dy + dz*dz <= nbr2[current_nb]) continue;
+        if (k != current_nb) {
+            dx = x - nbx[k];
+            dy = y - nby[k];
+            dz = z - nbz[k];
+            if (dx*dx + dy*dy + dz*dz <= nbr2[k]) {
+                current_nb = k;
+                continue;
+            }
+        }
+        for (k = 0; k < nni; ++k) {
+            dx = x - nbx[k];
+            dy = y - nby[k];
+            dz = z - nbz[k];
+            if (dx*dx + dy*dy + dz*dz <= nbr2[k]) {
+                current_nb = region_nb[region] = k;
+                break;
+            }
+        }
+        if (k == nni) ++n_surface;
+    }
+    return (4.0*M_PI*ri*ri*n_surface)/n_points;
+}
+
+/* Instrumentation, the average number of neighbors each test point
+   is compared to in sr_atom_area() (using the cap formulation of
+   sr_atom_area_cap(), which gives the same count except for points
+   exactly on the border of a cap). If hints is 0 the region hints
+   are not used, i.e. the original NSOL trick. */
+static double
+sr_distance_tests(const sr_data *sr,
+                  int hints)
+{
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    double n_tests = 0;
+
+    for (int i = 0; i < sr->n_atoms; ++i) {
+        const int nni = sr->nb->nn[i];
+        const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+        const double ri = sr->r[i];
+        const double * restrict vi = v+3*i;
+        double dx[nni+1], dy[nni+1], dz[nni+1], t[nni+1];
+        int current_nb = 0, region_nb[SR_N_REGIONS] = {0};
+
+        for (int k = 0; k < nni; ++k) {
+            const int a = nbi[k];
+            dx[k] = v[3*a] - vi[0];
+            dy[k] = v[3*a+1] - vi[1];
+            dz[k] = v[3*a+2] - vi[2];
+            t[k] = (ri*ri + dx[k]*dx[k] + dy[k]*dy[k] + dz[k]*dz[k] - sr->r2[a])/(2*ri);
+        }
+        if (nni == 0) continue;
+
+        for (int j = 0; j < sr->n_points; ++j) {
+            const double px = sr->tpx[j], py = sr->tpy[j], pz = sr->tpz[j];
+            const int region = sr->region[j];
+            int k = region_nb[region];
+            ++n_tests;
+            if (px*dx[current_nb] + py*dy[current_nb] + pz*dz[current_nb] >= t[current_nb])
+                continue;
+            if (hints && k != current_nb) {
+                ++n_tests;
+                if (px*dx[k] + py*dy[k] + pz*dz[k] >= t[k]) {
+                    current_nb = k;
+                    continue;
+                }
+            }
+            for (k = 0; k < nni; ++k) {
+                ++n_tests;
+                if (px*dx[k] + py*dy[k] + pz*dz[k] >= t[k]) {
+                    current_nb = k;
+                    if (hints) region_nb[region] = k;
+                    break;
+                }
+            }
+        }
+    }
+    return n_tests/((double)sr->n_atoms*sr->n_points);
+}
+
+/* If the test point p on the unit sphere, scaled and translated to
+   atom i, is inside neighbor j, the following holds, with D = x_j -
+   x_i and d = |D|:
+
+   |r_i p - D|^2 <= r_j^2  <=>  p.D >= (r_i^2 + d^2 - r_j^2)/(2 r_i)
+
+   I.e. neighbor j buries a cap of the unit sphere. This formulation
+   needs no per-atom copy of the test points, and the test of a point
+   against a neighbor is a scalar product with contiguously stored
+   cap data. No division by d is needed, and coinciding atoms (d = 0)
+   are handled correctly. */
+static double
+sr_atom_area_cap(int i,
+                 const sr_data *sr)
+{
+    const int n_points = sr->n_points;
+    const int nni = sr->nb->nn[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+    const double ri = sr->r[i];
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    const double * restrict vi = v+3*i;
+    double dx[nni+1], dy[nni+1], dz[nni+1], t[nni+1];
+    int n_caps = 0, n_surface = 0, current_nb = 0;
+    int region_nb[SR_N_REGIONS] = {0};
+
+    // the caps, neighbors that don't bury any part of the sphere are skipped
+    for (int k = 0; k < nni; ++k) {
+        const int a = nbi[k];
+        const double x = v[3*a] - vi[0], y = v[3*a+1] - vi[1], z = v[3*a+2] - vi[2];
+        const double d2 = x*x + y*y + z*z;
+        const double tk = (ri*ri + d2 - sr->r2[a])/(2*ri);
+        if (tk*fabs(tk) > d2) continue; // the cap is empty
+        if (-tk*fabs(tk) >= d2) return 0; // the cap covers the whole sphere
+        dx[n_caps] = x; dy[n_caps] = y; dz[n_caps] = z; t[n_caps] = tk;
+        ++n_caps;
+    }
+
+    // the NSOL trick, as in sr_atom_area()
+    for (int j = 0; j < n_points; ++j) {
+        const double px = sr->tpx[j], py = sr->tpy[j], pz = sr->tpz[j];
+        const int region = sr->region[j];
+        int k = region_nb[region];
+        if (n_caps > 0) {
+            if (px*dx[current_nb] + py*dy[current_nb] + pz*dz[current_nb] >= t[current_nb])
+                continue;
+            if (k != current_nb && px*dx[k] + py*dy[k] + pz*dz[k] >= t[k]) {
+                current_nb = k;
+                continue;
+            }
+        }
+        for (k = 0; k < n_caps; ++k) {
+            if (px*dx[k] + py*dy[k] + pz*dz[k] >= t[k]) {
+                current_nb = region_nb[region] = k;
+                break;
+            }
+        }
+        if (k == n_caps) ++n_surface;
+    }
+    return (4.0*M_PI*ri*ri*n_surface)/n_points;
+}
+
+/* Adaptive resolution: the exposed fraction f of the atom is first
+   estimated using the coarsest level of test points, and the area
+   is then calculated at the lowest level where the estimated error
+   is below the tolerance. For quasi-uniform test points the error
+   is roughly A f^1/2 (1-f)^1/2 n^-3/4, where A is the area of the
+   sphere and n the number of points (empirically, random points
+   would give n^-1/2). The fraction is estimated as (n_exposed +
+   1)/(n_points + 2), so that an atom that is completely buried or
+   exposed at the coarse level is not trusted blindly. The coarse
+   area itself is never used, since the choice of level would then
+   depend on its (random) error, which biases the result towards
+   underestimating partially buried areas. */
+static double
+sr_atom_area_adaptive(int i,
+                      const sr_data *sr)
+{
+    const double full = 4.0*M_PI*sr->r2[i];
+    const sr_data *level = sr->levels;
+    const int n0 = level[0].n_points;
+    const double f = (level[0].atom_area(i, &level[0])/full*n0 + 1)/(n0 + 2);
+    int l = 1;
+
+    while (l < sr->n_levels - 1 &&
+           full*sqrt(f*(1-f))*pow(level[l].n_points, -0.75) >= sr->tolerance) ++l;
+
+    return level[l].atom_area(i, &level[l]);
+}
+
+/* Like sr_atom_area_cap(), but the patches of test points are first
+   compared with the caps. With gamma the angle between the centers
+   of a cap of half-angle alpha and the bounding cap of a patch of
+   half-angle beta, the patch is completely buried by the cap if
+   gamma + beta <= alpha, and not touched by it if gamma - beta >
+   alpha. Only the points of patches that are neither completely
+   buried nor untouched are tested one by one, against the caps
+   touching the patch. */
+static double
+sr_atom_area_patch(int i,
+                   const sr_data *sr)
+{
+    const sr_patches *patches = &sr->patches;
+    const int n_points = sr->n_points;
+    const int nni = sr->nb->nn[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+    const double ri = sr->r[i];
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    const double * restrict vi = v+3*i;
+    double dx[nni+1], dy[nni+1], dz[nni+1], t[nni+1];
+    double ux[nni+1], uy[nni+1], uz[nni+1], cos_a[nni+1]; // unit directions and half-angles of caps
+    int touching[nni+1];
+    int n_caps = 0, n_surface = 0;
+
+    for (int k = 0; k < nni; ++k) {
+        const int a = nbi[k];
+        const double x = v[3*a] - vi[0], y = v[3*a+1] - vi[1], z = v[3*a+2] - vi[2];
+        const double d2 = x*x + y*y + z*z;
+        const double tk = (ri*ri + d2 - sr->r2[a])/(2*ri);
+        if (tk*fabs(tk) > d2) continue;
+        if (-tk*fabs(tk) >= d2) return 0;
+        const double d = sqrt(d2);
+        dx[n_caps] = x; dy[n_caps] = y; dz[n_caps] = z; t[n_caps] = tk;
+        ux[n_caps] = x/d; uy[n_caps] = y/d; uz[n_caps] = z/d; cos_a[n_caps] = tk/d;
+        ++n_caps;
+    }
+
+    for (int l = 0; l < patches->n; ++l) {
+        const double cos_b = patches->cos_r[l], sin_b = patches->sin_r[l];
+        const int j1 = patches->first[l], j2 = patches->first[l+1];
+        int n_touching = 0, buried = 0, current_nb = 0;
+
+        for (int k = 0; k < n_caps; ++k) {
+            const double cos_g = patches->x[l]*ux[k] + patches->y[l]*uy[k] + patches->z[l]*uz[k],
+                sin_g = sqrt(fmax(0, 1 - cos_g*cos_g));
+            // cos(gamma + beta) >= cos(alpha), with gamma + beta <= pi
+            if (cos_g >= -cos_b && cos_g*cos_b - sin_g*sin_b >= cos_a[k]) {
+                buried = 1;
+                break;
+            }
+            // gamma <= beta or cos(gamma - beta) >= cos(alpha)
+            if (cos_g >= cos_b || cos_g*cos_b + sin_g*sin_b >= cos_a[k])
+                touching[n_touching++] = k;
+        }
+        if (buried) continue;
+
+        for (int j = j1; j < j2; ++j) {
+            const double px = sr->tpx[j], py = sr->tpy[j], pz = sr->tpz[j];
+            int kk, k;
+            if (n_touching > 0) {
+                kk = touching[current_nb];
+                if (px*dx[kk] + py*dy[kk] + pz*dz[kk] >= t[kk]) continue;
+            }
+            for (k = 0; k < n_touching; ++k) {
+                kk = touching[k];
+                if (px*dx[kk] + py*dy[kk] + pz*dz[kk] >= t[kk]) {
+                    current_nb = k;
+                    break;
+                }
+            }
+            if (k == n_touching) ++n_surface;
+        }
+    }
+    return (4.0*M_PI*ri*ri*n_surface)/n_points;
+}
+
+/* Uses the same caps as sr_atom_area_cap(), but instead of testing
+   the points one by one, the mask of points buried by each cap is
+   taken from the lookup table, and the exposed points are those not
+   in the union of the masks. The quantization of the caps means the
+   result is an approximation of that of the other kernels, the
+   errors of individual points mostly cancel out. */
+static double
+sr_atom_area_lut(int i,
+                 const sr_data *sr)
+{
+    const sr_lut *lut = sr->lut;
+    const int n_words = lut->n_words;
+    const int nni = sr->nb->nn[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+    const double ri = sr->r[i];
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    const double * restrict vi = v+3*i;
+    uint64_t buried[n_words];
+    int n_buried = 0;
+
+    memset(buried, 0, sizeof(uint64_t)*n_words);
+    for (int k = 0; k < nni; ++k) {
+        const int a = nbi[k];
+        const double x = v[3*a] - vi[0], y = v[3*a+1] - vi[1], z = v[3*a+2] - vi[2];
+        const double d2 = x*x + y*y + z*z;
+        const double tk = (ri*ri + d2 - sr->r2[a])/(2*ri);
+        const uint64_t * restrict mask;
+        int m;
+        if (tk*fabs(tk) > d2) continue;
+        if (-tk*fabs(tk) >= d2) return 0;
+        // d > 0 here, and |tk| < d
+        m = (int)(acos(tk/sqrt(d2))/lut->d_theta + 0.5);
+        mask = lut->mask + ((size_t)sr_cube_cell(lut->n_grid, x, y, z)*lut->n_theta + m)*n_words;
+        for (int w = 0; w < n_words; ++w) buried[w] |= mask[w];
+    }
+    for (int w = 0; w < n_words; ++w) n_buried += sr_popcount64(buried[w]);
+
+    return (4.0*M_PI*ri*ri*(sr->n_points - n_buried))/sr->n_points;
+}
+
+#if SR_X86_SIMD
+/* The SIMD kernels below test a block of test points against one
+   neighbor at a time, in the same way as the scalar kernel, keeping a
+   bitmask of which points in the block are buried. The NSOL trick is
+   used for blocks instead of for individual points. */
+
+static double
+sr_atom_area_avx2(int i,
+                  const sr_data *sr)
+{
+    const int n_points = sr->n_points;
+    const int nni = sr->nb->nn[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+    const double ri = sr->r[i];
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    const double * restrict vi = v+3*i;
+    double nbx[nni+1], nby[nni+1], nbz[nni+1], nbr2[nni+1];
+    int n_surface = 0, current_nb = 0;
+    const __m256d vri = _mm256_set1_pd(ri),
+        vxi = _mm256_set1_pd(vi[0]),
+        vyi = _mm256_set1_pd(vi[1]),
+        vzi = _mm256_set1_pd(vi[2]);
+
+    // neighbor coordinates as structure of arrays
+    for (int k = 0; k < nni; ++k) {
+        const int a = nbi[k];
+        nbx[k] = v[3*a];
+        nby[k] = v[3*a+1];
+        nbz[k] = v[3*a+2];
+        nbr2[k] = sr->r2[a];
+    }
+    if (nni == 0) return 4.0*M_PI*ri*ri;
+
+    for (int j = 0; j < n_points; j += 4) {
+        // scale and translate test points, like freesasa_coord_scale() and _translate()
+        const __m256d x = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(sr->tpx+j), vri), vxi),
+            y = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(sr->tpy+j), vri), vyi),
+            z = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(sr->tpz+j), vri), vzi);
+        const int all = n_points - j >= 4 ? 0xF : (1 << (n_points - j)) - 1;
+        const int first = current_nb;
+        int buried = 0;
+        // start with the neighbor that buried points in the previous block
+        for (int k = -1; k < nni && (buried & all) != all; ++k) {
+            const int kk = k < 0 ? first : k;
+            if (k == first) continue;
+            const __m256d dx = _mm256_sub_pd(x, _mm256_set1_pd(nbx[kk])),
+                dy = _mm256_sub_pd(y, _mm256_set1_pd(nby[kk])),
+                dz = _mm256_sub_pd(z, _mm256_set1_pd(nbz[kk]));
+            const __m256d d2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx),
+                                                           _mm256_mul_pd(dy, dy)),
+                                             _mm256_mul_pd(dz, dz));
+            const int hit = _mm256_movemask_pd(_mm256_cmp_pd(d2, _mm256_set1_pd(nbr2[kk]),
+                                                             _CMP_LE_OQ));
+            if (hit & ~buried) current_nb = kk;
+            buried |= hit;
+        }
+        n_surface += __builtin_popcount(~buried & all);
+    }
+    return (4.0*M_PI*ri*ri*n_surface)/n_points;
+}
+
+static double
+sr_atom_area_avx512(int i,
+                    const sr_data *sr)
+{
+    const int n_points = sr->n_points;
+    const int nni = sr->nb->nn[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+    const double ri = sr->r[i];
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    const double * restrict vi = v+3*i;
+    double nbx[nni+1], nby[nni+1], nbz[nni+1], nbr2[nni+1];
+    int n_surface = 0, current_nb = 0;
+    const __m512d vri = _mm512_set1_pd(ri),
+        vxi = _mm512_set1_pd(vi[0]),
+        vyi = _mm512_set1_pd(vi[1]),
+        vzi = _mm512_set1_pd(vi[2]);
+
+    for (int k = 0; k < nni; ++k) {
+        const int a = nbi[k];
+        nbx[k] = v[3*a];
+        nby[k] = v[3*a+1];
+        nbz[k] = v[3*a+2];
+        nbr2[k] = sr->r2[a];
+    }
+    if (nni == 0) return 4.0*M_PI*ri*ri;
+
+    for (int j = 0; j < n_points; j += 8) {
+        const __m512d x = _mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(sr->tpx+j), vri), vxi),
+            y = _mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(sr->tpy+j), vri), vyi),
+            z = _mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(sr->tpz+j), vri), vzi);
+        const int all = n_points - j >= 8 ? 0xFF : (1 << (n_points - j)) - 1;
+        const int first = current_nb;
+        int buried = 0;
+        for (int k = -1; k < nni && (buried & all) != all; ++k) {
+            const int kk = k < 0 ? first : k;
+            if (k == first) continue;
+            const __m512d dx = _mm512_sub_pd(x, _mm512_set1_pd(nbx[kk])),
+                dy = _mm512_sub_pd(y, _mm512_set1_pd(nby[kk])),
+                dz = _mm512_sub_pd(z, _mm512_set1_pd(nbz[kk]));
+            const __m512d d2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx),
+                                                           _mm512_mul_pd(dy, dy)),
+                                             _mm512_mul_pd(dz, dz));
+            const int hit = _mm512_cmp_pd_mask(d2, _mm512_set1_pd(nbr2[kk]), _CMP_LE_OQ);
+            if (hit & ~buried) current_nb = kk;
+            buried |= hit;
+        }
+        n_surface += __builtin_popcount(~buried & all);
+    }
+    return (4.0*M_PI*ri*ri*n_surface)/n_points;
+}
+
+/* Single precision versions of the two kernels above, with twice as
+   many test points per block. The neighbors are stored relative to
+   atom i, as in sr_atom_area_single(). */
+
+static double
+sr_atom_area_avx2_single(int i,
+                         const sr_data *sr)
+{
+    const int n_points = sr->n_points;
+    const int nni = sr->nb->nn[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+    const double ri = sr->r[i];
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    const double * restrict vi = v+3*i;
+    float nbx[nni+1], nby[nni+1], nbz[nni+1], nbr2[nni+1];
+    int n_surface = 0, current_nb = 0;
+    const __m256 vri = _mm256_set1_ps(ri);
+
+    for (int k = 0; k < nni; ++k) {
+        const int a = nbi[k];
+        nbx[k] = v[3*a]   - vi[0];
+        nby[k] = v[3*a+1] - vi[1];
+        nbz[k] = v[3*a+2] - vi[2];
+        nbr2[k] = sr->r2[a];
+    }
+    if (nni == 0) return 4.0*M_PI*ri*ri;
+
+    for (int j = 0; j < n_points; j += 8) {
+        const __m256 x = _mm256_mul_ps(_mm256_loadu_ps(sr->tpxf+j), vri),
+            y = _mm256_mul_ps(_mm256_loadu_ps(sr->tpyf+j), vri),
+            z = _mm256_mul_ps(_mm256_loadu_ps(sr->tpzf+j), vri);
+        const int all = n_points - j >= 8 ? 0xFF : (1 << (n_points - j)) - 1;
+        const int first = current_nb;
+        int buried = 0;
+        for (int k = -1; k < nni && (buried & all) != all; ++k) {
+            const int kk = k < 0 ? first : k;
+            if (k == first) continue;
+            const __m256 dx = _mm256_sub_ps(x, _mm256_set1_ps(nbx[kk])),
+                dy = _mm256_sub_ps(y, _mm256_set1_ps(nby[kk])),
+                dz = _mm256_sub_ps(z, _mm256_set1_ps(nbz[kk]));
+            const __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                                          _mm256_mul_ps(dy, dy)),
+                                            _mm256_mul_ps(dz, dz));
+            const int hit = _mm256_movemask_ps(_mm256_cmp_ps(d2, _mm256_set1_ps(nbr2[kk]),
+                                                             _CMP_LE_OQ));
+            if (hit & ~buried) current_nb = kk;
+            buried |= hit;
+        }
+        n_surface += __builtin_popcount(~buried & all);
+    }
+    return (4.0*M_PI*ri*ri*n_surface)/n_points;
+}
+
+static double
+sr_atom_area_avx512_single(int i,
+                           const sr_data *sr)
+{
+    const int n_points = sr->n_points;
+    const int nni = sr->nb->nn[i];
+    const int * restrict nbi = sr->nb->nb + sr->nb->offset[i];
+    const double ri = sr->r[i];
+    const double * restrict v = freesasa_coord_all(sr->xyz);
+    const double * restrict vi = v+3*i;
+    float nbx[nni+1], nby[nni+1], nbz[nni+1], nbr2[nni+1];
+    int n_surface = 0, current_nb = 0;
+    const __m512 vri = _mm512_set1_ps(ri);
+
+    for (int k = 0; k < nni; ++k) {
+        const int a = nbi[k];
+        nbx[k] = v[3*a]   - vi[0];
+        nby[k] = v[3*a+1] - vi[1];
+        nbz[k] = v[3*a+2] - vi[2];
+        nbr2[k] = sr->r2[a];
+    }
+    if (nni == 0) return 4.0*M_PI*ri*ri;
+
+    for (int j = 0; j < n_points; j += 16) {
+        const __m512 x = _mm512_mul_ps(_mm512_loadu_ps(sr->tpxf+j), vri),
+            y = _mm512_mul_ps(_mm512_loadu_ps(sr->tpyf+j), vri),
+            z = _mm512_mul_ps(_mm512_loadu_ps(sr->tpzf+j), vri);
+        const int all = n_points - j >= 16 ? 0xFFFF : (1 << (n_points - j)) - 1;
+        const int first = current_nb;
+        int buried = 0;
+        for (int k = -1; k < nni && (buried & all) != all; ++k) {
+            const int kk = k < 0 ? first : k;
+            if (k == first) continue;
+            const __m512 dx = _mm512_sub_ps(x, _mm512_set1_ps(nbx[kk])),
+                dy = _mm512_sub_ps(y, _mm512_set1_ps(nby[kk])),
+                dz = _mm512_sub_ps(z, _mm512_set1_ps(nbz[kk]));
+            const __m512 d2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx),
+                                                          _mm512_mul_ps(dy, dy)),
+                                            _mm512_mul_ps(dz, dz));
+            const int hit = _mm512_cmp_ps_mask(d2, _mm512_set1_ps(nbr2[kk]), _CMP_LE_OQ);
+            if (hit & ~buried) current_nb = kk;
+            buried |= hit;
+        }
+        n_surface += __builtin_popcount(~buried & all);
+    }
+    return (4.0*M_PI*ri*ri*n_surface)/n_points;
+}
+#endif /* SR_X86_SIMD */
+
+#if USE_CHECK
+#include <check.h>
+
+START_TEST (test_icosahedral_points)
+{
+    const int N[] = {1, 12, 50, 100, 1000, 5000}, n_ref[] = {12, 12, 42, 92, 1002, 4842};
+    sr_patches patches;
+
+    for (int i = 0; i < sizeof(N)/sizeof(int); ++i) {
+        coord_t *coord = test_points(N[i], FREESASA_SR_ICOSAHEDRAL, &patches);
+        const double *p;
+        ck_assert_ptr_ne(coord, NULL);
+        ck_assert_int_eq(freesasa_coord_n(coord), n_ref[i]);
+        p = freesasa_coord_all(coord);
+
+        // points on the unit sphere, no duplicates
+        for (int j = 0; j < n_ref[i]; ++j) {
+            ck_assert(fabs(p[3*j]*p[3*j] + p[3*j+1]*p[3*j+1] + p[3*j+2]*p[3*j+2] - 1) < 1e-12);
+            for (int k = 0; k < j; ++k) {
+                ck_assert(freesasa_coord_dist2(coord, j, k) > 1e-6);
+            }
+        }
+
+        // the patches partition the points, and the caps contain their points
+        ck_assert_int_eq(patches.first[0], 0);
+        ck_assert_int_eq(patches.first[patches.n], n_ref[i]);
+        for (int l = 0; l < patches.n; ++l) {
+            ck_assert_int_le(patches.first[l], patches.first[l+1]);
+            for (int j = patches.first[l]; j < patches.first[l+1]; ++j) {
+                ck_assert(p[3*j]*patches.x[l] + p[3*j+1]*patches.y[l] +
+                          p[3*j+2]*patches.z[l] >= patches.cos_r[l]);
+            }
+        }
+        freesasa_coord_free(coord);
+        release_patches(&patches);
+    }
+}
+END_TEST
+
+TCase *
+test_SR_static()
+{
+    TCase *tc = tcase_create("sasa_sr.c static");
+    tcase_add_test(tc, test_icosahedral_points);
+
+    return tc;
+}
+
+#endif // USE_CHECK
@@ -0,0 +1,381 @@
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <assert.h>
+#if USE_THREADS
+# include <pthread.h>
+# include <time.h>
+#endif
+
+#include "freesasa_internal.h"
+
+#if USE_THREADS
+
+// the atoms are divided into this many chunks per thread
+#define CHUNKS_PER_THREAD 16
+
+/* The pool runs one set of tasks at a time. The tasks are taken in
+   order by the workers and the calling thread, the mutex protects
+   the task counters. */
+typedef struct {
+    int n_workers;
+    pthread_t *worker;
+    pthread_mutex_t lock;
+    pthread_cond_t start; //!< signaled when new tasks are available or the pool quits
+    pthread_cond_t done; //!< signaled when the last task is finished
+    pthread_mutex_t busy; //!< held by the thread that uses the pool
+    void *(*task)(void *);
+    char *args;
+    size_t arg_size;
+    int n_tasks, next_task, n_done;
+    int quit;
+} thread_pool;
+
+// the pool of the library, the lock protects the pointer
+static thread_pool *pool = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//! Runs tasks until there are none left, called with the lock held
+static void
+pool_run_tasks(thread_pool *p)
+{
+    while (p->next_task < p->n_tasks) {
+        int t = p->next_task++;
+        pthread_mutex_unlock(&p->lock);
+        p->task(p->args + t*p->arg_size);
+        pthread_mutex_lock(&p->lock);
+        if (++p->n_done == p->n_tasks) pthread_cond_signal(&p->done);
+    }
+}
+
+static void *
+pool_worker(void *arg)
+{
+    thread_pool *p = arg;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->quit && p->next_task >= p->n_tasks) {
+            pthread_cond_wait(&p->start, &p->lock);
+        }
+        if (p->quit) break;
+        pool_run_tasks(p);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+//! Waits until the pool isn't used, stops the workers and frees the pool
+static void
+pool_free(thread_pool *p)
+{
+    pthread_mutex_lock(&p->busy);
+    pthread_mutex_unlock(&p->busy);
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for (int w = 0; w < p->n_workers; ++w) pthread_join(p->worker[w], NULL);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->busy);
+    free(p->worker);
+    free(p);
+}
+
+//! Runs the tasks in a thread each, the way it's done without a pool
+static int
+thread_run_new(int n_tasks,
+               void *(*task)(void *),
+               char *args,
+               size_t arg_size)
+{
+    pthread_t thread[n_tasks];
+    int res, threads_created = 0, return_value = FREESASA_SUCCESS;
+
+    for (int t = 0; t < n_tasks; ++t) {
+        res = pthread_create(&thread[t], NULL, task, (void *) (args + t*arg_size));
+        if (res) {
+            return_value = fail_msg(freesasa_thread_error(res));
+            break;
+        }
+        ++threads_created;
+    }
+    for (int t = 0; t < threads_created; ++t) {
+        res = pthread_join(thread[t], NULL);
+        if (res) {
+            return_value = fail_msg(freesasa_thread_error(res));
+        }
+    }
+    return return_value;
+}
+
+int
+freesasa_thread_run(int n_tasks,
+                    void *(*task)(void *),
+                    void *args,
+                    size_t arg_size)
+{
+    thread_pool *p;
+
+    assert(n_tasks > 0);
+    assert(task);
+    assert(args);
+
+    // the pool is used by another calculation, or by one of the
+    // tasks that called this, start new threads instead. Once busy is
+    // held the pool can't be freed.
+    pthread_mutex_lock(&pool_lock);
+    p = pool;
+    if (p != NULL && pthread_mutex_trylock(&p->busy)) p = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    if (p == NULL) {
+        return thread_run_new(n_tasks, task, args, arg_size);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->task = task;
+    p->args = args;
+    p->arg_size = arg_size;
+    p->n_tasks = n_tasks;
+    p->next_task = p->n_done = 0;
+    pthread_cond_broadcast(&p->start);
+    pool_run_tasks(p);
+    while (p->n_done < p->n_tasks) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    p->n_tasks = p->next_task = 0;
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&p->busy);
+
+    return FREESASA_SUCCESS;
+}
+
+/* Each thread has a queue of chunks, initially a contiguous range
+   with its share of the total cost. A thread takes chunks from the
+   front of its own queue, and when that is empty, from the back of
+   the queue with most chunks left. */
+typedef struct {
+    int n_threads;
+    const int *chunk; //!< chunk c is the atoms chunk[c] to chunk[c+1]-1
+    int *head, *tail; //!< the queue of thread t is chunks head[t] to tail[t]-1
+    pthread_mutex_t lock;
+    void (*range)(void *data, int first, int end);
+} chunk_queue;
+
+typedef struct {
+    chunk_queue *q;
+    int t;
+    void *data;
+    double time; //!< time spent by the thread, in seconds
+} chunk_worker;
+
+//! The next chunk for thread t, -1 if there are none left
+static int
+chunk_next(chunk_queue *q,
+           int t)
+{
+    int c = -1, victim = -1, most = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head[t] < q->tail[t]) {
+        c = q->head[t]++;
+    } else {
+        for (int u = 0; u < q->n_threads; ++u) {
+            if (q->tail[u] - q->head[u] > most) {
+                most = q->tail[u] - q->head[u];
+                victim = u;
+            }
+        }
+        if (victim >= 0) c = --q->tail[victim];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return c;
+}
+
+static double
+wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void *
+chunk_thread(void *arg)
+{
+    chunk_worker *w = arg;
+    double start = wall_time();
+    int c;
+
+    while ((c = chunk_next(w->q, w->t)) >= 0) {
+        w->q->range(w->data, w->q->chunk[c], w->q->chunk[c+1]);
+    }
+    w->time = wall_time() - start;
+    return NULL;
+}
+
+int
+freesasa_thread_run_atoms(int n_threads,
+                          int n_atoms,
+                          const int *nn,
+                          const char *skip,
+                          void (*range)(void *data, int first, int end),
+                          void *data,
+                          size_t data_size,
+                          double *imbalance)
+{
+    assert(n_threads > 0);
+    assert(n_atoms >= n_threads);
+    assert(range);
+    assert(data);
+
+    const int n_chunks = n_atoms < CHUNKS_PER_THREAD*n_threads ?
+        n_atoms : CHUNKS_PER_THREAD*n_threads;
+    int chunk[n_chunks+1], head[n_threads], tail[n_threads];
+    chunk_worker worker[n_threads];
+    chunk_queue q;
+    long total = 0, sum = 0;
+    double max_time = 0, sum_time = 0;
+    int return_value;
+
+#define ATOM_COST(i) (1 + (nn && !(skip && skip[i]) ? nn[i] : 0))
+    for (int i = 0; i < n_atoms; ++i) total += ATOM_COST(i);
+
+    // chunks of roughly equal cost, at least one atom each
+    chunk[0] = 0;
+    for (int c = 0, i = 0; c < n_chunks; ++c) {
+        if (c == n_chunks - 1) {
+            i = n_atoms;
+        } else {
+            do {
+                sum += ATOM_COST(i);
+                ++i;
+            } while (i < n_atoms - (n_chunks - c - 1) &&
+                     sum + ATOM_COST(i) <= (c+1)*total/n_chunks);
+        }
+        chunk[c+1] = i;
+    }
+#undef ATOM_COST
+
+    q.n_threads = n_threads;
+    q.chunk = chunk;
+    q.head = head;
+    q.tail = tail;
+    q.range = range;
+    pthread_mutex_init(&q.lock, NULL);
+    for (int t = 0; t < n_threads; ++t) {
+        head[t] = t*n_chunks/n_threads;
+        tail[t] = (t+1)*n_chunks/n_threads;
+        worker[t].q = &q;
+        worker[t].t = t;
+        worker[t].data = (char*)data + t*data_size;
+        worker[t].time = 0;
+    }
+
+    return_value = freesasa_thread_run(n_threads, chunk_thread, worker, sizeof(chunk_worker));
+    pthread_mutex_destroy(&q.lock);
+
+    for (int t = 0; t < n_threads; ++t) {
+        sum_time += worker[t].time;
+        if (worker[t].time > max_time) max_time = worker[t].time;
+    }
+    if (imbalance) *imbalance = sum_time > 0 ? max_time*n_threads/sum_time : 1;
+
+    return return_value;
+}
+
+int
+freesasa_thread_pool_create(int n_threads)
+{
+    thread_pool *p, *old;
+    int res;
+
+    if (n_threads < 1) {
+        return fail_msg("number of threads must be 1 or larger, %d given", n_threads);
+    }
+    freesasa_thread_pool_destroy();
+
+    p = malloc(sizeof(thread_pool));
+    if (p == NULL) return mem_fail();
+    // the calling thread is one of the threads
+    p->n_workers = 0;
+    p->worker = malloc(sizeof(pthread_t)*n_threads);
+    if (p->worker == NULL) {
+        free(p);
+        return mem_fail();
+    }
+    p->n_tasks = p->next_task = p->n_done = 0;
+    p->quit = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_mutex_init(&p->busy, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (int w = 0; w < n_threads - 1; ++w) {
+        res = pthread_create(&p->worker[w], NULL, pool_worker, (void *) p);
+        if (res) {
+            pool_free(p);
+            return fail_msg(freesasa_thread_error(res));
+        }
+        ++p->n_workers;
+    }
+
+    // another thread can have created a pool in the meantime
+    pthread_mutex_lock(&pool_lock);
+    old = pool;
+    pool = p;
+    pthread_mutex_unlock(&pool_lock);
+    if (old) pool_free(old);
+
+    return FREESASA_SUCCESS;
+}
+
+void
+freesasa_thread_pool_destroy(void)
+{
+    thread_pool *p;
+
+    // new calculations don't find the pool after this, pool_free()
+    // waits for the one using it, if any
+    pthread_mutex_lock(&pool_lock);
+    p = pool;
+    pool = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    if (p) pool_free(p);
+}
+
+int
+freesasa_thread_pool_n_threads(void)
+{
+    int n;
+
+    pthread_mutex_lock(&pool_lock);
+    n = pool ? pool->n_workers + 1 : 0;
+    pthread_mutex_unlock(&pool_lock);
+    return n;
+}
+
+#else /* USE_THREADS */
+
+int
+freesasa_thread_pool_create(int n_threads)
+{
+    (void) n_threads;
+    return freesasa_warn("in %s(): program compiled for single-threaded use, "
+                         "no thread pool created\n", __func__);
+}
+
+void
+freesasa_thread_pool_destroy(void)
+{
+}
+
+int
+freesasa_thread_pool_n_threads(void)
+{
+    return 0;
+}
+
+#endif /* USE_THREADS */
@@ -32,19 +32,14 @@ freesasa_whole_file(FILE* file)
 }
 
 static void
-freesasa_err_impl(int err,
+freesasa_err_impl(const char *type,
                   const char *format,
                   va_list arg)
 {
     FILE *fp = stderr;
     if (errlog != NULL) fp = errlog;
 
-    fprintf(fp, "%s: ", freesasa_name);
-    switch (err) {
-    case FREESASA_FAIL: fputs("error: ", fp); break;
-    case FREESASA_WARN: fputs("warning: ", fp); break;
-    default: break;
-    }
+    fprintf(fp, "%s: %s: ", freesasa_name, type);
     vfprintf(fp, format, arg);
     va_end(arg);
     fputc('\n', fp);
@@ -57,7 +52,7 @@ freesasa_fail(const char *format,...)
     va_list arg;
     if (freesasa_get_verbosity() == FREESASA_V_SILENT) return FREESASA_FAIL;
     va_start(arg, format);
-    freesasa_err_impl(FREESASA_FAIL,format,arg);
+    freesasa_err_impl("error",format,arg);
     va_end(arg);
     return FREESASA_FAIL;
 }
@@ -68,11 +63,22 @@ int freesasa_warn(const char *format,...)
     int v = freesasa_get_verbosity();
     if (v == FREESASA_V_NOWARNINGS || v == FREESASA_V_SILENT) return FREESASA_WARN;
     va_start(arg, format);
-    freesasa_err_impl(FREESASA_WARN,format,arg);
+    freesasa_err_impl("warning",format,arg);
     va_end(arg);
     return FREESASA_WARN;
 }
 
+int
+freesasa_debug(const char *format,...)
+{
+    va_list arg;
+    if (freesasa_get_verbosity() != FREESASA_V_DEBUG) return FREESASA_SUCCESS;
+    va_start(arg, format);
+    freesasa_err_impl("debug",format,arg);
+    va_end(arg);
+    return FREESASA_SUCCESS;
+}
+
 int
 freesasa_fail_wloc(const char* file,
                    int line,
@@ -391,6 +391,9 @@ parameters2xml(const freesasa_parameters *p)
     case FREESASA_LEE_RICHARDS:
         sprintf(buf, "%d", p->lee_richards_n_slices);
         break;
+    case FREESASA_ANALYTICAL:
+        sprintf(buf, "%d", 0);
+        break;
     default:
         assert(0);
         break;
@@ -74,6 +74,31 @@ START_TEST (test_coord)
 }
 END_TEST
 
+START_TEST (test_morton_order)
+{
+    // points in a 4x4x4 grid, given in reverse order, each 2x2x2
+    // block should be contiguous in the Morton order
+    double xyz[3*64];
+    int order[64], seen[64] = {0};
+    for (int i = 0; i < 64; ++i) {
+        const int j = 63 - i;
+        xyz[3*i] = j % 4;
+        xyz[3*i+1] = j/4 % 4;
+        xyz[3*i+2] = j/16;
+    }
+    ck_assert_int_eq(freesasa_coord_append(coord,xyz,64),FREESASA_SUCCESS);
+    ck_assert_int_eq(freesasa_coord_morton_order(coord,order),FREESASA_SUCCESS);
+    ck_assert_int_eq(order[0],63);
+    ck_assert_int_eq(order[63],0);
+    for (int k = 0; k < 64; ++k) {
+        const double *a = freesasa_coord_i(coord,order[k]);
+        const double *b = freesasa_coord_i(coord,order[8*(k/8)]);
+        ck_assert_int_eq(seen[order[k]]++,0);
+        for (int d = 0; d < 3; ++d) ck_assert_int_eq((int)a[d]/2,(int)b[d]/2);
+    }
+}
+END_TEST
+
 START_TEST (test_memerr)
 {
     set_fail_after(0);
@@ -105,6 +130,7 @@ Suite* coord_suite()
     TCase *tc_core = tcase_create("Core");
     tcase_add_checked_fixture(tc_core,setup,teardown);
     tcase_add_test(tc_core,test_coord);
+    tcase_add_test(tc_core,test_morton_order);
     tcase_add_test(tc_core,test_memerr);
     suite_add_tcase(s,tc_core);
     return s;
@@ -1,10 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 #include <check.h>
 #if HAVE_CONFIG_H
 #  include <config.h>
 #endif
+#if USE_THREADS
+#  include <pthread.h>
+#endif
 
 #include <freesasa.h>
 #include <freesasa_internal.h>
@@ -78,6 +83,16 @@ void setup_sr_precision(void)
 void teardown_sr_precision(void)
 {
     
+}
+void setup_an_precision(void)
+{
+    parameters = freesasa_default_parameters;
+    parameters.alg = FREESASA_ANALYTICAL;
+    tolerance = 1e-10;
+}
+void teardown_an_precision(void)
+{
+    
 }
 
 START_TEST (test_sasa_alg_basic)
@@ -169,6 +184,20 @@ void teardown_sr(void)
 
 }
 
+void setup_an (void)
+{
+    parameters = freesasa_default_parameters;
+    parameters.alg = FREESASA_ANALYTICAL;
+    parameters.n_threads = 1;
+    total_ref = 4804.633997;
+    polar_ref = 2502.677016;
+    apolar_ref = 2301.956981;
+}
+void teardown_an(void)
+{
+
+}
+
 void setup_lr (void)
 {
     parameters = freesasa_default_parameters;
@@ -184,6 +213,38 @@ void teardown_lr(void)
 
 }
 
+// 1UBQ, for tests that compare different ways of doing the same calculation
+static freesasa_structure *ubq;
+
+static void setup_1ubq(void)
+{
+    FILE *pdb = fopen(DATADIR "1ubq.pdb","r");
+    ck_assert(pdb != NULL);
+    ubq = freesasa_structure_from_pdb(pdb, NULL, 0);
+    fclose(pdb);
+    ck_assert(ubq != NULL);
+}
+static void teardown_1ubq(void)
+{
+    freesasa_structure_free(ubq);
+    ubq = NULL;
+}
+
+// Do the two results agree atom by atom to within tol (0 means exactly)?
+static int
+same_sasa(const freesasa_result *ref, const freesasa_result *res, double tol)
+{
+    ck_assert(ref != NULL && res != NULL);
+    if (ref->n_atoms != res->n_atoms) return 0;
+    for (int i = 0; i < ref->n_atoms; ++i) {
+        if (fabs(res->sasa[i] - ref->sasa[i]) > tol) {
+            printf("atom %d: %.12g != %.12g\n", i, res->sasa[i], ref->sasa[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 START_TEST (test_sasa_1ubq)
 {
     FILE *pdb = fopen(DATADIR "1ubq.pdb","r");
@@ -425,6 +486,11 @@ START_TEST (test_multi_calc)
     p.lee_richards_n_slices = 20;
     ck_assert((res = freesasa_calc_structure(st,&p)) != NULL);
     ck_assert(fabs(res->total - 4804.055641) < 1e-5);
+    freesasa_result_free(res);
+    // Analytical
+    p.alg = FREESASA_ANALYTICAL;
+    ck_assert((res = freesasa_calc_structure(st,&p)) != NULL);
+    ck_assert(fabs(res->total - 4804.633997) < 1e-5);
     
     freesasa_structure_free(st);
     freesasa_result_free(res);
@@ -476,36 +542,56 @@ START_TEST (test_1d3z)
 }
 END_TEST
 
+// Makes the first, second, etc, allocation fail until the calculation
+// succeeds, it should fail cleanly each time before that. Returns the
+// number of allocations the calculation needs.
+static int
+calc_until_success(const coord_t *xyz,
+                   const double *r,
+                   const freesasa_parameters *p)
+{
+    freesasa_result *res = NULL;
+    int i;
+
+    for (i = 1; res == NULL && i < 100000; ++i) {
+        set_fail_after(i);
+        res = freesasa_calc(xyz, r, p);
+        set_fail_after(0);
+    }
+    ck_assert_ptr_ne(res, NULL);
+    freesasa_result_free(res);
+    return i - 1;
+}
+
 START_TEST (test_memerr)
 {
     freesasa_parameters p = freesasa_default_parameters;
     double v[18] = {0,0,0, 1,1,1, -1,1,-1, 2,0,-2, 2,2,0, -5,5,5};
     struct coord_t coord = {.xyz = v, .n = 6, .is_linked = 0};
     const double r[6]  = {4,2,2,2,2,2};
+    const freesasa_algorithm alg[] = {FREESASA_SHRAKE_RUPLEY, FREESASA_LEE_RICHARDS,
+                                      FREESASA_ANALYTICAL};
     void *ptr;
-    p.shrake_rupley_n_points = 10; // so the loop below will be fast
 
     freesasa_set_verbosity(FREESASA_V_SILENT);
-    for (int i = 1; i < 40; ++i) {
-        p.alg = FREESASA_SHRAKE_RUPLEY;
-        set_fail_after(i);
-        ptr = freesasa_calc(&coord, r, &p);
-        set_fail_after(0);
-        ck_assert_ptr_eq(ptr, NULL);
-        p.alg = FREESASA_LEE_RICHARDS;
-        set_fail_after(i);
-        ptr = freesasa_calc(&coord, r, &p);
-        set_fail_after(0);
-        ck_assert_ptr_eq(ptr, NULL);
+    p.shrake_rupley_n_points = 10; // so the loops below will be fast
+    p.n_threads = 1;
+    for (int k = 0; k < 3; ++k) {
+        p.alg = alg[k];
+        ck_assert_int_gt(calc_until_success(&coord, r, &p), 1);
     }
 
+    // the first 100 atoms of 1ubq, divided between two threads
     FILE *file = fopen(DATADIR "1ubq.pdb","r");
     freesasa_structure *s = freesasa_structure_from_pdb(file, NULL, 0);
+    struct coord_t part = {.xyz = (double*)freesasa_coord_all(freesasa_structure_xyz(s)),
+                           .n = 100, .is_linked = 1};
+    p.n_threads = 2;
+    for (int k = 0; k < 3; ++k) {
+        p.alg = alg[k];
+        ck_assert_int_gt(calc_until_success(&part, freesasa_structure_radius(s), &p), 1);
+    }
     for (int i = 1; i < 256; i *= 2) { //try to spread it out without doing too many calculations
-        set_fail_after(i);
-        ptr = freesasa_calc_structure(s, NULL);
-        set_fail_after(0);
-        ck_assert_ptr_eq(ptr, NULL);
         set_fail_after(i);
         ptr = freesasa_structure_get_chains(s, "A");
         set_fail_after(0);
@@ -517,7 +603,752 @@ START_TEST (test_memerr)
 }
 END_TEST
 
+START_TEST (test_sr_kernels)
+{
+    // All S&R kernels should give identical results, independently of
+    // the number of test points and their distribution (if a kernel is
+    // not available the scalar one is used instead)
+    freesasa_parameters p = freesasa_default_parameters;
+    const freesasa_sr_kernel kernels[] = {FREESASA_SR_AUTO, FREESASA_SR_AVX2, FREESASA_SR_AVX512};
+    const int n_points[] = {1, 13, 100, 1001};
+    const freesasa_sr_point_set point_sets[] = {FREESASA_SR_SPIRAL, FREESASA_SR_ICOSAHEDRAL};
+    freesasa_result *ref, *res;
+
+    p.alg = FREESASA_SHRAKE_RUPLEY;
+    p.n_threads = 1;
+    freesasa_set_verbosity(FREESASA_V_SILENT);
+    for (int ps = 0; ps < sizeof(point_sets)/sizeof(freesasa_sr_point_set); ++ps) {
+        p.shrake_rupley_point_set = point_sets[ps];
+        for (int i = 0; i < sizeof(n_points)/sizeof(int); ++i) {
+            p.shrake_rupley_n_points = n_points[i];
+            p.shrake_rupley_kernel = FREESASA_SR_SCALAR;
+            ref = freesasa_calc_structure(ubq, &p);
+            ck_assert_ptr_ne(ref, NULL);
+            for (int k = 0; k < sizeof(kernels)/sizeof(freesasa_sr_kernel); ++k) {
+                p.shrake_rupley_kernel = kernels[k];
+                res = freesasa_calc_structure(ubq, &p);
+                ck_assert_ptr_ne(res, NULL);
+                ck_assert(same_sasa(ref, res, 0));
+                freesasa_result_free(res);
+            }
+            // the cap kernel can differ for points exactly on the border of a cap
+            p.shrake_rupley_kernel = FREESASA_SR_CAP;
+            res = freesasa_calc_structure(ubq, &p);
+            ck_assert_ptr_ne(res, NULL);
+            ck_assert(float_eq(res->total, ref->total, 1e-3*ref->total));
+            freesasa_result_free(res);
+            // the patch kernel uses the cap formulation too (and falls back
+            // on the cap kernel for the spiral)
+            p.shrake_rupley_kernel = FREESASA_SR_PATCH;
+            res = freesasa_calc_structure(ubq, &p);
+            ck_assert_ptr_ne(res, NULL);
+            ck_assert(float_eq(res->total, ref->total, 1e-3*ref->total));
+            freesasa_result_free(res);
+            // the lookup-table kernel is approximate, run twice to use the cached table
+            p.shrake_rupley_kernel = FREESASA_SR_LUT;
+            for (int k = 0; k < 2; ++k) {
+                res = freesasa_calc_structure(ubq, &p);
+                ck_assert_ptr_ne(res, NULL);
+                ck_assert(float_eq(res->total, ref->total, 1e-2*ref->total));
+                freesasa_result_free(res);
+            }
+            freesasa_result_free(ref);
+        }
+    }
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+}
+END_TEST
+
+START_TEST (test_lr_kernels)
+{
+    // The SIMD L&R kernels should agree with the scalar one within 1e-10 Å^2
+    // per atom (if a kernel is not available the scalar one is used instead)
+    freesasa_parameters p = freesasa_default_parameters;
+    const freesasa_lr_kernel kernels[] = {FREESASA_LR_AUTO, FREESASA_LR_AVX2, FREESASA_LR_AVX512};
+    const int n_slices[] = {1, 7, 20, 100};
+    const double pair_xyz[6] = {0, 0, 0, 1, 1, 1}, pair_r[2] = {1.5, 2};
+    freesasa_result *ref, *res;
+
+    p.alg = FREESASA_LEE_RICHARDS;
+    p.n_threads = 1;
+    freesasa_set_verbosity(FREESASA_V_SILENT);
+    for (int i = 0; i < sizeof(n_slices)/sizeof(int); ++i) {
+        p.lee_richards_n_slices = n_slices[i];
+        p.lee_richards_kernel = FREESASA_LR_SCALAR;
+        ref = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(ref, NULL);
+        for (int k = 0; k < sizeof(kernels)/sizeof(freesasa_lr_kernel); ++k) {
+            p.lee_richards_kernel = kernels[k];
+            res = freesasa_calc_structure(ubq, &p);
+            ck_assert_ptr_ne(res, NULL);
+            ck_assert(same_sasa(ref, res, 1e-10));
+            freesasa_result_free(res);
+        }
+        freesasa_result_free(ref);
+    }
+
+    // the stack use of the kernels doesn't depend on the resolution (the
+    // exact area is 162.6128 Å^2)
+    p.lee_richards_n_slices = 4000000;
+    p.n_threads = 2;
+    for (int k = 0; k <= sizeof(kernels)/sizeof(freesasa_lr_kernel); ++k) {
+        // the last round is the single precision kernel
+        if (k < sizeof(kernels)/sizeof(freesasa_lr_kernel)) p.lee_richards_kernel = kernels[k];
+        else p.precision = FREESASA_SINGLE_PRECISION;
+        res = freesasa_calc_coord(pair_xyz, pair_r, 2, &p);
+        ck_assert_ptr_ne(res, NULL);
+        ck_assert(float_eq(res->total, 162.6128, 1e-4));
+        freesasa_result_free(res);
+    }
+    p.precision = FREESASA_DOUBLE_PRECISION;
+
+    p.lee_richards_kernel = 17;
+    ck_assert_ptr_eq(freesasa_calc_structure(ubq, &p), NULL);
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+}
+END_TEST
+
+START_TEST (test_lr_adaptive)
+{
+    // Adaptive slicing should be close to the exact result for a
+    // small tolerance, also for an isolated sphere and a narrow band
+    freesasa_parameters p = freesasa_default_parameters;
+    const double xyz[3] = {0, 0, 0}, r = 1.5;
+    // two neighbors on the z-axis that leave an exposed band from z =
+    // 0.3 to 0.36 on the central sphere, which a coarse sampling
+    // misses
+    const double band_xyz[9] = {0, 0, 0, 0, 0, -1, 0, 0, 1},
+        band_r[3] = {2, sqrt(5.6), sqrt(4.28)};
+    freesasa_result *ref, *res, *res2;
+
+    p.alg = FREESASA_ANALYTICAL;
+    p.n_threads = 1;
+    ref = freesasa_calc_structure(ubq, &p);
+    ck_assert_ptr_ne(ref, NULL);
+
+    p.alg = FREESASA_LEE_RICHARDS;
+    p.lee_richards_n_slices = 1000;
+    p.lee_richards_tolerance = 0.01;
+    res = freesasa_calc_structure(ubq, &p);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert(float_eq(res->total, ref->total, 1e-3*ref->total));
+    // the maximum error is 0.016 Å^2
+    for (int i = 0; i < res->n_atoms; ++i) {
+        ck_assert(fabs(res->sasa[i] - ref->sasa[i]) < 2*p.lee_richards_tolerance);
+    }
+
+    p.n_threads = 2;
+    res2 = freesasa_calc_structure(ubq, &p);
+    ck_assert_ptr_ne(res2, NULL);
+    ck_assert(same_sasa(res2, res, 0));
+    freesasa_result_free(res2);
+    freesasa_result_free(res);
+    freesasa_result_free(ref);
+
+    p.n_threads = 1;
+    res = freesasa_calc_coord(xyz, &r, 1, &p);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert(float_eq(res->total, 4*M_PI*(r + p.probe_radius)*(r + p.probe_radius),
+                       p.lee_richards_tolerance));
+    freesasa_result_free(res);
+
+    p.probe_radius = 0;
+    res = freesasa_calc_coord(band_xyz, band_r, 3, &p);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert(float_eq(res->sasa[0], 2*M_PI*band_r[0]*0.06, 2*p.lee_richards_tolerance));
+    freesasa_result_free(res);
+
+    freesasa_set_verbosity(FREESASA_V_SILENT);
+    p.lee_richards_tolerance = -1;
+    ck_assert_ptr_eq(freesasa_calc_structure(ubq, &p), NULL);
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+}
+END_TEST
+
+START_TEST (test_lr_adaptive_cost)
+{
+    // The number of slices evaluated, which is printed at debug
+    // verbosity, should fall as the tolerance grows
+    freesasa_parameters p = freesasa_default_parameters;
+    const double tolerance[] = {0.001, 0.01, 0.1};
+    double n_eval[3];
+    char line[256];
+    FILE *err;
+    freesasa_result *res;
+
+    p.alg = FREESASA_LEE_RICHARDS;
+    p.lee_richards_n_slices = 1000;
+    freesasa_set_verbosity(FREESASA_V_DEBUG);
+    for (int k = 0; k < 3; ++k) {
+        err = tmpfile();
+        ck_assert_ptr_ne(err, NULL);
+        freesasa_set_err_out(err);
+        p.lee_richards_tolerance = tolerance[k];
+        res = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(res, NULL);
+        freesasa_result_free(res);
+        rewind(err);
+        n_eval[k] = 0;
+        while (fgets(line, sizeof(line), err)) {
+            if (strstr(line, "slices per atom")) {
+                ck_assert_int_eq(sscanf(line, "FreeSASA: debug: L&R: %lf", &n_eval[k]), 1);
+            }
+        }
+        fclose(err);
+        // fewer slices than fixed slicing with the same resolution
+        ck_assert(n_eval[k] > 0);
+        ck_assert(n_eval[k] < p.lee_richards_n_slices);
+    }
+    freesasa_set_err_out(stderr);
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+
+    ck_assert(n_eval[0] > n_eval[1]);
+    ck_assert(n_eval[1] > n_eval[2]);
+}
+END_TEST
+
+START_TEST (test_verlet_list)
+{
+    // A random walk of 1ubq, using a Verlet list should give the
+    // same results as calculating the neighbors from scratch
+    const int n = freesasa_structure_n(ubq);
+    const double *r = freesasa_structure_radius(ubq);
+    double *xyz = malloc(sizeof(double)*3*n);
+    const freesasa_algorithm alg[] = {FREESASA_SHRAKE_RUPLEY, FREESASA_LEE_RICHARDS,
+                                      FREESASA_ANALYTICAL};
+    freesasa_parameters p = freesasa_default_parameters;
+    freesasa_verlet_list *verlet = freesasa_verlet_list_new(1.0);
+    freesasa_result *ref, *res;
+    unsigned int seed = 1;
+    int n_builds;
+
+    ck_assert_ptr_ne(verlet, NULL);
+    memcpy(xyz, freesasa_coord_all(freesasa_structure_xyz(ubq)), sizeof(double)*3*n);
+    for (int frame = 0; frame < 10; ++frame) {
+        for (int i = 0; i < 3*n; ++i) {
+            seed = seed*1103515245 + 12345;
+            xyz[i] += 0.2*((seed >> 8)/(double)(1 << 24) - 0.5);
+        }
+        for (int k = 0; k < 3; ++k) {
+            p.alg = alg[k];
+            ref = freesasa_calc_coord(xyz, r, n, &p);
+            res = freesasa_calc_coord_verlet(xyz, r, n, &p, verlet);
+            ck_assert_ptr_ne(ref, NULL);
+            ck_assert_ptr_ne(res, NULL);
+            ck_assert(same_sasa(ref, res, 1e-10));
+            freesasa_result_free(res);
+            freesasa_result_free(ref);
+        }
+    }
+    // the atoms move about 0.1 Å per frame, the list should be reused most of the time
+    n_builds = freesasa_verlet_list_n_builds(verlet);
+    ck_assert_int_gt(n_builds, 1);
+    ck_assert_int_lt(n_builds, 6);
+
+    // a new probe radius changes the neighbors
+    p.probe_radius = 1.2;
+    res = freesasa_calc_coord_verlet(xyz, r, n, &p, verlet);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert_int_eq(freesasa_verlet_list_n_builds(verlet), n_builds + 1);
+    freesasa_result_free(res);
+
+    // so does single precision in L&R, which stores the distances as float
+    p.alg = FREESASA_LEE_RICHARDS;
+    p.precision = FREESASA_SINGLE_PRECISION;
+    ref = freesasa_calc_coord(xyz, r, n, &p);
+    res = freesasa_calc_coord_verlet(xyz, r, n, &p, verlet);
+    ck_assert_ptr_ne(ref, NULL);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert_int_eq(freesasa_verlet_list_n_builds(verlet), n_builds + 2);
+    ck_assert(same_sasa(ref, res, 1e-10));
+    freesasa_result_free(res);
+    freesasa_result_free(ref);
+
+    freesasa_set_verbosity(FREESASA_V_SILENT);
+    ck_assert_ptr_eq(freesasa_verlet_list_new(-1), NULL);
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+
+    freesasa_verlet_list_free(verlet);
+    free(xyz);
+}
+END_TEST
+
+START_TEST (test_nb_storage)
+{
+    // L&R with half storage of the neighbor list should give
+    // identical results, with all kernels and with adaptive slicing
+    freesasa_parameters p = freesasa_default_parameters;
+    const freesasa_lr_kernel kernel[] = {FREESASA_LR_SCALAR, FREESASA_LR_AUTO,
+                                         FREESASA_LR_AUTO};
+    freesasa_result *ref, *res;
+
+    p.alg = FREESASA_LEE_RICHARDS;
+    for (int k = 0; k < 3; ++k) {
+        p.lee_richards_kernel = kernel[k];
+        p.lee_richards_tolerance = k == 2 ? 0.5 : 0;
+        p.neighbor_storage = FREESASA_NB_FULL;
+        ref = freesasa_calc_structure(ubq, &p);
+        p.neighbor_storage = FREESASA_NB_HALF;
+        res = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(ref, NULL);
+        ck_assert_ptr_ne(res, NULL);
+        ck_assert(same_sasa(ref, res, 0));
+        freesasa_result_free(res);
+        freesasa_result_free(ref);
+    }
+
+    freesasa_set_verbosity(FREESASA_V_SILENT);
+    p.neighbor_storage = 17;
+    ck_assert_ptr_eq(freesasa_calc_structure(ubq, &p), NULL);
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+}
+END_TEST
+
+START_TEST (test_nb_search)
+{
+    // calculations without a stored neighbor list should give the
+    // same results, with one or more threads, for S&R with fixed and
+    // adaptive resolution and L&R with fixed and adaptive slices
+    freesasa_parameters p = freesasa_default_parameters;
+    const freesasa_algorithm alg[] = {FREESASA_SHRAKE_RUPLEY, FREESASA_SHRAKE_RUPLEY,
+                                      FREESASA_LEE_RICHARDS, FREESASA_LEE_RICHARDS};
+    const double tolerance[] = {0, 0.5, 0, 0.5};
+    freesasa_result *ref, *res;
+
+    for (int k = 0; k < 4; ++k) {
+        p.alg = alg[k];
+        p.shrake_rupley_tolerance = p.lee_richards_tolerance = tolerance[k];
+        p.n_threads = 1;
+        p.neighbor_storage = FREESASA_NB_FULL;
+        ref = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(ref, NULL);
+        p.neighbor_storage = FREESASA_NB_NONE;
+        for (p.n_threads = 1; p.n_threads <= 3; p.n_threads += 2) {
+            res = freesasa_calc_structure(ubq, &p);
+            ck_assert_ptr_ne(res, NULL);
+            ck_assert(same_sasa(ref, res, 1e-10));
+            freesasa_result_free(res);
+        }
+        freesasa_result_free(ref);
+    }
+}
+END_TEST
+
+#if USE_THREADS
+static void *
+pool_cycle(void *arg)
+{
+    volatile int *stop = arg;
+    while (!*stop) {
+        freesasa_thread_pool_create(3);
+        freesasa_thread_pool_destroy();
+    }
+    return NULL;
+}
+
+START_TEST (test_thread_pool)
+{
+    // calculations on the thread pool should give the same results as
+    // with new threads, also when the pool has fewer threads than
+    // the calculation uses
+    freesasa_parameters p = freesasa_default_parameters;
+    const freesasa_algorithm alg[] = {FREESASA_SHRAKE_RUPLEY, FREESASA_SHRAKE_RUPLEY,
+                                      FREESASA_LEE_RICHARDS, FREESASA_LEE_RICHARDS,
+                                      FREESASA_ANALYTICAL};
+    const freesasa_nb_storage storage[] = {FREESASA_NB_FULL, FREESASA_NB_NONE,
+                                           FREESASA_NB_FULL, FREESASA_NB_FULL,
+                                           FREESASA_NB_FULL};
+    freesasa_result *ref[5], *res;
+    pthread_t thread;
+    volatile int stop = 0;
+
+    ck_assert_int_eq(freesasa_thread_pool_n_threads(), 0);
+    p.n_threads = 3;
+    for (int k = 0; k < 5; ++k) {
+        p.alg = alg[k];
+        p.neighbor_storage = storage[k];
+        p.lee_richards_tolerance = k == 3 ? 0.5 : 0;
+        ref[k] = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(ref[k], NULL);
+    }
+
+    for (int n = 3; n >= 2; --n) {
+        ck_assert_int_eq(freesasa_thread_pool_create(n), FREESASA_SUCCESS);
+        ck_assert_int_eq(freesasa_thread_pool_n_threads(), n);
+        for (int rep = 0; rep < 10; ++rep) {
+            for (int k = 0; k < 5; ++k) {
+                p.alg = alg[k];
+                p.neighbor_storage = storage[k];
+                p.lee_richards_tolerance = k == 3 ? 0.5 : 0;
+                res = freesasa_calc_structure(ubq, &p);
+                ck_assert_ptr_ne(res, NULL);
+                ck_assert(same_sasa(ref[k], res, 0));
+                freesasa_result_free(res);
+            }
+        }
+    }
+    freesasa_thread_pool_destroy();
+    ck_assert_int_eq(freesasa_thread_pool_n_threads(), 0);
+
+    // the pool can be created and destroyed while a calculation in
+    // another thread uses it
+    p.alg = FREESASA_LEE_RICHARDS;
+    p.neighbor_storage = FREESASA_NB_FULL;
+    p.lee_richards_tolerance = 0;
+    pthread_create(&thread, NULL, pool_cycle, (void *) &stop);
+    for (int rep = 0; rep < 50; ++rep) {
+        res = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(res, NULL);
+        ck_assert(same_sasa(ref[2], res, 0));
+        freesasa_result_free(res);
+    }
+    stop = 1;
+    pthread_join(thread, NULL);
+    freesasa_thread_pool_destroy();
+
+    freesasa_set_verbosity(FREESASA_V_SILENT);
+    ck_assert_int_eq(freesasa_thread_pool_create(0), FREESASA_FAIL);
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+    ck_assert_int_eq(freesasa_thread_pool_n_threads(), 0);
+
+    for (int k = 0; k < 5; ++k) freesasa_result_free(ref[k]);
+}
+END_TEST
+
+static void
+count_range(void *data,
+            int first,
+            int end)
+{
+    int *count = data;
+    for (int i = first; i < end; ++i) ++count[i];
+}
+
+START_TEST (test_thread_run_atoms)
+{
+    // each atom should be processed exactly once, also when the
+    // costs are very uneven
+    const int n = 1000;
+    int count[n], nn[n];
+    char skip[n];
+    double imbalance = 0;
+
+    for (int i = 0; i < n; ++i) {
+        nn[i] = i < 10 ? 10000 : i % 7;
+        skip[i] = i % 3 == 0;
+    }
+    for (int n_threads = 2; n_threads <= 5; ++n_threads) {
+        for (int i = 0; i < n; ++i) count[i] = 0;
+        ck_assert_int_eq(freesasa_thread_run_atoms(n_threads, n, nn, skip, count_range,
+                                                   count, 0, &imbalance),
+                         FREESASA_SUCCESS);
+        for (int i = 0; i < n; ++i) ck_assert_int_eq(count[i], 1);
+        ck_assert(imbalance >= 1);
+
+        for (int i = 0; i < n; ++i) count[i] = 0;
+        ck_assert_int_eq(freesasa_thread_run_atoms(n_threads, n_threads, NULL, NULL, count_range,
+                                                   count, 0, NULL),
+                         FREESASA_SUCCESS);
+        for (int i = 0; i < n_threads; ++i) ck_assert_int_eq(count[i], 1);
+    }
+}
+END_TEST
+#endif /* USE_THREADS */
+
+START_TEST (test_atom_order)
+{
+    // Processing the atoms in Morton order should give the same
+    // results, in the original order
+    freesasa_parameters p = freesasa_default_parameters;
+    const freesasa_algorithm alg[] = {FREESASA_SHRAKE_RUPLEY, FREESASA_LEE_RICHARDS,
+                                      FREESASA_ANALYTICAL};
+    freesasa_result *ref, *res;
+
+    for (int k = 0; k < 3; ++k) {
+        p.alg = alg[k];
+        p.atom_order = FREESASA_INPUT_ORDER;
+        ref = freesasa_calc_structure(ubq, &p);
+        p.atom_order = FREESASA_MORTON_ORDER;
+        res = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(ref, NULL);
+        ck_assert_ptr_ne(res, NULL);
+        ck_assert_int_eq(res->parameters.atom_order, FREESASA_MORTON_ORDER);
+        ck_assert(same_sasa(ref, res, 1e-10));
+        ck_assert(float_eq(res->total, ref->total, 1e-8));
+        freesasa_result_free(res);
+        freesasa_result_free(ref);
+    }
+
+    freesasa_set_verbosity(FREESASA_V_SILENT);
+    p.atom_order = 17;
+    ck_assert_ptr_eq(freesasa_calc_structure(ubq, &p), NULL);
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+}
+END_TEST
+
+START_TEST (test_atom_order_benchmark)
+{
+    // Prints the time for S&R and L&R with atoms in input and Morton
+    // order, for 48 copies of 3bzd (132192 atoms) stacked in a 4x4x3
+    // grid. The atoms are either in PDB order, which is already
+    // fairly local, or shuffled. Doesn't test anything beyond the
+    // totals agreeing. Only run if the environment variable
+    // FREESASA_BENCHMARK is set.
+    FILE *pdb = fopen(DATADIR "3bzd_trimmed.pdb","r");
+    freesasa_structure *st = freesasa_structure_from_pdb(pdb, NULL, 0);
+    const int n1 = freesasa_structure_n(st), n = 48*n1;
+    const double *v = freesasa_coord_all(freesasa_structure_xyz(st));
+    double *xyz = malloc(sizeof(double)*3*n), *r = malloc(sizeof(double)*n);
+    int *pos = malloc(sizeof(int)*n);
+    unsigned int seed = 1;
+    freesasa_parameters p = freesasa_default_parameters;
+    const freesasa_algorithm alg[] = {FREESASA_SHRAKE_RUPLEY, FREESASA_LEE_RICHARDS};
+
+    fclose(pdb);
+    p.n_threads = 1;
+    printf("\nAtom order, %d atoms, s (input / Morton):\n", n);
+    for (int shuffled = 0; shuffled < 2; ++shuffled) {
+        for (int j = 0; j < n; ++j) pos[j] = j;
+        for (int j = n - 1; shuffled && j > 0; --j) {
+            int k, tmp;
+            seed = seed*1103515245 + 12345;
+            k = (seed >> 8) % (j + 1);
+            tmp = pos[j]; pos[j] = pos[k]; pos[k] = tmp;
+        }
+        for (int c = 0; c < 48; ++c) {
+            for (int i = 0; i < n1; ++i) {
+                const int j = pos[c*n1 + i];
+                xyz[3*j] = v[3*i] + 45*(c % 4);
+                xyz[3*j+1] = v[3*i+1] + 45*(c/4 % 4);
+                xyz[3*j+2] = v[3*i+2] + 45*(c/16);
+                r[j] = freesasa_structure_radius(st)[i];
+            }
+        }
+        for (int k = 0; k < 2; ++k) {
+            double t[2], total[2];
+            p.alg = alg[k];
+            for (int order = 0; order < 2; ++order) {
+                freesasa_result *res;
+                clock_t start = clock();
+                p.atom_order = order;
+                res = freesasa_calc_coord(xyz, r, n, &p);
+                t[order] = (double)(clock() - start)/CLOCKS_PER_SEC;
+                ck_assert_ptr_ne(res, NULL);
+                total[order] = res->total;
+                freesasa_result_free(res);
+            }
+            ck_assert(float_eq(total[0], total[1], 1e-6));
+            printf("%-16s %-9s %6.3f %6.3f\n", freesasa_alg_name(p.alg),
+                   shuffled ? "shuffled" : "PDB order", t[0], t[1]);
+        }
+    }
+
+    free(xyz);
+    free(r);
+    free(pos);
+    freesasa_structure_free(st);
+}
+END_TEST
+
+START_TEST (test_analytical_gradient)
+{
+    // The gradient should agree with finite differences, and the
+    // total force should be zero
+    freesasa_parameters p = freesasa_default_parameters;
+    const int n = freesasa_structure_n(ubq);
+    const double *radii = freesasa_structure_radius(ubq);
+    const double h = 1e-5;
+    double *xyz = malloc(sizeof(double)*3*n), *grad = malloc(sizeof(double)*3*n),
+        *grad2 = malloc(sizeof(double)*3*n), sum[3] = {0, 0, 0};
+    freesasa_result *res, *res2, *plus, *minus;
+
+    memcpy(xyz, freesasa_structure_coord_array(ubq), sizeof(double)*3*n);
+    p.n_threads = 1;
+    res = freesasa_calc_coord_gradient(xyz, radii, n, &p, grad);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert(float_eq(res->total, 4804.633997, 1e-5));
+    for (int i = 0; i < n; ++i) {
+        for (int x = 0; x < 3; ++x) sum[x] += grad[3*i+x];
+    }
+    for (int x = 0; x < 3; ++x) ck_assert(fabs(sum[x]) < 1e-9);
+
+    p.alg = FREESASA_ANALYTICAL;
+    for (int k = 0; k < 3*n; k += 17) {
+        const double x0 = xyz[k];
+        xyz[k] = x0 + h;
+        plus = freesasa_calc_coord(xyz, radii, n, &p);
+        xyz[k] = x0 - h;
+        minus = freesasa_calc_coord(xyz, radii, n, &p);
+        xyz[k] = x0;
+        ck_assert(fabs((plus->total - minus->total)/(2*h) - grad[k]) < 1e-5);
+        freesasa_result_free(plus);
+        freesasa_result_free(minus);
+    }
+
+    // with threads, and the algorithm in the parameters is ignored
+    p.alg = FREESASA_SHRAKE_RUPLEY;
+    p.n_threads = 2;
+    res2 = freesasa_calc_coord_gradient(xyz, radii, n, &p, grad2);
+    ck_assert_ptr_ne(res2, NULL);
+    ck_assert_int_eq(res2->parameters.alg, FREESASA_ANALYTICAL);
+    for (int i = 0; i < 3*n; ++i) ck_assert(fabs(grad[i] - grad2[i]) < 1e-10);
+    ck_assert(same_sasa(res, res2, 0));
+
+    freesasa_result_free(res2);
+    freesasa_result_free(res);
+
+    // two spheres of radius R = 2.4 (with probe) at distance 3, moving
+    // them apart increases the area by 2*pi*R per unit length
+    {
+        const double xyz2[6] = {0, 0, 0, 3, 0, 0}, r2[2] = {1, 1}, R = 1 + p.probe_radius;
+        res = freesasa_calc_coord_gradient(xyz2, r2, 2, &p, grad);
+        ck_assert_ptr_ne(res, NULL);
+        ck_assert(float_eq(res->total, 4*M_PI*R*R + 2*M_PI*R*3, 1e-10));
+        ck_assert(float_eq(grad[0], -2*M_PI*R, 1e-10));
+        ck_assert(float_eq(grad[3], 2*M_PI*R, 1e-10));
+        for (int i = 1; i < 6; ++i) {
+            if (i != 3) ck_assert(fabs(grad[i]) < 1e-10);
+        }
+        freesasa_result_free(res);
+    }
+
+    free(grad2);
+    free(grad);
+    free(xyz);
+}
+END_TEST
+
+START_TEST (test_sr_adaptive)
+{
+    // The adaptive resolution should be between the finest and the
+    // coarsest, and converge to the finest as the tolerance goes to 0
+    freesasa_parameters p = freesasa_default_parameters;
+    freesasa_result *ref, *res;
+
+    p.alg = FREESASA_SHRAKE_RUPLEY;
+    p.shrake_rupley_n_points = 2000;
+    ref = freesasa_calc_structure(ubq, &p);
+    ck_assert_ptr_ne(ref, NULL);
+
+    p.shrake_rupley_tolerance = 1e-6;
+    res = freesasa_calc_structure(ubq, &p);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert(same_sasa(ref, res, 0));
+    freesasa_result_free(res);
+
+    // with one or several threads, and with different kernels
+    p.shrake_rupley_tolerance = 0.5;
+    for (int t = 1; t <= 2; ++t) {
+        p.n_threads = t;
+        p.shrake_rupley_kernel = t == 1 ? FREESASA_SR_SCALAR : FREESASA_SR_AUTO;
+        res = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(res, NULL);
+        ck_assert(float_eq(res->total, ref->total, 1e-2*ref->total));
+        freesasa_result_free(res);
+    }
+
+    freesasa_result_free(ref);
+}
+END_TEST
+
+START_TEST (test_single_precision)
+{
+    // Single precision should be close to double precision, and the
+    // single precision S&R kernels should give identical results
+    freesasa_parameters p = freesasa_default_parameters;
+    const freesasa_sr_kernel kernels[] = {FREESASA_SR_AUTO, FREESASA_SR_AVX2, FREESASA_SR_AVX512};
+    const freesasa_algorithm algs[] = {FREESASA_LEE_RICHARDS, FREESASA_SHRAKE_RUPLEY};
+    freesasa_result *ref, *res, *single;
+
+    freesasa_set_verbosity(FREESASA_V_SILENT);
+    p.shrake_rupley_n_points = 1001;
+    p.lee_richards_n_slices = 50;
+    for (int a = 0; a < 2; ++a) {
+        p.alg = algs[a];
+        p.shrake_rupley_kernel = FREESASA_SR_SCALAR;
+        p.precision = FREESASA_DOUBLE_PRECISION;
+        ref = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(ref, NULL);
+        p.precision = FREESASA_SINGLE_PRECISION;
+        single = freesasa_calc_structure(ubq, &p);
+        ck_assert_ptr_ne(single, NULL);
+        ck_assert(float_eq(single->total, ref->total, 1e-4*ref->total));
+        for (int i = 0; i < ref->n_atoms; ++i) {
+            ck_assert(float_eq(single->sasa[i], ref->sasa[i], 0.5));
+        }
+        for (int k = 0; p.alg == FREESASA_SHRAKE_RUPLEY &&
+                 k < sizeof(kernels)/sizeof(freesasa_sr_kernel); ++k) {
+            p.shrake_rupley_kernel = kernels[k];
+            res = freesasa_calc_structure(ubq, &p);
+            ck_assert_ptr_ne(res, NULL);
+            ck_assert(same_sasa(single, res, 0));
+            freesasa_result_free(res);
+        }
+        freesasa_result_free(single);
+        freesasa_result_free(ref);
+    }
+
+    p.precision = 2;
+    ck_assert_ptr_eq(freesasa_calc_structure(ubq, &p), NULL);
+    freesasa_set_verbosity(FREESASA_V_NORMAL);
+}
+END_TEST
+
+START_TEST (test_analytical)
+{
+    // A sphere surrounded by six equal caps along the axes, the cap
+    // radius is varied through configurations where neighboring
+    // circles are tangent (45 deg) and where three circles meet at
+    // the corners of a cube (acos(1/sqrt(3))), which are degenerate
+    // and calculated with the fallback.
+    const double angles[] = {30, 45, 50, 54, acos(1/sqrt(3))*180/M_PI, 60};
+    const double r[7] = {1, 1, 1, 1, 1, 1, 1};
+    freesasa_parameters an = freesasa_default_parameters, lr = freesasa_default_parameters;
+
+    an.alg = FREESASA_ANALYTICAL;
+    an.probe_radius = lr.probe_radius = 0;
+    lr.lee_richards_n_slices = 20000;
+
+    for (int a = 0; a < sizeof(angles)/sizeof(double); ++a) {
+        const double d = 2*cos(angles[a]*M_PI/180);
+        const double xyz[21] = {0,0,0, d,0,0, -d,0,0, 0,d,0, 0,-d,0, 0,0,d, 0,0,-d};
+        freesasa_result *res_an = freesasa_calc_coord(xyz, r, 7, &an),
+            *res_lr = freesasa_calc_coord(xyz, r, 7, &lr);
+        ck_assert(res_an != NULL);
+        ck_assert(res_lr != NULL);
+        for (int i = 0; i < 7; ++i) {
+            // L&R converges slowly when the circles are parallel to the slices
+            ck_assert(float_eq(res_an->sasa[i], res_lr->sasa[i], 1e-3));
+        }
+        if (angles[a] <= 45) {
+            // disjoint caps
+            ck_assert(float_eq(res_an->sasa[0], 4*M_PI - 12*M_PI*(1 - d/2), 1e-10));
+        }
+        freesasa_result_free(res_an);
+        freesasa_result_free(res_lr);
+    }
+
+    // 1UBQ, compare with high resolution L&R atom by atom
+    freesasa_result *res_an, *res_lr;
+
+    an.probe_radius = lr.probe_radius = FREESASA_DEF_PROBE_RADIUS;
+    lr.lee_richards_n_slices = 10000;
+    res_an = freesasa_calc_structure(ubq, &an);
+    res_lr = freesasa_calc_structure(ubq, &lr);
+    ck_assert(res_an != NULL);
+    ck_assert(res_lr != NULL);
+    for (int i = 0; i < res_an->n_atoms; ++i) {
+        ck_assert(float_eq(res_an->sasa[i], res_lr->sasa[i], 1e-3));
+    }
+    ck_assert(float_eq(res_an->total, res_lr->total, 1e-2));
+
+    freesasa_result_free(res_an);
+    freesasa_result_free(res_lr);
+}
+END_TEST
+
 extern TCase * test_LR_static();
+extern TCase * test_SR_static();
 
 Suite *sasa_suite()
 {
@@ -535,11 +1366,37 @@ Suite *sasa_suite()
     tcase_add_test(tc_lr_basic, test_sasa_alg_basic);
 
     TCase *tc_lr_static = test_LR_static();
+
+    TCase *tc_an_basic = tcase_create("Basic Analytical");
+    tcase_add_checked_fixture(tc_an_basic,setup_an_precision,teardown_an_precision);
+    tcase_add_test(tc_an_basic, test_sasa_alg_basic);
+    tcase_add_test(tc_an_basic, test_analytical);
+    tcase_add_test(tc_an_basic, test_analytical_gradient);
+    tcase_add_checked_fixture(tc_an_basic,setup_1ubq,teardown_1ubq);
     
     TCase *tc_sr_basic = tcase_create("Basic S&R");
     tcase_add_checked_fixture(tc_sr_basic,setup_sr_precision,teardown_sr_precision);
     tcase_add_test(tc_sr_basic, test_sasa_alg_basic);
 
+    TCase *tc_sr_static = test_SR_static();
+
+    TCase *tc_kernels = tcase_create("Kernels");
+    tcase_add_checked_fixture(tc_kernels,setup_1ubq,teardown_1ubq);
+    tcase_add_test(tc_kernels, test_sr_kernels);
+    tcase_add_test(tc_kernels, test_sr_adaptive);
+    tcase_add_test(tc_kernels, test_single_precision);
+    tcase_add_test(tc_kernels, test_lr_kernels);
+    tcase_add_test(tc_kernels, test_lr_adaptive);
+    tcase_add_test(tc_kernels, test_lr_adaptive_cost);
+    tcase_add_test(tc_kernels, test_atom_order);
+    tcase_add_test(tc_kernels, test_nb_storage);
+    tcase_add_test(tc_kernels, test_nb_search);
+    tcase_add_test(tc_kernels, test_verlet_list);
+#if USE_THREADS
+    tcase_add_test(tc_kernels, test_thread_pool);
+    tcase_add_test(tc_kernels, test_thread_run_atoms);
+#endif
+
     TCase *tc_lr = tcase_create("1UBQ-L&R");
     tcase_add_checked_fixture(tc_lr,setup_lr,teardown_lr);
     tcase_add_test(tc_lr, test_sasa_1ubq);
@@ -548,6 +1405,10 @@ Suite *sasa_suite()
     tcase_add_checked_fixture(tc_sr,setup_sr,teardown_sr);
     tcase_add_test(tc_sr, test_sasa_1ubq);
 
+    TCase *tc_an = tcase_create("1UBQ-Analytical");
+    tcase_add_checked_fixture(tc_an,setup_an,teardown_an);
+    tcase_add_test(tc_an, test_sasa_1ubq);
+
     TCase *tc_trimmed = tcase_create("Trimmed PDB file");
     tcase_add_test(tc_trimmed, test_trimmed_pdb);
 
@@ -558,11 +1419,23 @@ Suite *sasa_suite()
     suite_add_tcase(s, tc_lr_basic);
     suite_add_tcase(s, tc_lr_static);
     suite_add_tcase(s, tc_sr_basic);
+    suite_add_tcase(s, tc_sr_static);
+    suite_add_tcase(s, tc_an_basic);
+    suite_add_tcase(s, tc_kernels);
     suite_add_tcase(s, tc_lr);
     suite_add_tcase(s, tc_sr);
+    suite_add_tcase(s, tc_an);
     suite_add_tcase(s, tc_trimmed);
     suite_add_tcase(s, tc_1d3z);
 
+    // the benchmarks take long and don't test much, only run them on request
+    if (getenv("FREESASA_BENCHMARK")) {
+        TCase *tc_benchmark = tcase_create("Benchmarks");
+        tcase_set_timeout(tc_benchmark, 60);
+        tcase_add_test(tc_benchmark, test_atom_order_benchmark);
+        suite_add_tcase(s, tc_benchmark);
+    }
+
 #if USE_THREADS
     printf("Using pthread\n");
     TCase *tc_pthr = tcase_create("Pthread");
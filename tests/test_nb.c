@@ -1,3 +1,5 @@
+#include <math.h>
+#include <string.h>
 #include <nb.h>
 #include <freesasa_internal.h>
 #include <check.h>
@@ -11,11 +13,11 @@ START_TEST (test_nb)
     coord_t *coord = freesasa_coord_new();
     nb_list *nb;
     freesasa_coord_append(coord,v,6);
-    ck_assert_ptr_eq(freesasa_nb_new(NULL,NULL),NULL);
-    ck_assert_ptr_eq(freesasa_nb_new(NULL,r),NULL);
-    ck_assert_ptr_eq(freesasa_nb_new(coord,NULL),NULL);
+    ck_assert_ptr_eq(freesasa_nb_new(NULL,NULL,1),NULL);
+    ck_assert_ptr_eq(freesasa_nb_new(NULL,r,1),NULL);
+    ck_assert_ptr_eq(freesasa_nb_new(coord,NULL,1),NULL);
 
-    nb = freesasa_nb_new(coord,r);
+    nb = freesasa_nb_new(coord,r,1);
     ck_assert(nb != NULL);
     ck_assert(freesasa_nb_contact(nb,0,1));
     ck_assert(freesasa_nb_contact(nb,1,0));
@@ -25,6 +27,39 @@ START_TEST (test_nb)
 }
 END_TEST
 
+START_TEST (test_nb_1ubq)
+{
+    // compare to brute force, each contact should be listed exactly once
+    FILE *pdb = fopen(DATADIR "1ubq.pdb","r");
+    freesasa_structure *st = freesasa_structure_from_pdb(pdb, NULL, 0);
+    const coord_t *coord = freesasa_structure_xyz(st);
+    const int n = freesasa_structure_n(st);
+    double r[n];
+    nb_list *nb;
+
+    fclose(pdb);
+    for (int i = 0; i < n; ++i) r[i] = freesasa_structure_radius(st)[i] + 1.4;
+    nb = freesasa_nb_new(coord, r, 1);
+    ck_assert(nb != NULL);
+
+    for (int i = 0; i < n; ++i) {
+        int count[n];
+        int nn = 0;
+        memset(count, 0, sizeof(int)*n);
+        for (int k = 0; k < nb->nn[i]; ++k) ++count[nb->nb[nb->offset[i] + k]];
+        for (int j = 0; j < n; ++j) {
+            int contact = (j != i &&
+                           freesasa_coord_dist2(coord, i, j) < (r[i]+r[j])*(r[i]+r[j]));
+            ck_assert_int_eq(count[j], contact);
+            nn += contact;
+        }
+        ck_assert_int_eq(nb->nn[i], nn);
+    }
+    freesasa_nb_free(nb);
+    freesasa_structure_free(st);
+}
+END_TEST
+
 START_TEST (test_memerr)
 {
     freesasa_set_verbosity(FREESASA_V_SILENT);
@@ -32,9 +67,10 @@ START_TEST (test_memerr)
     struct coord_t coord = {.xyz = v, .n = 6, .is_linked = 0};
     const double r[6]  = {4,2,2,2,2,2};
 
-    for (int i = 1; i < 30; ++i) {
+    // the list and the cells are allocated in 7 steps that can fail
+    for (int i = 1; i < 8; ++i) {
         set_fail_after(i);
-        void *ptr = freesasa_nb_new(&coord,r);
+        void *ptr = freesasa_nb_new(&coord,r,1);
         set_fail_after(0);
         ck_assert_ptr_eq(ptr, NULL);
     }
@@ -42,6 +78,302 @@ START_TEST (test_memerr)
 }
 END_TEST
 
+START_TEST (test_buried)
+{
+    coord_t *coord = freesasa_coord_new();
+    nb_list *nb;
+    char buried[7];
+    // a sphere in the center of an octahedral cage
+    const double cage[21] = {0,0,0, 1.5,0,0, -1.5,0,0, 0,1.5,0, 0,-1.5,0, 0,0,1.5, 0,0,-1.5};
+    const double r_cage[7] = {1, 1.5, 1.5, 1.5, 1.5, 1.5, 1.5};
+
+    // spheres 1 and 2 are inside sphere 0
+    freesasa_coord_append(coord,v,6);
+    nb = freesasa_nb_new(coord,r,1);
+    ck_assert_int_eq(freesasa_nb_buried(buried, coord, r, nb), 2);
+    ck_assert(!buried[0] && buried[1] && buried[2] && !buried[5]);
+    freesasa_nb_free(nb);
+    freesasa_coord_free(coord);
+
+    coord = freesasa_coord_new();
+    freesasa_coord_append(coord,cage,7);
+    nb = freesasa_nb_new(coord,r_cage,1);
+    ck_assert_int_eq(freesasa_nb_buried(buried, coord, r_cage, nb), 1);
+    ck_assert(buried[0]);
+    freesasa_nb_free(nb);
+    freesasa_coord_free(coord);
+
+    // with one side of the cage open
+    coord = freesasa_coord_new();
+    freesasa_coord_append(coord,cage,6);
+    nb = freesasa_nb_new(coord,r_cage,1);
+    ck_assert_int_eq(freesasa_nb_buried(buried, coord, r_cage, nb), 0);
+    freesasa_nb_free(nb);
+    freesasa_coord_free(coord);
+}
+END_TEST
+
+START_TEST (test_buried_1ubq)
+{
+    // atoms found to be buried should have no surface in a high
+    // resolution calculation without the pre-pass
+    FILE *pdb = fopen(DATADIR "1ubq.pdb","r");
+    freesasa_structure *st = freesasa_structure_from_pdb(pdb, NULL, 0);
+    const coord_t *coord = freesasa_structure_xyz(st);
+    const int n = freesasa_structure_n(st);
+    double r[n];
+    char buried[n];
+    freesasa_parameters p = freesasa_default_parameters;
+    freesasa_result *res;
+    nb_list *nb;
+    int n_buried;
+
+    fclose(pdb);
+    for (int i = 0; i < n; ++i) r[i] = freesasa_structure_radius(st)[i] + p.probe_radius;
+    nb = freesasa_nb_new(coord, r, 1);
+    n_buried = freesasa_nb_buried(buried, coord, r, nb);
+    ck_assert_int_gt(n_buried, n/10);
+
+    p.alg = FREESASA_SHRAKE_RUPLEY;
+    p.shrake_rupley_n_points = 1000;
+    res = freesasa_calc_structure(st, &p);
+    ck_assert_ptr_ne(res, NULL);
+    for (int i = 0; i < n; ++i) {
+        if (buried[i]) ck_assert(res->sasa[i] == 0);
+    }
+
+    freesasa_result_free(res);
+    freesasa_nb_free(nb);
+    freesasa_structure_free(st);
+}
+END_TEST
+
+START_TEST (test_sort)
+{
+    // the sorted list should contain the same neighbors, with the
+    // same distances, those that bury larger caps first
+    FILE *pdb = fopen(DATADIR "1ubq.pdb","r");
+    freesasa_structure *st = freesasa_structure_from_pdb(pdb, NULL, 0);
+    const coord_t *coord = freesasa_structure_xyz(st);
+    const int n = freesasa_structure_n(st);
+    const double *v = freesasa_coord_all(coord);
+    double r[n];
+    nb_list *nb, *ref;
+
+    fclose(pdb);
+    for (int i = 0; i < n; ++i) r[i] = freesasa_structure_radius(st)[i] + 1.4;
+    nb = freesasa_nb_new(coord, r, 1);
+    ref = freesasa_nb_new(coord, r, 1);
+    ck_assert_int_eq(freesasa_nb_sort(nb, coord, r), FREESASA_SUCCESS);
+
+    for (int i = 0; i < n; ++i) {
+        double prev_f = 1;
+        ck_assert_int_eq(nb->nn[i], ref->nn[i]);
+        for (int k = 0; k < nb->nn[i]; ++k) {
+            const int o = nb->offset[i] + k, j = nb->nb[o];
+            const double d = sqrt(freesasa_coord_dist2(coord, i, j));
+            // height of the cap buried by j, divided by the diameter of i
+            const double f = (r[i] - (r[i]*r[i] + d*d - r[j]*r[j])/(2*d))/(2*r[i]);
+            ck_assert(freesasa_nb_contact(ref, i, j));
+            ck_assert(float_eq(nb->xd[o], v[3*j] - v[3*i], 1e-10));
+            ck_assert(float_eq(nb->yd[o], v[3*j+1] - v[3*i+1], 1e-10));
+            ck_assert(float_eq(nb->xyd[o], sqrt(nb->xd[o]*nb->xd[o] + nb->yd[o]*nb->yd[o]), 1e-10));
+            // the buried fraction is sorted with a resolution of 1/32
+            ck_assert(f <= prev_f + 1./32 + 1e-10);
+            prev_f = f;
+        }
+    }
+    freesasa_nb_free(nb);
+    freesasa_nb_free(ref);
+    freesasa_structure_free(st);
+}
+END_TEST
+
+START_TEST (test_threads)
+{
+    // four overlapping copies of 3bzd, large enough to be split
+    // between threads, the list should be the same as with one thread
+    FILE *pdb = fopen(DATADIR "3bzd_trimmed.pdb","r");
+    freesasa_structure *st = freesasa_structure_from_pdb(pdb, NULL, 0);
+    const int n1 = freesasa_structure_n(st), n = 4*n1;
+    const double *v = freesasa_coord_all(freesasa_structure_xyz(st));
+    coord_t *coord = freesasa_coord_new();
+    double *r = malloc(sizeof(double)*n);
+    nb_list *nb, *ref;
+
+    fclose(pdb);
+    for (int c = 0; c < 4; ++c) {
+        for (int i = 0; i < n1; ++i) {
+            const double xyz[3] = {v[3*i] + 20*c, v[3*i+1], v[3*i+2]};
+            freesasa_coord_append(coord, xyz, 1);
+            r[c*n1 + i] = freesasa_structure_radius(st)[i] + 1.4;
+        }
+    }
+
+    ref = freesasa_nb_new(coord, r, 1);
+    for (int n_threads = 2; n_threads <= 5; ++n_threads) {
+        nb = freesasa_nb_new(coord, r, n_threads);
+        ck_assert_ptr_ne(nb, NULL);
+        ck_assert(memcmp(nb->offset, ref->offset, sizeof(int)*(n+1)) == 0);
+        ck_assert(memcmp(nb->nn, ref->nn, sizeof(int)*n) == 0);
+        for (int k = 0; k < ref->offset[n]; ++k) {
+            ck_assert_int_eq(nb->nb[k], ref->nb[k]);
+            ck_assert(nb->xyd[k] == ref->xyd[k]);
+            ck_assert(nb->xd[k] == ref->xd[k]);
+            ck_assert(nb->yd[k] == ref->yd[k]);
+        }
+        freesasa_nb_free(nb);
+    }
+
+    freesasa_nb_free(ref);
+    freesasa_coord_free(coord);
+    freesasa_structure_free(st);
+    free(r);
+}
+END_TEST
+
+START_TEST (test_storage)
+{
+    // two overlapping copies of 3bzd, half storage, single precision
+    // and no distances should give the same neighbors as full
+    // storage, also with threads, and the same distances with half
+    // storage (rounded in single precision)
+    FILE *pdb = fopen(DATADIR "3bzd_trimmed.pdb","r");
+    freesasa_structure *st = freesasa_structure_from_pdb(pdb, NULL, 0);
+    const int n1 = freesasa_structure_n(st), n = 2*n1;
+    const double *v = freesasa_coord_all(freesasa_structure_xyz(st));
+    coord_t *coord = freesasa_coord_new();
+    double *r = malloc(sizeof(double)*n);
+    nb_list *nb, *ref;
+
+    fclose(pdb);
+    for (int c = 0; c < 2; ++c) {
+        for (int i = 0; i < n1; ++i) {
+            const double xyz[3] = {v[3*i] + 20*c, v[3*i+1], v[3*i+2]};
+            freesasa_coord_append(coord, xyz, 1);
+            r[c*n1 + i] = freesasa_structure_radius(st)[i] + 1.4;
+        }
+    }
+
+    ref = freesasa_nb_new(coord, r, 1);
+    for (int n_threads = 1; n_threads <= 3; n_threads += 2) {
+        nb = freesasa_nb_new_storage(coord, r, n_threads, NB_HALF, 0);
+        ck_assert_ptr_ne(nb, NULL);
+        ck_assert_int_eq(nb->storage, NB_HALF);
+        ck_assert(memcmp(nb->offset, ref->offset, sizeof(int)*(n+1)) == 0);
+        for (int k = 0; k < ref->offset[n]; ++k) {
+            ck_assert_int_eq(nb->nb[k], ref->nb[k]);
+            ck_assert(freesasa_nb_xyd(nb, k) == ref->xyd[k]);
+            ck_assert(freesasa_nb_xd(nb, k) == ref->xd[k]);
+            ck_assert(freesasa_nb_yd(nb, k) == ref->yd[k]);
+        }
+        freesasa_nb_free(nb);
+
+        // single precision, the distances are rounded
+        for (int half = 0; half <= 1; ++half) {
+            nb = freesasa_nb_new_storage(coord, r, n_threads, half ? NB_HALF : NB_FULL, 1);
+            ck_assert_ptr_ne(nb, NULL);
+            ck_assert_int_eq(nb->storage, half ? NB_HALF : NB_FULL);
+            ck_assert_ptr_eq(nb->xyd, NULL);
+            ck_assert_ptr_ne(nb->xydf, NULL);
+            ck_assert(memcmp(nb->offset, ref->offset, sizeof(int)*(n+1)) == 0);
+            for (int k = 0; k < ref->offset[n]; ++k) {
+                ck_assert_int_eq(nb->nb[k], ref->nb[k]);
+                ck_assert(freesasa_nb_xyd(nb, k) == (float)ref->xyd[k]);
+                ck_assert(freesasa_nb_xd(nb, k) == (float)ref->xd[k]);
+                ck_assert(freesasa_nb_yd(nb, k) == (float)ref->yd[k]);
+            }
+            freesasa_nb_free(nb);
+        }
+
+        nb = freesasa_nb_new_storage(coord, r, n_threads, NB_INDICES, 0);
+        ck_assert_ptr_ne(nb, NULL);
+        ck_assert_ptr_eq(nb->xyd, NULL);
+        ck_assert_ptr_eq(nb->xydf, NULL);
+        ck_assert_ptr_eq(nb->pair, NULL);
+        ck_assert(memcmp(nb->offset, ref->offset, sizeof(int)*(n+1)) == 0);
+        ck_assert(memcmp(nb->nb, ref->nb, sizeof(int)*ref->offset[n]) == 0);
+        freesasa_nb_free(nb);
+    }
+
+    // sorting moves the references to the pairs with the neighbors
+    nb = freesasa_nb_new_storage(coord, r, 1, NB_HALF, 0);
+    ck_assert_int_eq(freesasa_nb_sort(nb, coord, r), FREESASA_SUCCESS);
+    v = freesasa_coord_all(coord);
+    for (int i = 0; i < n; ++i) {
+        for (int o = nb->offset[i]; o < nb->offset[i+1]; ++o) {
+            const int j = nb->nb[o];
+            ck_assert(float_eq(freesasa_nb_xd(nb, o), v[3*j] - v[3*i], 1e-10));
+            ck_assert(float_eq(freesasa_nb_yd(nb, o), v[3*j+1] - v[3*i+1], 1e-10));
+        }
+    }
+    freesasa_nb_free(nb);
+
+    freesasa_nb_free(ref);
+    freesasa_coord_free(coord);
+    freesasa_structure_free(st);
+    free(r);
+}
+END_TEST
+
+struct search_check {
+    nb_search *s;
+    const nb_list *ref;
+    const double *v;
+    int *ok; // 1 if the neighbors of atom i are correct, 0 if not, -1 if not processed
+};
+
+static void
+search_check_atom(void *data,
+                  int t,
+                  int i)
+{
+    struct search_check *sc = data;
+    const nb_list *nb = freesasa_nb_search_list(sc->s, t);
+    const double *v = sc->v;
+    int ok = sc->ok[i] == -1 && nb->nn[i] == sc->ref->nn[i] && nb->offset[i] == 0;
+    for (int k = 0; ok && k < nb->nn[i]; ++k) {
+        const int j = nb->nb[k];
+        ok = freesasa_nb_contact(sc->ref, i, j) &&
+            float_eq(nb->xd[k], v[3*j] - v[3*i], 1e-10) &&
+            float_eq(nb->yd[k], v[3*j+1] - v[3*i+1], 1e-10);
+    }
+    sc->ok[i] = ok;
+}
+
+START_TEST (test_search)
+{
+    // the neighbors found one atom at a time should be the same as in
+    // the full list, each atom should be processed once
+    FILE *pdb = fopen(DATADIR "3bzd_trimmed.pdb","r");
+    freesasa_structure *st = freesasa_structure_from_pdb(pdb, NULL, 0);
+    const coord_t *coord = freesasa_structure_xyz(st);
+    const int n = freesasa_structure_n(st);
+    double *r = malloc(sizeof(double)*n);
+    int *ok = malloc(sizeof(int)*n);
+    struct search_check sc;
+
+    fclose(pdb);
+    for (int i = 0; i < n; ++i) r[i] = freesasa_structure_radius(st)[i] + 1.4;
+    sc.ref = freesasa_nb_new(coord, r, 1);
+    sc.v = freesasa_coord_all(coord);
+    sc.ok = ok;
+    for (int n_threads = 1; n_threads <= 3; n_threads += 2) {
+        sc.s = freesasa_nb_search_new(coord, r, n_threads, NB_FULL);
+        ck_assert_ptr_ne(sc.s, NULL);
+        for (int i = 0; i < n; ++i) ok[i] = -1;
+        ck_assert_int_eq(freesasa_nb_search_run(sc.s, search_check_atom, &sc), FREESASA_SUCCESS);
+        for (int i = 0; i < n; ++i) ck_assert_int_eq(ok[i], 1);
+        freesasa_nb_search_free(sc.s);
+    }
+
+    freesasa_nb_free((nb_list*) sc.ref);
+    freesasa_structure_free(st);
+    free(r);
+    free(ok);
+}
+END_TEST
+
 extern TCase * test_nb_static();
 
 Suite* nb_suite() {
@@ -49,7 +381,14 @@ Suite* nb_suite() {
 
     TCase *tc_nb = tcase_create("Basic");
     tcase_add_test(tc_nb,test_nb);
+    tcase_add_test(tc_nb,test_nb_1ubq);
     tcase_add_test(tc_nb,test_memerr);
+    tcase_add_test(tc_nb,test_buried);
+    tcase_add_test(tc_nb,test_buried_1ubq);
+    tcase_add_test(tc_nb,test_sort);
+    tcase_add_test(tc_nb,test_threads);
+    tcase_add_test(tc_nb,test_storage);
+    tcase_add_test(tc_nb,test_search);
 
     TCase *tc_static = test_nb_static();
     